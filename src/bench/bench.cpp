@@ -0,0 +1,136 @@
+// Copyright (c) 2015 The RenosCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <new>
+
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include <boost/foreach.hpp>
+
+// Every operator new in the process is counted, so each benchmark can report
+// how many allocations one iteration makes as well as how long it takes.
+static volatile uint64_t nAllocations = 0;
+
+#if __cplusplus >= 201103L
+#define BENCH_THROW_BAD_ALLOC
+#else
+#define BENCH_THROW_BAD_ALLOC throw(std::bad_alloc)
+#endif
+
+static void* CountedAlloc(size_t nSize)
+{
+    __sync_fetch_and_add(&nAllocations, 1);
+    void* p = malloc(nSize ? nSize : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t nSize) BENCH_THROW_BAD_ALLOC
+{
+    return CountedAlloc(nSize);
+}
+
+void* operator new[](size_t nSize) BENCH_THROW_BAD_ALLOC
+{
+    return CountedAlloc(nSize);
+}
+
+void operator delete(void* p) throw()
+{
+    free(p);
+}
+
+void operator delete[](void* p) throw()
+{
+    free(p);
+}
+
+uint64_t benchmark::GetAllocations()
+{
+    return __sync_fetch_and_add(&nAllocations, 0);
+}
+
+static double gettimedouble()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_usec * 0.000001 + tv.tv_sec;
+}
+
+benchmark::State::State(const std::string& _name, double _maxElapsed) :
+    name(_name), maxElapsed(_maxElapsed), beginTime(0), lastTime(0), minTime(1e9), maxTime(0), count(0), timeCheckCount(1), beginAllocations(0)
+{
+}
+
+bool benchmark::State::KeepRunning()
+{
+    double now;
+    if (count == 0)
+    {
+        beginAllocations = GetAllocations();
+        beginTime = now = gettimedouble();
+    }
+    else
+    {
+        // Only look at the clock every timeCheckCount iterations, so
+        // benchmarks that run very quickly aren't dominated by gettimeofday
+        if ((count + 1) % timeCheckCount != 0)
+        {
+            ++count;
+            return true;
+        }
+        now = gettimedouble();
+        double elapsedOne = (now - lastTime) / timeCheckCount;
+        if (elapsedOne < minTime) minTime = elapsedOne;
+        if (elapsedOne > maxTime) maxTime = elapsedOne;
+        if (elapsedOne * timeCheckCount < maxElapsed / 16) timeCheckCount *= 2;
+    }
+    lastTime = now;
+    ++count;
+
+    if (now - beginTime < maxElapsed)
+        return true;
+
+    --count;
+    if (count == 0)
+        minTime = maxTime = now - beginTime;
+
+    uint64_t nAllocated = GetAllocations() - beginAllocations;
+    std::cout << std::fixed << std::setprecision(6) << name << "," << count << "," << minTime << "," << maxTime << ","
+              << (now - beginTime) / std::max(count, (uint64_t)1) << ","
+              << std::setprecision(1) << (double)nAllocated / std::max(count, (uint64_t)1) << "\n";
+    return false;
+}
+
+benchmark::BenchRunner::BenchmarkMap& benchmark::BenchRunner::benchmarks()
+{
+    // Constructed on first use, registrations run during static initialisation
+    static BenchmarkMap benchmarks_map;
+    return benchmarks_map;
+}
+
+benchmark::BenchRunner::BenchRunner(const std::string& name, benchmark::BenchFunction func)
+{
+    benchmarks().insert(std::make_pair(name, func));
+}
+
+void benchmark::BenchRunner::RunAll(const std::string& strFilter, double dElapsedTimeForOne)
+{
+    std::cout << "#Benchmark,count,min(s),max(s),average(s),allocations per iteration\n";
+
+    BOOST_FOREACH(const BenchmarkMap::value_type& p, benchmarks())
+    {
+        if (p.first.find(strFilter) == std::string::npos)
+            continue;
+        State state(p.first, dElapsedTimeForOne);
+        p.second(state);
+    }
+}
@@ -0,0 +1,74 @@
+// Copyright (c) 2015 The RenosCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BENCH_BENCH_H
+#define BENCH_BENCH_H
+
+#include <map>
+#include <string>
+
+#include <stdint.h>
+
+#include <boost/function.hpp>
+#include <boost/preprocessor/cat.hpp>
+#include <boost/preprocessor/stringize.hpp>
+
+// Simple micro-benchmarking framework, run by bench_renos.
+//
+// Usage:
+//
+// static void CODE_TO_TIME(benchmark::State& state)
+// {
+//     ... do any setup needed...
+//     while (state.KeepRunning())
+//     {
+//         ... do stuff you want to time...
+//     }
+//     ... do any cleanup needed...
+// }
+//
+// BENCHMARK(CODE_TO_TIME);
+
+namespace benchmark {
+
+    /** Number of operator new calls the process made so far */
+    uint64_t GetAllocations();
+
+    class State
+    {
+        std::string name;
+        double maxElapsed;
+        double beginTime;
+        double lastTime, minTime, maxTime;
+        uint64_t count;
+        uint64_t timeCheckCount;
+        uint64_t beginAllocations;
+    public:
+        State(const std::string& _name, double _maxElapsed);
+
+        /** True while the benchmark should run another iteration. Prints
+         *  the result when it returns false. */
+        bool KeepRunning();
+    };
+
+    typedef boost::function<void(State&)> BenchFunction;
+
+    class BenchRunner
+    {
+        typedef std::map<std::string, BenchFunction> BenchmarkMap;
+        static BenchmarkMap& benchmarks();
+
+    public:
+        BenchRunner(const std::string& name, BenchFunction func);
+
+        /** Run the benchmarks whose name contains strFilter, each for
+         *  about dElapsedTimeForOne seconds */
+        static void RunAll(const std::string& strFilter, double dElapsedTimeForOne = 1.0);
+    };
+}
+
+// BENCHMARK(foo) expands to:  benchmark::BenchRunner bench_11foo("foo", foo);
+#define BENCHMARK(n) \
+    benchmark::BenchRunner BOOST_PP_CAT(bench_, BOOST_PP_CAT(__LINE__, n))(BOOST_PP_STRINGIZE(n), n);
+
+#endif // BENCH_BENCH_H
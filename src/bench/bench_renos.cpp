@@ -0,0 +1,31 @@
+// Copyright (c) 2015 The RenosCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "hash.h"
+#include "hashblock.h"
+#include "util.h"
+
+#include <stdio.h>
+
+#include <boost/filesystem.hpp>
+
+// bench_renos [filter]: runs every benchmark whose name contains filter, or
+// all of them, and prints one comma separated line per benchmark.
+int main(int argc, char* argv[])
+{
+    std::string strSHA256 = SHA256AutoDetect();
+    printf("# %s X11, %s SHA256\n", HashX11Implementation(), strSHA256.c_str());
+
+    // Benchmarks that open databases or write the log get a throwaway data directory
+    boost::filesystem::path pathTemp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("bench_renos_%%%%%%%%");
+    boost::filesystem::create_directories(pathTemp);
+    mapArgs["-datadir"] = pathTemp.string();
+
+    benchmark::BenchRunner::RunAll(argc > 1 ? argv[1] : "");
+
+    boost::filesystem::remove_all(pathTemp);
+    return 0;
+}
@@ -0,0 +1,113 @@
+// Copyright (c) 2015 The RenosCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "key.h"
+#include "keystore.h"
+#include "main.h"
+#include "script.h"
+#include "txdb.h"
+
+#include <stdio.h>
+
+using namespace std;
+
+// No mainnet blocks ship with the tree, so these replay a block of
+// nTx pay-to-pubkey-hash transactions, each spending two outputs of earlier
+// transactions, with the previous transactions already fetched as
+// ConnectBlock gets them from FetchInputs.
+struct CSpendBlock
+{
+    vector<CTransaction> vtx;
+    vector<MapPrevTx> vInputs;
+
+    CSpendBlock(unsigned int nTx)
+    {
+        CBasicKeyStore keystore;
+        CKey key;
+        key.MakeNewKey(true);
+        keystore.AddKey(key);
+        CScript scriptPubKey;
+        scriptPubKey.SetDestination(key.GetPubKey().GetID());
+
+        for (unsigned int i = 0; i < nTx; i++)
+        {
+            CTransaction txPrev;
+            txPrev.vin.resize(1);
+            txPrev.vin[0].prevout = COutPoint(GetRandHash(), 0);
+            txPrev.vout.resize(2);
+            for (int n = 0; n < 2; n++)
+            {
+                txPrev.vout[n].nValue = 10 * COIN;
+                txPrev.vout[n].scriptPubKey = scriptPubKey;
+            }
+
+            CTransaction tx;
+            tx.vin.resize(2);
+            tx.vout.resize(1);
+            tx.vout[0].nValue = 19 * COIN;
+            tx.vout[0].scriptPubKey = scriptPubKey;
+            for (int n = 0; n < 2; n++)
+            {
+                tx.vin[n].prevout = COutPoint(txPrev.GetHash(), n);
+                SignSignature(keystore, txPrev, tx, n);
+            }
+            tx.CacheHash();
+
+            MapPrevTx inputs;
+            inputs[txPrev.GetHash()] = make_pair(CTxIndex(CDiskTxPos(1, 1, i), txPrev.vout.size()), txPrev);
+            vtx.push_back(tx);
+            vInputs.push_back(inputs);
+        }
+    }
+};
+
+// Checks and spends the inputs of every transaction in the block. The
+// signatures are in the signature cache after the first iteration, so this is
+// the cost of the previous output path itself: look at the allocations column.
+static void ConnectInputsBlock(benchmark::State& state)
+{
+    CSpendBlock block(100);
+    CTxDB txdb("cr+");
+    while (state.KeepRunning())
+    {
+        map<uint256, CTxIndex> mapTestPool;
+        for (unsigned int i = 0; i < block.vtx.size(); i++)
+        {
+            if (!block.vtx[i].ConnectInputs(txdb, block.vInputs[i], mapTestPool, CDiskTxPos(1, 1, i), NULL, false, false))
+            {
+                printf("# ConnectInputs failed\n");
+                return;
+            }
+        }
+    }
+}
+
+// One input script with its signature in the signature cache, and the
+// ECDSA verification a cache miss costs on top of it
+static void VerifySignatureCached(benchmark::State& state)
+{
+    CSpendBlock block(1);
+    const CTransaction& txPrev = block.vInputs[0].begin()->second.second;
+    VerifySignature(txPrev, block.vtx[0], 0, STANDARD_SCRIPT_VERIFY_FLAGS, 0);
+    while (state.KeepRunning())
+        VerifySignature(txPrev, block.vtx[0], 0, STANDARD_SCRIPT_VERIFY_FLAGS, 0);
+}
+
+static void VerifySignatureECDSA(benchmark::State& state)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    uint256 hash = GetRandHash();
+    vector<unsigned char> vchSig;
+    key.Sign(hash, vchSig);
+    while (state.KeepRunning())
+        pubkey.Verify(hash, vchSig);
+}
+
+BENCHMARK(ConnectInputsBlock);
+BENCHMARK(VerifySignatureCached);
+BENCHMARK(VerifySignatureECDSA);
@@ -0,0 +1,36 @@
+// Copyright (c) 2015 The RenosCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "hashblock.h"
+
+#include <string.h>
+
+// X11 of block headers, with the stages selected for this CPU and with the
+// portable sphlib code only
+static void X11Header(benchmark::State& state)
+{
+    unsigned char header[80];
+    memset(header, 0, sizeof(header));
+    while (state.KeepRunning())
+    {
+        uint256 hash = HashX11(header, sizeof(header));
+        memcpy(header, &hash, 4);
+    }
+}
+
+static void X11HeaderGeneric(benchmark::State& state)
+{
+    unsigned char header[80];
+    memset(header, 0, sizeof(header));
+    while (state.KeepRunning())
+    {
+        uint256 hash = HashX11Generic(header, sizeof(header));
+        memcpy(header, &hash, 4);
+    }
+}
+
+BENCHMARK(X11Header);
+BENCHMARK(X11HeaderGeneric);
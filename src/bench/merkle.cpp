@@ -0,0 +1,76 @@
+// Copyright (c) 2015 The RenosCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "main.h"
+
+using namespace std;
+
+// No mainnet blocks ship with the tree, so these use a block as large as the
+// network accepts, filled with one input, two output transactions.
+static CBlock LargestBlock()
+{
+    CBlock block;
+    unsigned int nSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+    while (nSize < MAX_BLOCK_SIZE - 1000)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), GetRand(4));
+        tx.vin[0].scriptSig = CScript() << vector<unsigned char>(72, 1) << vector<unsigned char>(33, 2);
+        tx.vout.resize(2);
+        for (int i = 0; i < 2; i++)
+        {
+            tx.vout[i].nValue = GetRand(100 * COIN);
+            tx.vout[i].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20, i) << OP_EQUALVERIFY << OP_CHECKSIG;
+        }
+        block.vtx.push_back(tx);
+        nSize += ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    }
+    return block;
+}
+
+// The merkle tree as it was built before the levels were hashed in batches
+static void MerkleRootPairwise(benchmark::State& state)
+{
+    CBlock block = LargestBlock();
+    while (state.KeepRunning())
+    {
+        vector<uint256> vTree;
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            vTree.push_back(tx.GetHash());
+        int j = 0;
+        for (int nSize = block.vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+        {
+            for (int i = 0; i < nSize; i += 2)
+            {
+                int i2 = std::min(i+1, nSize-1);
+                vTree.push_back(Hash(BEGIN(vTree[j+i]),  END(vTree[j+i]),
+                                     BEGIN(vTree[j+i2]), END(vTree[j+i2])));
+            }
+            j += nSize;
+        }
+    }
+}
+
+static void MerkleRootBatched(benchmark::State& state)
+{
+    CBlock block = LargestBlock();
+    while (state.KeepRunning())
+        block.BuildMerkleTree();
+}
+
+// A block received from a peer, whose transaction hashes are cached
+static void MerkleRootBatchedCachedTxids(benchmark::State& state)
+{
+    CBlock block = LargestBlock();
+    block.CacheTxHashes();
+    while (state.KeepRunning())
+        block.BuildMerkleTree();
+}
+
+BENCHMARK(MerkleRootPairwise);
+BENCHMARK(MerkleRootBatched);
+BENCHMARK(MerkleRootBatchedCachedTxids);
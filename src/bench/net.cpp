@@ -0,0 +1,157 @@
+// Copyright (c) 2015 The RenosCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "net.h"
+#include "util.h"
+
+#include <algorithm>
+
+#include <string.h>
+
+#include <boost/thread.hpp>
+
+#ifndef WIN32
+#include <sys/resource.h>
+#endif
+
+using namespace std;
+
+#ifndef WIN32
+static SOCKET ConnectLoopback(unsigned short nPort)
+{
+    SOCKET hSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (hSocket == INVALID_SOCKET)
+        return INVALID_SOCKET;
+    struct sockaddr_in sockaddr;
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_port = htons(nPort);
+    sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(hSocket, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) == SOCKET_ERROR)
+    {
+        closesocket(hSocket);
+        return INVALID_SOCKET;
+    }
+    return hSocket;
+}
+
+static bool WaitForNodes(unsigned int nNodes)
+{
+    for (int i = 0; i < 60000; i++)
+    {
+        {
+            LOCK(cs_vNodes);
+            if (vNodes.size() == nNodes)
+                return true;
+        }
+        MilliSleep(1);
+    }
+    return false;
+}
+
+// The node the socket handler made for our end of the connection
+static CNode* FindPeerNode(SOCKET hSocket)
+{
+    struct sockaddr_in sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    if (getsockname(hSocket, (struct sockaddr*)&sockaddr, &len) == SOCKET_ERROR)
+        return NULL;
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes)
+        if (pnode->addr.GetPort() == ntohs(sockaddr.sin_port))
+            return pnode;
+    return NULL;
+}
+
+static uint64_t GetRecvBytes(CNode* pnode)
+{
+    LOCK(pnode->cs_vRecvMsg);
+    return pnode->nRecvBytes;
+}
+
+// One message at a time from idle loopback peers all over the set, until the
+// socket handler has received it. Both ends of every connection live in this
+// process, so select() runs out of descriptors at about FD_SETSIZE / 2 peers.
+static void SocketHandler(benchmark::State& state, const char* pszMode, unsigned int nPeers)
+{
+    static unsigned short nPort = 0;
+
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    if (2 * nPeers + 64 > limit.rlim_cur || (strcmp(pszMode, "select") == 0 && 2 * nPeers + 64 > FD_SETSIZE))
+    {
+        printf("# %s with %u peers skipped, not enough descriptors\n", pszMode, nPeers);
+        return;
+    }
+
+    if (nPort == 0)
+    {
+        nPort = 20000 + GetRand(20000);
+        if (!BindListenPort(CService("127.0.0.1", nPort)))
+        {
+            printf("# can't bind port %u\n", nPort);
+            return;
+        }
+    }
+    mapArgs["-maxconnections"] = "100000";
+    mapArgs["-socketevents"] = pszMode;
+    InitSocketEvents();
+    boost::thread threadSocketHandler(&ThreadSocketHandler);
+
+    vector<SOCKET> vhSocket;
+    for (unsigned int i = 0; i < nPeers; i++)
+    {
+        SOCKET hSocket = ConnectLoopback(nPort);
+        if (hSocket == INVALID_SOCKET)
+            break;
+        vhSocket.push_back(hSocket);
+    }
+
+    vector<CNode*> vPeerNode;
+    if (vhSocket.size() == nPeers && WaitForNodes(nPeers))
+        BOOST_FOREACH(SOCKET hSocket, vhSocket)
+            vPeerNode.push_back(FindPeerNode(hSocket));
+
+    if (vPeerNode.size() == nPeers && count(vPeerNode.begin(), vPeerNode.end(), (CNode*)NULL) == 0)
+    {
+        CDataStream ssMessage(SER_NETWORK, PROTOCOL_VERSION);
+        ssMessage << CMessageHeader("ping", 0);
+
+        unsigned int nNext = 0;
+        while (state.KeepRunning())
+        {
+            unsigned int nPeer = (nNext++ * 7919) % nPeers;
+            uint64_t nRecv = GetRecvBytes(vPeerNode[nPeer]) + ssMessage.size();
+            send(vhSocket[nPeer], &ssMessage[0], ssMessage.size(), MSG_NOSIGNAL);
+            while (GetRecvBytes(vPeerNode[nPeer]) < nRecv)
+                boost::this_thread::yield();
+        }
+    }
+    else
+        printf("# %s with %u peers: could not connect them all\n", pszMode, nPeers);
+
+    BOOST_FOREACH(SOCKET& hSocket, vhSocket)
+        closesocket(hSocket);
+    WaitForNodes(0);
+    threadSocketHandler.interrupt();
+    threadSocketHandler.join();
+}
+
+static void SocketHandlerSelect16(benchmark::State& state) { SocketHandler(state, "select", 16); }
+static void SocketHandlerSelect448(benchmark::State& state) { SocketHandler(state, "select", 448); }
+static void SocketHandlerEpoll16(benchmark::State& state) { SocketHandler(state, "epoll", 16); }
+static void SocketHandlerEpoll448(benchmark::State& state) { SocketHandler(state, "epoll", 448); }
+static void SocketHandlerEpoll4096(benchmark::State& state) { SocketHandler(state, "epoll", 4096); }
+
+BENCHMARK(SocketHandlerSelect16);
+BENCHMARK(SocketHandlerSelect448);
+BENCHMARK(SocketHandlerEpoll16);
+BENCHMARK(SocketHandlerEpoll448);
+BENCHMARK(SocketHandlerEpoll4096);
+#endif
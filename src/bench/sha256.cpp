@@ -0,0 +1,51 @@
+// Copyright (c) 2015 The RenosCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "crypto/sha256.h"
+
+#include <string.h>
+#include <vector>
+
+// Each SHA-256 variant is measured by only allowing the extensions it uses.
+// A CPU without them falls back to the next best code, which the name
+// printed at startup and the numbers will show.
+
+static void SHA256Stream(benchmark::State& state, int nAllow)
+{
+    SHA256AutoDetect(nAllow);
+    std::vector<unsigned char> vData(1 << 20);
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    while (state.KeepRunning())
+        CSHA256().Write(&vData[0], vData.size()).Finalize(hash);
+    SHA256AutoDetect();
+}
+
+// 64 double SHA-256 hashes of 64 bytes, one merkle tree level of 128 nodes
+static void SHA256D64Level(benchmark::State& state, int nAllow)
+{
+    SHA256AutoDetect(nAllow);
+    unsigned char nodes[64 * 64], hashes[32 * 64];
+    memset(nodes, 0, sizeof(nodes));
+    while (state.KeepRunning())
+        SHA256D64(hashes, nodes, 64);
+    SHA256AutoDetect();
+}
+
+static void SHA256_1MB_Generic(benchmark::State& state) { SHA256Stream(state, 0); }
+static void SHA256_1MB_SHANI(benchmark::State& state) { SHA256Stream(state, SHA256_USE_SHANI); }
+static void SHA256D64_64_Generic(benchmark::State& state) { SHA256D64Level(state, 0); }
+static void SHA256D64_64_SSE41(benchmark::State& state) { SHA256D64Level(state, SHA256_USE_SSE41); }
+static void SHA256D64_64_AVX2(benchmark::State& state) { SHA256D64Level(state, SHA256_USE_AVX2); }
+static void SHA256D64_64_SHANI(benchmark::State& state) { SHA256D64Level(state, SHA256_USE_SHANI); }
+static void SHA256D64_64_Best(benchmark::State& state) { SHA256D64Level(state, SHA256_USE_ALL); }
+
+BENCHMARK(SHA256_1MB_Generic);
+BENCHMARK(SHA256_1MB_SHANI);
+BENCHMARK(SHA256D64_64_Generic);
+BENCHMARK(SHA256D64_64_SSE41);
+BENCHMARK(SHA256D64_64_AVX2);
+BENCHMARK(SHA256D64_64_SHANI);
+BENCHMARK(SHA256D64_64_Best);
@@ -0,0 +1,132 @@
+// Copyright (c) 2015 The RenosCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "main.h"
+#include "txdb.h"
+
+#include <leveldb/write_batch.h>
+
+using namespace std;
+
+// The transaction index work ConnectBlock does for a block of nTx
+// transactions inside one TxnBegin/TxnAbort: each transaction spends an
+// output of the one before it, so every ReadTxIndex finds a pending write.
+static vector<CTransaction> ChainedTransactions(unsigned int nTx)
+{
+    vector<CTransaction> vtx(nTx);
+    uint256 hashPrev = GetRandHash();
+    for (unsigned int i = 0; i < nTx; i++)
+    {
+        vtx[i].vin.resize(1);
+        vtx[i].vin[0].prevout = COutPoint(hashPrev, 0);
+        vtx[i].vout.resize(2);
+        vtx[i].vout[0].nValue = 1000;
+        vtx[i].CacheHash();
+        hashPrev = vtx[i].GetHash();
+    }
+    return vtx;
+}
+
+static void ConnectBlockTxIndex(benchmark::State& state, unsigned int nTx)
+{
+    vector<CTransaction> vtx = ChainedTransactions(nTx);
+    CTxDB txdb("cr+");
+    while (state.KeepRunning())
+    {
+        txdb.TxnBegin();
+        for (unsigned int i = 0; i < nTx; i++)
+        {
+            if (i > 0)
+            {
+                CTxIndex txindex;
+                if (txdb.ReadTxIndex(vtx[i].vin[0].prevout.hash, txindex) && !txindex.vSpent.empty())
+                {
+                    txindex.vSpent[0] = CDiskTxPos(1, 1, i);
+                    txdb.UpdateTxIndex(vtx[i].vin[0].prevout.hash, txindex);
+                }
+            }
+            txdb.AddTxIndex(vtx[i], CDiskTxPos(1, 1, i), 1);
+        }
+        txdb.TxnAbort();
+    }
+}
+
+// The same reads done the way ScanBatch did before the overlay: replaying the
+// whole leveldb::WriteBatch for every lookup
+class CBatchReplay : public leveldb::WriteBatch::Handler
+{
+public:
+    string strKey;
+    string* pstrValue;
+    bool fFound;
+
+    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value)
+    {
+        if (key.ToString() == strKey)
+        {
+            fFound = true;
+            *pstrValue = value.ToString();
+        }
+    }
+    virtual void Delete(const leveldb::Slice& key)
+    {
+        if (key.ToString() == strKey)
+            fFound = false;
+    }
+};
+
+static void ConnectBlockTxIndexReplayed(benchmark::State& state, unsigned int nTx)
+{
+    vector<CTransaction> vtx = ChainedTransactions(nTx);
+    while (state.KeepRunning())
+    {
+        leveldb::WriteBatch batch;
+        for (unsigned int i = 0; i < nTx; i++)
+        {
+            CTxIndex txindex(CDiskTxPos(1, 1, i), vtx[i].vout.size());
+            if (i > 0)
+            {
+                CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+                ssKey << make_pair(string("tx"), vtx[i].vin[0].prevout.hash);
+                string strValue;
+                CBatchReplay replay;
+                replay.strKey = ssKey.str();
+                replay.pstrValue = &strValue;
+                replay.fFound = false;
+                batch.Iterate(&replay);
+                if (replay.fFound)
+                {
+                    CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+                    CTxIndex txindexPrev;
+                    ssValue >> txindexPrev;
+                    txindexPrev.vSpent[0] = CDiskTxPos(1, 1, i);
+                    CDataStream ssPrev(SER_DISK, CLIENT_VERSION);
+                    ssPrev << txindexPrev;
+                    batch.Put(ssKey.str(), ssPrev.str());
+                }
+            }
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            ssKey << make_pair(string("tx"), vtx[i].GetHash());
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            ssValue << txindex;
+            batch.Put(ssKey.str(), ssValue.str());
+        }
+    }
+}
+
+static void ConnectBlockTxIndex_100(benchmark::State& state) { ConnectBlockTxIndex(state, 100); }
+static void ConnectBlockTxIndex_1000(benchmark::State& state) { ConnectBlockTxIndex(state, 1000); }
+static void ConnectBlockTxIndex_5000(benchmark::State& state) { ConnectBlockTxIndex(state, 5000); }
+static void ConnectBlockTxIndexReplayed_100(benchmark::State& state) { ConnectBlockTxIndexReplayed(state, 100); }
+static void ConnectBlockTxIndexReplayed_1000(benchmark::State& state) { ConnectBlockTxIndexReplayed(state, 1000); }
+static void ConnectBlockTxIndexReplayed_5000(benchmark::State& state) { ConnectBlockTxIndexReplayed(state, 5000); }
+
+BENCHMARK(ConnectBlockTxIndex_100);
+BENCHMARK(ConnectBlockTxIndex_1000);
+BENCHMARK(ConnectBlockTxIndex_5000);
+BENCHMARK(ConnectBlockTxIndexReplayed_100);
+BENCHMARK(ConnectBlockTxIndexReplayed_1000);
+BENCHMARK(ConnectBlockTxIndexReplayed_5000);
@@ -17,6 +17,7 @@
 #else
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/fcntl.h>
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -28,6 +29,11 @@
 typedef u_int SOCKET;
 #endif
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#define USE_EPOLL
+#endif
+
 
 #ifdef WIN32
 #define MSG_NOSIGNAL        0
@@ -62,5 +68,16 @@ inline int myclosesocket(SOCKET& hSocket)
 }
 #define closesocket(s)      myclosesocket(s)
 
+// select() can only watch sockets below FD_SETSIZE, except on Windows where
+// FD_SETSIZE limits the number of sockets instead
+inline bool IsSelectableSocket(SOCKET hSocket)
+{
+#ifdef WIN32
+    return true;
+#else
+    return hSocket < FD_SETSIZE;
+#endif
+}
+
 
 #endif
@@ -8,6 +8,16 @@
 
 #include <string.h>
 
+// The SHA-NI, AVX2 and SSE4.1 code below is compiled for its instruction set
+// with function attributes and only called after cpuid said the CPU has it,
+// like the X11 stages in hashblock.cpp.
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define USE_SHA256_SIMD 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 // Internal implementation code.
 namespace
 {
@@ -127,7 +137,234 @@ void Transform(uint32_t* s, const unsigned char* chunk)
     s[7] += h;
 }
 
+/** Perform a number of SHA-256 transformations, processing consecutive 64-byte chunks. */
+void TransformBlocks(uint32_t* s, const unsigned char* chunk, size_t blocks)
+{
+    while (blocks--) {
+        Transform(s, chunk);
+        chunk += 64;
+    }
+}
+
+/** The second block of the SHA-256 of any 64 byte message. */
+const unsigned char pad64[64] = {
+    0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02, 0x00
+};
+
+typedef void (*TransformType)(uint32_t*, const unsigned char*, size_t);
+typedef void (*TransformD64Type)(unsigned char*, const unsigned char*);
+
+/** Double SHA-256 of one 64 byte input with the given block transform. */
+template<TransformType tr>
+void TransformD64(unsigned char* out, const unsigned char* in)
+{
+    uint32_t s[8];
+    unsigned char buf[64];
+
+    Initialize(s);
+    tr(s, in, 1);
+    tr(s, pad64, 1);
+
+    // The 32 byte digest padded to one block
+    for (int i = 0; i < 8; i++)
+        WriteBE32(buf + 4 * i, s[i]);
+    memset(buf + 32, 0, 32);
+    buf[32] = 0x80;
+    buf[62] = 0x01;
+
+    Initialize(s);
+    tr(s, buf, 1);
+    for (int i = 0; i < 8; i++)
+        WriteBE32(out + 4 * i, s[i]);
+}
+
+#ifdef USE_SHA256_SIMD
+
+const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHA256_SHANI_TARGET __attribute__((target("sha,sse4.1")))
+#define SHA256_SSE41_TARGET __attribute__((target("sse4.1")))
+#define SHA256_AVX2_TARGET __attribute__((target("avx2")))
+
+// SHA-NI block transform. The sha256rnds2 instruction keeps the state as
+// ABEF and CDGH vectors and does two rounds per call, sha256msg1/msg2 extend
+// the message schedule four words at a time.
+SHA256_SHANI_TARGET void TransformBlocks_SHANI(uint32_t* s, const unsigned char* chunk, size_t blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // ABCD EFGH -> ABEF CDGH
+    __m128i t0 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)s), 0xB1);
+    __m128i t1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(s + 4)), 0x1B);
+    __m128i s0 = _mm_alignr_epi8(t0, t1, 8);
+    __m128i s1 = _mm_blend_epi16(t1, t0, 0xF0);
+
+    while (blocks--) {
+        const __m128i so0 = s0, so1 = s1;
+        __m128i w[4];
+        for (int i = 0; i < 4; i++)
+            w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(chunk + 16 * i)), mask);
+
+        for (int g = 0; g < 16; g++) {
+            // w[g & 3] holds words 4g-16..4g-13 and is replaced by 4g..4g+3
+            if (g >= 4)
+                w[g & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(w[g & 3], w[(g + 1) & 3]),
+                                                              _mm_alignr_epi8(w[(g + 3) & 3], w[(g + 2) & 3], 4)),
+                                                w[(g + 3) & 3]);
+            const __m128i msg = _mm_add_epi32(w[g & 3], _mm_loadu_si128((const __m128i*)(K + 4 * g)));
+            s1 = _mm_sha256rnds2_epu32(s1, s0, msg);
+            s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(msg, 0x0E));
+        }
+
+        s0 = _mm_add_epi32(s0, so0);
+        s1 = _mm_add_epi32(s1, so1);
+        chunk += 64;
+    }
+
+    // ABEF CDGH -> ABCD EFGH
+    t0 = _mm_shuffle_epi32(s0, 0x1B);
+    t1 = _mm_shuffle_epi32(s1, 0xB1);
+    _mm_storeu_si128((__m128i*)s, _mm_blend_epi16(t0, t1, 0xF0));
+    _mm_storeu_si128((__m128i*)(s + 4), _mm_alignr_epi8(t1, t0, 8));
+}
+
+// Multi-buffer transforms: lane i of every vector belongs to input i, so
+// four (SSE4.1) or eight (AVX2) independent 64 byte inputs are hashed with
+// the same instructions the portable code uses for one. Only used for
+// double SHA-256 of 64 byte inputs, where many hashes are wanted at once.
+#define SHA256_MULTIWAY(V, TARGET, SET1, ADD, XOR, AND, OR, SRLI, SLLI)                                  \
+TARGET static inline V Ch(V x, V y, V z) { return XOR(z, AND(x, XOR(y, z))); }                             \
+TARGET static inline V Maj(V x, V y, V z) { return OR(AND(x, y), AND(z, OR(x, y))); }                      \
+TARGET static inline V Rotr(V x, int n) { return OR(SRLI(x, n), SLLI(x, 32 - n)); }                        \
+TARGET static inline V Sigma0(V x) { return XOR(XOR(Rotr(x, 2), Rotr(x, 13)), Rotr(x, 22)); }             \
+TARGET static inline V Sigma1(V x) { return XOR(XOR(Rotr(x, 6), Rotr(x, 11)), Rotr(x, 25)); }             \
+TARGET static inline V sigma0(V x) { return XOR(XOR(Rotr(x, 7), Rotr(x, 18)), SRLI(x, 3)); }              \
+TARGET static inline V sigma1(V x) { return XOR(XOR(Rotr(x, 17), Rotr(x, 19)), SRLI(x, 10)); }            \
+                                                                                                            \
+TARGET static inline void Round(V a, V b, V c, V& d, V e, V f, V g, V& h, V kw)                           \
+{                                                                                                           \
+    V t1 = ADD(ADD(ADD(h, Sigma1(e)), Ch(e, f, g)), kw);                                                    \
+    V t2 = ADD(Sigma0(a), Maj(a, b, c));                                                                    \
+    d = ADD(d, t1);                                                                                         \
+    h = ADD(t1, t2);                                                                                        \
+}                                                                                                           \
+                                                                                                            \
+/* One transform of the 16 message words in w, which are overwritten */                                    \
+TARGET static void Compress(V* s, V* w)                                                                     \
+{                                                                                                           \
+    V a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];                      \
+    for (int i = 0; i < 64; i += 16) {                                                                      \
+        if (i > 0)                                                                                          \
+            for (int j = 0; j < 16; j++)                                                                    \
+                w[j] = ADD(ADD(w[j], sigma0(w[(j + 1) & 15])), ADD(w[(j + 9) & 15], sigma1(w[(j + 14) & 15]))); \
+        Round(a, b, c, d, e, f, g, h, ADD(SET1(K[i + 0]), w[0]));                                          \
+        Round(h, a, b, c, d, e, f, g, ADD(SET1(K[i + 1]), w[1]));                                          \
+        Round(g, h, a, b, c, d, e, f, ADD(SET1(K[i + 2]), w[2]));                                          \
+        Round(f, g, h, a, b, c, d, e, ADD(SET1(K[i + 3]), w[3]));                                          \
+        Round(e, f, g, h, a, b, c, d, ADD(SET1(K[i + 4]), w[4]));                                          \
+        Round(d, e, f, g, h, a, b, c, ADD(SET1(K[i + 5]), w[5]));                                          \
+        Round(c, d, e, f, g, h, a, b, ADD(SET1(K[i + 6]), w[6]));                                          \
+        Round(b, c, d, e, f, g, h, a, ADD(SET1(K[i + 7]), w[7]));                                          \
+        Round(a, b, c, d, e, f, g, h, ADD(SET1(K[i + 8]), w[8]));                                          \
+        Round(h, a, b, c, d, e, f, g, ADD(SET1(K[i + 9]), w[9]));                                          \
+        Round(g, h, a, b, c, d, e, f, ADD(SET1(K[i + 10]), w[10]));                                        \
+        Round(f, g, h, a, b, c, d, e, ADD(SET1(K[i + 11]), w[11]));                                        \
+        Round(e, f, g, h, a, b, c, d, ADD(SET1(K[i + 12]), w[12]));                                        \
+        Round(d, e, f, g, h, a, b, c, ADD(SET1(K[i + 13]), w[13]));                                        \
+        Round(c, d, e, f, g, h, a, b, ADD(SET1(K[i + 14]), w[14]));                                        \
+        Round(b, c, d, e, f, g, h, a, ADD(SET1(K[i + 15]), w[15]));                                        \
+    }                                                                                                       \
+    s[0] = ADD(s[0], a); s[1] = ADD(s[1], b); s[2] = ADD(s[2], c); s[3] = ADD(s[3], d);                    \
+    s[4] = ADD(s[4], e); s[5] = ADD(s[5], f); s[6] = ADD(s[6], g); s[7] = ADD(s[7], h);                    \
+}                                                                                                           \
+                                                                                                            \
+TARGET static void Initialize(V* s)                                                                         \
+{                                                                                                           \
+    uint32_t iv[8];                                                                                         \
+    sha256::Initialize(iv);                                                                                 \
+    for (int i = 0; i < 8; i++)                                                                             \
+        s[i] = SET1(iv[i]);                                                                                 \
+}                                                                                                           \
+                                                                                                            \
+/* Double SHA-256 of sizeof(V) / 4 consecutive 64 byte inputs */                                           \
+TARGET static void TransformD64(unsigned char* out, const unsigned char* in)                                \
+{                                                                                                           \
+    const int nWays = sizeof(V) / 4;                                                                        \
+    V s[8], w[16];                                                                                          \
+    uint32_t lanes[sizeof(V) / 4];                                                                          \
+                                                                                                            \
+    Initialize(s);                                                                                          \
+    for (int j = 0; j < 16; j++) {                                                                          \
+        for (int i = 0; i < nWays; i++)                                                                     \
+            lanes[i] = ReadBE32(in + 64 * i + 4 * j);                                                       \
+        w[j] = LOAD(lanes);                                                                                 \
+    }                                                                                                       \
+    Compress(s, w);                                                                                         \
+                                                                                                            \
+    /* Padding block of a 64 byte message */                                                               \
+    for (int j = 0; j < 16; j++)                                                                            \
+        w[j] = SET1(ReadBE32(pad64 + 4 * j));                                                               \
+    Compress(s, w);                                                                                         \
+                                                                                                            \
+    /* The 32 byte digests padded to one block */                                                          \
+    for (int j = 0; j < 8; j++)                                                                             \
+        w[j] = s[j];                                                                                        \
+    w[8] = SET1(0x80000000);                                                                                \
+    for (int j = 9; j < 15; j++)                                                                            \
+        w[j] = SET1(0);                                                                                     \
+    w[15] = SET1(256);                                                                                      \
+    Initialize(s);                                                                                          \
+    Compress(s, w);                                                                                         \
+                                                                                                            \
+    for (int j = 0; j < 8; j++) {                                                                           \
+        STORE(lanes, s[j]);                                                                                 \
+        for (int i = 0; i < nWays; i++)                                                                     \
+            WriteBE32(out + 32 * i + 4 * j, lanes[i]);                                                      \
+    }                                                                                                       \
+}
+
+namespace sse41
+{
+#define LOAD(p) _mm_loadu_si128((const __m128i*)(p))
+#define STORE(p, x) _mm_storeu_si128((__m128i*)(p), x)
+SHA256_MULTIWAY(__m128i, SHA256_SSE41_TARGET, _mm_set1_epi32, _mm_add_epi32, _mm_xor_si128, _mm_and_si128,
+                _mm_or_si128, _mm_srli_epi32, _mm_slli_epi32)
+#undef LOAD
+#undef STORE
+} // namespace sse41
+
+namespace avx2
+{
+#define LOAD(p) _mm256_loadu_si256((const __m256i*)(p))
+#define STORE(p, x) _mm256_storeu_si256((__m256i*)(p), x)
+SHA256_MULTIWAY(__m256i, SHA256_AVX2_TARGET, _mm256_set1_epi32, _mm256_add_epi32, _mm256_xor_si256, _mm256_and_si256,
+                _mm256_or_si256, _mm256_srli_epi32, _mm256_slli_epi32)
+#undef LOAD
+#undef STORE
+} // namespace avx2
+
+#endif // USE_SHA256_SIMD
+
 } // namespace sha256
+
+// Selected by SHA256AutoDetect()
+sha256::TransformType Transform = sha256::TransformBlocks;
+sha256::TransformD64Type TransformD64 = sha256::TransformD64<sha256::TransformBlocks>;
+sha256::TransformD64Type TransformD64_4way = NULL;
+sha256::TransformD64Type TransformD64_8way = NULL;
+
 } // namespace
 
 
@@ -147,14 +384,15 @@ CSHA256& CSHA256::Write(const unsigned char* data, size_t len)
         memcpy(buf + bufsize, data, 64 - bufsize);
         bytes += 64 - bufsize;
         data += 64 - bufsize;
-        sha256::Transform(s, buf);
+        Transform(s, buf, 1);
         bufsize = 0;
     }
-    while (end >= data + 64) {
+    if (end >= data + 64) {
         // Process full chunks directly from the source.
-        sha256::Transform(s, data);
-        bytes += 64;
-        data += 64;
+        size_t blocks = (end - data) / 64;
+        Transform(s, data, blocks);
+        bytes += 64 * blocks;
+        data += 64 * blocks;
     }
     if (end > data) {
         // Fill the buffer with what remains.
@@ -187,3 +425,82 @@ CSHA256& CSHA256::Reset()
     sha256::Initialize(s);
     return *this;
 }
+
+std::string SHA256AutoDetect(int nAllow)
+{
+    std::string ret = "standard";
+    Transform = sha256::TransformBlocks;
+    TransformD64 = sha256::TransformD64<sha256::TransformBlocks>;
+    TransformD64_4way = NULL;
+    TransformD64_8way = NULL;
+
+#ifdef USE_SHA256_SIMD
+    unsigned int eax, ebx, ecx, edx;
+    bool fSSE41 = false, fAVX2 = false, fSHANI = false;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    {
+        fSSE41 = (ecx & bit_SSE4_1);
+        // AVX state must also be enabled by the OS
+        bool fOSAVX = false;
+        if ((ecx & bit_OSXSAVE) && (ecx & bit_AVX))
+        {
+            uint32_t a, d;
+            __asm__ ("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+            fOSAVX = (a & 6) == 6;
+        }
+        if (__get_cpuid_max(0, NULL) >= 7)
+        {
+            __cpuid_count(7, 0, eax, ebx, ecx, edx);
+            fAVX2 = fOSAVX && (ebx & (1 << 5));
+            fSHANI = fSSE41 && (ebx & (1 << 29));
+        }
+    }
+
+    if (fSHANI && (nAllow & SHA256_USE_SHANI))
+    {
+        Transform = sha256::TransformBlocks_SHANI;
+        TransformD64 = sha256::TransformD64<sha256::TransformBlocks_SHANI>;
+        ret = "shani(1way)";
+        // One SHA-NI hash is about as fast as a lane of the multi-buffer code
+        fSSE41 = fAVX2 = false;
+    }
+    if (fSSE41 && (nAllow & SHA256_USE_SSE41))
+    {
+        TransformD64_4way = sha256::sse41::TransformD64;
+        ret += ",sse41(4way)";
+    }
+    if (fAVX2 && (nAllow & SHA256_USE_AVX2))
+    {
+        TransformD64_8way = sha256::avx2::TransformD64;
+        ret += ",avx2(8way)";
+    }
+#endif
+
+    return ret;
+}
+
+void SHA256D64(unsigned char* output, const unsigned char* input, size_t nBlocks)
+{
+    if (TransformD64_8way) {
+        while (nBlocks >= 8) {
+            TransformD64_8way(output, input);
+            output += 256;
+            input += 512;
+            nBlocks -= 8;
+        }
+    }
+    if (TransformD64_4way) {
+        while (nBlocks >= 4) {
+            TransformD64_4way(output, input);
+            output += 128;
+            input += 256;
+            nBlocks -= 4;
+        }
+    }
+    while (nBlocks) {
+        TransformD64(output, input);
+        output += 32;
+        input += 64;
+        --nBlocks;
+    }
+}
@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string>
 
 /** A hasher class for SHA-256. */
 class CSHA256
@@ -25,4 +26,23 @@ public:
     CSHA256& Reset();
 };
 
+/** Instruction set extensions SHA256AutoDetect() may use. */
+enum
+{
+    SHA256_USE_SSE41 = (1 << 0),  // 4 way double SHA-256 of 64 byte inputs
+    SHA256_USE_AVX2  = (1 << 1),  // 8 way double SHA-256 of 64 byte inputs
+    SHA256_USE_SHANI = (1 << 2),  // single block transform
+    SHA256_USE_ALL   = SHA256_USE_SSE41 | SHA256_USE_AVX2 | SHA256_USE_SHANI
+};
+
+/** Select the fastest SHA-256 code the CPU supports, out of the extensions
+ *  allowed by nAllow, and return a description of it. Until this is called
+ *  the portable code is used. Not thread safe: call it before starting
+ *  threads that hash. */
+std::string SHA256AutoDetect(int nAllow = SHA256_USE_ALL);
+
+/** Double SHA-256 of nBlocks consecutive 64 byte inputs, such as pairs of
+ *  merkle tree nodes, writing nBlocks 32 byte hashes to output. */
+void SHA256D64(unsigned char* output, const unsigned char* input, size_t nBlocks);
+
 #endif // BITCOIN_CRYPTO_SHA256_H
@@ -7,32 +7,62 @@
 
 #include "uint256.h"
 #include "serialize.h"
+#include "crypto/sha256.h"
 
 #include <openssl/sha.h>
 #include <openssl/ripemd.h>
 
+/** Double SHA-256 hasher, using whichever SHA-256 code SHA256AutoDetect() selected. */
+class CHash256
+{
+private:
+    CSHA256 sha;
+
+public:
+    static const size_t OUTPUT_SIZE = CSHA256::OUTPUT_SIZE;
+
+    CHash256& Write(const unsigned char* data, size_t len) {
+        sha.Write(data, len);
+        return *this;
+    }
+
+    void Finalize(unsigned char hash[OUTPUT_SIZE]) {
+        unsigned char buf[CSHA256::OUTPUT_SIZE];
+        sha.Finalize(buf);
+        sha.Reset().Write(buf, CSHA256::OUTPUT_SIZE).Finalize(hash);
+    }
+
+    CHash256& Reset() {
+        sha.Reset();
+        return *this;
+    }
+};
+
 template<typename T1>
 inline uint256 Hash(const T1 pbegin, const T1 pend)
 {
     static unsigned char pblank[1];
-    uint256 hash1;
-    SHA256((pbegin == pend ? pblank : (unsigned char*)&pbegin[0]), (pend - pbegin) * sizeof(pbegin[0]), (unsigned char*)&hash1);
-    uint256 hash2;
-    SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
-    return hash2;
+    const unsigned char* pch = (pbegin == pend ? pblank : (const unsigned char*)&pbegin[0]);
+    size_t nSize = (pend - pbegin) * sizeof(pbegin[0]);
+    uint256 hash;
+    if (nSize == 64)
+        SHA256D64((unsigned char*)&hash, pch, 1);
+    else
+        CHash256().Write(pch, nSize).Finalize((unsigned char*)&hash);
+    return hash;
 }
 
 class CHashWriter
 {
 private:
-    SHA256_CTX ctx;
+    CHash256 ctx;
 
 public:
     int nType;
     int nVersion;
 
     void Init() {
-        SHA256_Init(&ctx);
+        ctx.Reset();
     }
 
     CHashWriter(int nTypeIn, int nVersionIn) : nType(nTypeIn), nVersion(nVersionIn) {
@@ -40,17 +70,15 @@ public:
     }
 
     CHashWriter& write(const char *pch, size_t size) {
-        SHA256_Update(&ctx, pch, size);
+        ctx.Write((const unsigned char*)pch, size);
         return (*this);
     }
 
     // invalidates the object
     uint256 GetHash() {
-        uint256 hash1;
-        SHA256_Final((unsigned char*)&hash1, &ctx);
-        uint256 hash2;
-        SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
-        return hash2;
+        uint256 hash;
+        ctx.Finalize((unsigned char*)&hash);
+        return hash;
     }
 
     template<typename T>
@@ -67,15 +95,22 @@ inline uint256 Hash(const T1 p1begin, const T1 p1end,
                     const T2 p2begin, const T2 p2end)
 {
     static unsigned char pblank[1];
-    uint256 hash1;
-    SHA256_CTX ctx;
-    SHA256_Init(&ctx);
-    SHA256_Update(&ctx, (p1begin == p1end ? pblank : (unsigned char*)&p1begin[0]), (p1end - p1begin) * sizeof(p1begin[0]));
-    SHA256_Update(&ctx, (p2begin == p2end ? pblank : (unsigned char*)&p2begin[0]), (p2end - p2begin) * sizeof(p2begin[0]));
-    SHA256_Final((unsigned char*)&hash1, &ctx);
-    uint256 hash2;
-    SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
-    return hash2;
+    const unsigned char* pch1 = (p1begin == p1end ? pblank : (const unsigned char*)&p1begin[0]);
+    const unsigned char* pch2 = (p2begin == p2end ? pblank : (const unsigned char*)&p2begin[0]);
+    size_t nSize1 = (p1end - p1begin) * sizeof(p1begin[0]);
+    size_t nSize2 = (p2end - p2begin) * sizeof(p2begin[0]);
+    uint256 hash;
+    if (nSize1 + nSize2 == 64)
+    {
+        // Merkle tree nodes
+        unsigned char buf[64];
+        memcpy(buf, pch1, nSize1);
+        memcpy(buf + nSize1, pch2, nSize2);
+        SHA256D64((unsigned char*)&hash, buf, 1);
+    }
+    else
+        CHash256().Write(pch1, nSize1).Write(pch2, nSize2).Finalize((unsigned char*)&hash);
+    return hash;
 }
 
 template<typename T1, typename T2, typename T3>
@@ -84,16 +119,12 @@ inline uint256 Hash(const T1 p1begin, const T1 p1end,
                     const T3 p3begin, const T3 p3end)
 {
     static unsigned char pblank[1];
-    uint256 hash1;
-    SHA256_CTX ctx;
-    SHA256_Init(&ctx);
-    SHA256_Update(&ctx, (p1begin == p1end ? pblank : (unsigned char*)&p1begin[0]), (p1end - p1begin) * sizeof(p1begin[0]));
-    SHA256_Update(&ctx, (p2begin == p2end ? pblank : (unsigned char*)&p2begin[0]), (p2end - p2begin) * sizeof(p2begin[0]));
-    SHA256_Update(&ctx, (p3begin == p3end ? pblank : (unsigned char*)&p3begin[0]), (p3end - p3begin) * sizeof(p3begin[0]));
-    SHA256_Final((unsigned char*)&hash1, &ctx);
-    uint256 hash2;
-    SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
-    return hash2;
+    uint256 hash;
+    CHash256().Write((p1begin == p1end ? pblank : (const unsigned char*)&p1begin[0]), (p1end - p1begin) * sizeof(p1begin[0]))
+              .Write((p2begin == p2end ? pblank : (const unsigned char*)&p2begin[0]), (p2end - p2begin) * sizeof(p2begin[0]))
+              .Write((p3begin == p3end ? pblank : (const unsigned char*)&p3begin[0]), (p3end - p3begin) * sizeof(p3begin[0]))
+              .Finalize((unsigned char*)&hash);
+    return hash;
 }
 
 template<typename T>
@@ -109,7 +140,7 @@ inline uint160 Hash160(const T1 pbegin, const T1 pend)
 {
     static unsigned char pblank[1];
     uint256 hash1;
-    SHA256((pbegin == pend ? pblank : (unsigned char*)&pbegin[0]), (pend - pbegin) * sizeof(pbegin[0]), (unsigned char*)&hash1);
+    CSHA256().Write((pbegin == pend ? pblank : (const unsigned char*)&pbegin[0]), (pend - pbegin) * sizeof(pbegin[0])).Finalize((unsigned char*)&hash1);
     uint160 hash2;
     RIPEMD160((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
     return hash2;
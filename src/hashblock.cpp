@@ -0,0 +1,409 @@
+// Copyright (c) 2015 The RenosCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#define GLOBALDEFINED
+#include "hashblock.h"
+
+#include <string.h>
+
+// SSE2 version of the cubehash stage and AES-NI versions of the shavite and
+// echo stages. They are compiled for their instruction set with function
+// attributes and only called after cpuid said the CPU has it, so the rest of
+// the binary keeps running on any x86.
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define USE_X11_SIMD 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+namespace {
+
+struct CX11Init
+{
+    bool fSSE2;
+    bool fAESNI;
+
+    CX11Init()
+    {
+        fillz();
+        fSSE2 = fAESNI = false;
+#ifdef USE_X11_SIMD
+        unsigned int eax, ebx, ecx, edx;
+        if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        {
+            fSSE2 = (edx & bit_SSE2);
+            fAESNI = fSSE2 && (ecx & bit_AES) && (ecx & bit_SSSE3);
+        }
+#endif
+    }
+};
+
+// Filled on first use, which is from static initializers (the genesis block hashes)
+const CX11Init& X11Init()
+{
+    static CX11Init init;
+    return init;
+}
+
+#ifdef USE_X11_SIMD
+
+#define X11_SSE2_TARGET __attribute__((target("sse2")))
+#define X11_AESNI_TARGET __attribute__((target("aes,ssse3")))
+
+// CubeHash 16/32-512, see cubehash_core() and cubehash_close() in cubehash.c,
+// for a 64 byte message. The 32 state words are kept in 8 vectors: x[0..3]
+// hold words 0-15 and x[4..7] words 16-31, so every step of a round is one
+// operation on four words and the word swaps become vector moves and shuffles.
+static const unsigned int pCubehashIV512[32] = {
+    0x2AEA2A61, 0x50F494D4, 0x2D538B8B, 0x4167D83E,
+    0x3FEE2313, 0xC701CF8C, 0xCC39968E, 0x50AC5695,
+    0x4D42C787, 0xA647A8B3, 0x97CF0BEF, 0x825B4537,
+    0xEEF864D2, 0xF22090C4, 0xD0E5CD33, 0xA23911AE,
+    0xFCD398D9, 0x148FE485, 0x1B017BEF, 0xB6444532,
+    0x6A536159, 0x2FF5781C, 0x91FA7934, 0x0DBADEA9,
+    0xD65C8A2B, 0xA5A70E75, 0xB1C62456, 0xBC796576,
+    0x1921C8F7, 0xE7989AF1, 0x7795D246, 0xD43E3B44
+};
+
+#define CUBEHASH_ROTL(x, n) _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - (n)))
+
+X11_SSE2_TARGET static void CubehashRounds_SSE2(__m128i* x, int nRounds)
+{
+    for (int r = 0; r < nRounds; r++)
+    {
+        x[4] = _mm_add_epi32(x[0], x[4]);
+        x[5] = _mm_add_epi32(x[1], x[5]);
+        x[6] = _mm_add_epi32(x[2], x[6]);
+        x[7] = _mm_add_epi32(x[3], x[7]);
+        // Rotate by 7 and swap words 0-7 with 8-15
+        __m128i y0 = CUBEHASH_ROTL(x[2], 7);
+        __m128i y1 = CUBEHASH_ROTL(x[3], 7);
+        __m128i y2 = CUBEHASH_ROTL(x[0], 7);
+        __m128i y3 = CUBEHASH_ROTL(x[1], 7);
+        x[0] = _mm_xor_si128(y0, x[4]);
+        x[1] = _mm_xor_si128(y1, x[5]);
+        x[2] = _mm_xor_si128(y2, x[6]);
+        x[3] = _mm_xor_si128(y3, x[7]);
+        // Swap words 16+i with 16+(i^2)
+        x[4] = _mm_shuffle_epi32(x[4], 0x4e);
+        x[5] = _mm_shuffle_epi32(x[5], 0x4e);
+        x[6] = _mm_shuffle_epi32(x[6], 0x4e);
+        x[7] = _mm_shuffle_epi32(x[7], 0x4e);
+        x[4] = _mm_add_epi32(x[0], x[4]);
+        x[5] = _mm_add_epi32(x[1], x[5]);
+        x[6] = _mm_add_epi32(x[2], x[6]);
+        x[7] = _mm_add_epi32(x[3], x[7]);
+        // Rotate by 11 and swap words i with i^4
+        y0 = CUBEHASH_ROTL(x[1], 11);
+        y1 = CUBEHASH_ROTL(x[0], 11);
+        y2 = CUBEHASH_ROTL(x[3], 11);
+        y3 = CUBEHASH_ROTL(x[2], 11);
+        x[0] = _mm_xor_si128(y0, x[4]);
+        x[1] = _mm_xor_si128(y1, x[5]);
+        x[2] = _mm_xor_si128(y2, x[6]);
+        x[3] = _mm_xor_si128(y3, x[7]);
+        // Swap words 16+i with 16+(i^1)
+        x[4] = _mm_shuffle_epi32(x[4], 0xb1);
+        x[5] = _mm_shuffle_epi32(x[5], 0xb1);
+        x[6] = _mm_shuffle_epi32(x[6], 0xb1);
+        x[7] = _mm_shuffle_epi32(x[7], 0xb1);
+    }
+}
+
+X11_SSE2_TARGET static void Cubehash512_64_SSE2(const unsigned char* pin, unsigned char* pout)
+{
+    __m128i x[8];
+    for (int i = 0; i < 8; i++)
+        x[i] = _mm_loadu_si128((const __m128i*)&pCubehashIV512[4 * i]);
+
+    // Two 32 byte message blocks, then the padding block
+    for (int b = 0; b < 2; b++)
+    {
+        x[0] = _mm_xor_si128(x[0], _mm_loadu_si128((const __m128i*)(pin + 32 * b)));
+        x[1] = _mm_xor_si128(x[1], _mm_loadu_si128((const __m128i*)(pin + 32 * b + 16)));
+        CubehashRounds_SSE2(x, 16);
+    }
+    x[0] = _mm_xor_si128(x[0], _mm_cvtsi32_si128(0x80));
+    CubehashRounds_SSE2(x, 16);
+
+    // Finalization
+    x[7] = _mm_xor_si128(x[7], _mm_set_epi32(1, 0, 0, 0));
+    CubehashRounds_SSE2(x, 160);
+
+    for (int i = 0; i < 4; i++)
+        _mm_storeu_si128((__m128i*)(pout + 16 * i), x[i]);
+}
+
+// SHAvite-3 512, see c512() and shavite_big_close() in shavite.c, for a
+// 64 byte message. All rounds are AES rounds with a zero key.
+static const unsigned int pShaviteIV512[16] = {
+    0x72FCCDD8, 0x79CA4727, 0x128A077B, 0x40D55AEC,
+    0xD1901A06, 0x430AE307, 0xB29F5CD1, 0xDF07FBFC,
+    0x8E45D73D, 0x681AB538, 0xBDE86578, 0xDD577E47,
+    0xE275EADE, 0x502D9FCD, 0xB9357178, 0x022A4B9A
+};
+
+X11_AESNI_TARGET static void Shavite512_64_AESNI(const unsigned char* pin, unsigned char* pout)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    // The message padded to one 128 byte block: 0x80, the bit count (512)
+    // at 110 and the output size in bits (512) at 126
+    unsigned char buf[128];
+    memcpy(buf, pin, 64);
+    memset(buf + 64, 0, 64);
+    buf[64] = 0x80;
+    buf[111] = 0x02;
+    buf[127] = 0x02;
+    const unsigned int count0 = 512, count1 = 0, count2 = 0, count3 = 0;
+
+    // Message expansion, 112 round keys of 128 bits
+    __m128i rk[112];
+    for (int i = 0; i < 8; i++)
+        rk[i] = _mm_loadu_si128((const __m128i*)(buf + 16 * i));
+    int j = 8;
+    while (true)
+    {
+        for (int s = 0; s < 8; s++, j++)
+        {
+            rk[j] = _mm_aesenc_si128(_mm_shuffle_epi32(rk[j - 8], 0x39), rk[j - 1]);
+            if (j == 8)
+                rk[j] = _mm_xor_si128(rk[j], _mm_set_epi32(~count3, count2, count1, count0));
+            else if (j == 41)
+                rk[j] = _mm_xor_si128(rk[j], _mm_set_epi32(~count0, count1, count2, count3));
+            else if (j == 79)
+                rk[j] = _mm_xor_si128(rk[j], _mm_set_epi32(~count1, count0, count3, count2));
+            else if (j == 110)
+                rk[j] = _mm_xor_si128(rk[j], _mm_set_epi32(~count2, count3, count0, count1));
+        }
+        if (j == 112)
+            break;
+        for (int s = 0; s < 8; s++, j++)
+            rk[j] = _mm_xor_si128(rk[j - 8], _mm_alignr_epi8(rk[j - 1], rk[j - 2], 4));
+    }
+
+    const __m128i h0 = _mm_loadu_si128((const __m128i*)&pShaviteIV512[0]);
+    const __m128i h1 = _mm_loadu_si128((const __m128i*)&pShaviteIV512[4]);
+    const __m128i h2 = _mm_loadu_si128((const __m128i*)&pShaviteIV512[8]);
+    const __m128i h3 = _mm_loadu_si128((const __m128i*)&pShaviteIV512[12]);
+    __m128i p0 = h0, p1 = h1, p2 = h2, p3 = h3;
+    for (int r = 0; r < 14; r++)
+    {
+        const __m128i* k = &rk[8 * r];
+        __m128i x = _mm_xor_si128(p1, k[0]);
+        x = _mm_aesenc_si128(x, k[1]);
+        x = _mm_aesenc_si128(x, k[2]);
+        x = _mm_aesenc_si128(x, k[3]);
+        p0 = _mm_xor_si128(p0, _mm_aesenc_si128(x, zero));
+
+        x = _mm_xor_si128(p3, k[4]);
+        x = _mm_aesenc_si128(x, k[5]);
+        x = _mm_aesenc_si128(x, k[6]);
+        x = _mm_aesenc_si128(x, k[7]);
+        p2 = _mm_xor_si128(p2, _mm_aesenc_si128(x, zero));
+
+        __m128i t = p3;
+        p3 = p2;
+        p2 = p1;
+        p1 = p0;
+        p0 = t;
+    }
+    _mm_storeu_si128((__m128i*)(pout +  0), _mm_xor_si128(h0, p0));
+    _mm_storeu_si128((__m128i*)(pout + 16), _mm_xor_si128(h1, p1));
+    _mm_storeu_si128((__m128i*)(pout + 32), _mm_xor_si128(h2, p2));
+    _mm_storeu_si128((__m128i*)(pout + 48), _mm_xor_si128(h3, p3));
+}
+
+// Multiply every byte by 2 in GF(2^8) modulo the AES polynomial
+X11_AESNI_TARGET static inline __m128i EchoMul2(__m128i x)
+{
+    const __m128i mask = _mm_and_si128(_mm_cmpgt_epi8(_mm_setzero_si128(), x), _mm_set1_epi8(0x1b));
+    return _mm_xor_si128(_mm_add_epi8(x, x), mask);
+}
+
+X11_AESNI_TARGET static inline void EchoMixColumn(__m128i* w)
+{
+    const __m128i a = w[0], b = w[1], c = w[2], d = w[3];
+    const __m128i ab = _mm_xor_si128(a, b);
+    const __m128i bc = _mm_xor_si128(b, c);
+    const __m128i cd = _mm_xor_si128(c, d);
+    const __m128i abx = EchoMul2(ab);
+    const __m128i bcx = EchoMul2(bc);
+    const __m128i cdx = EchoMul2(cd);
+    w[0] = _mm_xor_si128(abx, _mm_xor_si128(bc, d));
+    w[1] = _mm_xor_si128(bcx, _mm_xor_si128(a, cd));
+    w[2] = _mm_xor_si128(cdx, _mm_xor_si128(ab, d));
+    w[3] = _mm_xor_si128(_mm_xor_si128(abx, bcx), _mm_xor_si128(cdx, _mm_xor_si128(ab, c)));
+}
+
+// ECHO 512, see COMPRESS_BIG and echo_big_close() in echo.c, for a 64 byte message
+X11_AESNI_TARGET static void Echo512_64_AESNI(const unsigned char* pin, unsigned char* pout)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i iv = _mm_set_epi32(0, 0, 0, 512);
+
+    // The message padded to one 128 byte block: 0x80, the output size in
+    // bits (512) at 110 and the bit count (512) at 112
+    unsigned char buf[128];
+    memcpy(buf, pin, 64);
+    memset(buf + 64, 0, 64);
+    buf[64] = 0x80;
+    buf[111] = 0x02;
+    buf[113] = 0x02;
+
+    __m128i w[16];
+    for (int i = 0; i < 8; i++)
+    {
+        w[i] = iv;
+        w[i + 8] = _mm_loadu_si128((const __m128i*)(buf + 16 * i));
+    }
+
+    // The 128 bit counter starts at the bit count and never carries out of
+    // its low word for a single block
+    unsigned int k = 512;
+    for (int r = 0; r < 10; r++)
+    {
+        // BIG.SubWords
+        for (int i = 0; i < 16; i++)
+            w[i] = _mm_aesenc_si128(_mm_aesenc_si128(w[i], _mm_cvtsi32_si128(k++)), zero);
+
+        // BIG.ShiftRows
+        __m128i t = w[1];
+        w[1] = w[5];
+        w[5] = w[9];
+        w[9] = w[13];
+        w[13] = t;
+        t = w[2];
+        w[2] = w[10];
+        w[10] = t;
+        t = w[6];
+        w[6] = w[14];
+        w[14] = t;
+        t = w[15];
+        w[15] = w[11];
+        w[11] = w[7];
+        w[7] = w[3];
+        w[3] = t;
+
+        // BIG.MixColumns
+        EchoMixColumn(&w[0]);
+        EchoMixColumn(&w[4]);
+        EchoMixColumn(&w[8]);
+        EchoMixColumn(&w[12]);
+    }
+
+    for (int i = 0; i < 4; i++)
+    {
+        const __m128i m = _mm_loadu_si128((const __m128i*)(buf + 16 * i));
+        _mm_storeu_si128((__m128i*)(pout + 16 * i), _mm_xor_si128(_mm_xor_si128(iv, m), _mm_xor_si128(w[i], w[i + 8])));
+    }
+}
+
+#endif // USE_X11_SIMD
+
+uint256 HashX11Impl(const void* pdata, size_t nSize, bool fSSE2, bool fAESNI)
+{
+    sph_blake512_context     ctx_blake;
+    sph_bmw512_context       ctx_bmw;
+    sph_groestl512_context   ctx_groestl;
+    sph_jh512_context        ctx_jh;
+    sph_keccak512_context    ctx_keccak;
+    sph_skein512_context     ctx_skein;
+    sph_luffa512_context     ctx_luffa;
+    sph_cubehash512_context  ctx_cubehash;
+    sph_shavite512_context   ctx_shavite;
+    sph_simd512_context      ctx_simd;
+    sph_echo512_context      ctx_echo;
+
+    uint512 hash[11];
+
+    // Start from the contexts initialised once in X11Init instead of running every init function
+    ZBLAKE;
+    sph_blake512 (&ctx_blake, pdata, nSize);
+    sph_blake512_close(&ctx_blake, static_cast<void*>(&hash[0]));
+
+    ZBMW;
+    sph_bmw512 (&ctx_bmw, static_cast<const void*>(&hash[0]), 64);
+    sph_bmw512_close(&ctx_bmw, static_cast<void*>(&hash[1]));
+
+    ZGROESTL;
+    sph_groestl512 (&ctx_groestl, static_cast<const void*>(&hash[1]), 64);
+    sph_groestl512_close(&ctx_groestl, static_cast<void*>(&hash[2]));
+
+    ZSKEIN;
+    sph_skein512 (&ctx_skein, static_cast<const void*>(&hash[2]), 64);
+    sph_skein512_close(&ctx_skein, static_cast<void*>(&hash[3]));
+
+    ZJH;
+    sph_jh512 (&ctx_jh, static_cast<const void*>(&hash[3]), 64);
+    sph_jh512_close(&ctx_jh, static_cast<void*>(&hash[4]));
+
+    ZKECCAK;
+    sph_keccak512 (&ctx_keccak, static_cast<const void*>(&hash[4]), 64);
+    sph_keccak512_close(&ctx_keccak, static_cast<void*>(&hash[5]));
+
+    ZLUFFA;
+    sph_luffa512 (&ctx_luffa, static_cast<void*>(&hash[5]), 64);
+    sph_luffa512_close(&ctx_luffa, static_cast<void*>(&hash[6]));
+
+#ifdef USE_X11_SIMD
+    if (fSSE2)
+        Cubehash512_64_SSE2((const unsigned char*)&hash[6], (unsigned char*)&hash[7]);
+    else
+#endif
+    {
+        ZCUBEHASH;
+        sph_cubehash512 (&ctx_cubehash, static_cast<const void*>(&hash[6]), 64);
+        sph_cubehash512_close(&ctx_cubehash, static_cast<void*>(&hash[7]));
+    }
+
+#ifdef USE_X11_SIMD
+    if (fAESNI)
+        Shavite512_64_AESNI((const unsigned char*)&hash[7], (unsigned char*)&hash[8]);
+    else
+#endif
+    {
+        ZSHAVITE;
+        sph_shavite512(&ctx_shavite, static_cast<const void*>(&hash[7]), 64);
+        sph_shavite512_close(&ctx_shavite, static_cast<void*>(&hash[8]));
+    }
+
+    ZSIMD;
+    sph_simd512 (&ctx_simd, static_cast<const void*>(&hash[8]), 64);
+    sph_simd512_close(&ctx_simd, static_cast<void*>(&hash[9]));
+
+#ifdef USE_X11_SIMD
+    if (fAESNI)
+        Echo512_64_AESNI((const unsigned char*)&hash[9], (unsigned char*)&hash[10]);
+    else
+#endif
+    {
+        ZECHO;
+        sph_echo512 (&ctx_echo, static_cast<const void*>(&hash[9]), 64);
+        sph_echo512_close(&ctx_echo, static_cast<void*>(&hash[10]));
+    }
+
+    return hash[10].trim256();
+}
+
+} // anon namespace
+
+uint256 HashX11(const void* pdata, size_t nSize)
+{
+    const CX11Init& init = X11Init();
+    return HashX11Impl(pdata, nSize, init.fSSE2, init.fAESNI);
+}
+
+uint256 HashX11Generic(const void* pdata, size_t nSize)
+{
+    X11Init();
+    return HashX11Impl(pdata, nSize, false, false);
+}
+
+const char* HashX11Implementation()
+{
+    const CX11Init& init = X11Init();
+    return init.fAESNI ? "sse2+aesni" : init.fSSE2 ? "sse2" : "generic";
+}
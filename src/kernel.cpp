@@ -242,22 +242,22 @@ static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifi
 //   quantities so as to generate blocks faster, degrading the system back into
 //   a proof-of-work situation.
 //
-static bool CheckStakeKernelHashV1(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
+static bool CheckStakeKernelHashV1(unsigned int nBits, const CKernelInput& kernel, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
 {
-    if (nTimeTx < txPrev.nTime)  // Transaction timestamp violation
+    if (nTimeTx < kernel.nTimeTxPrev)  // Transaction timestamp violation
         return error("CheckStakeKernelHash() : nTime violation");
 
-    unsigned int nTimeBlockFrom = blockFrom.GetBlockTime();
+    unsigned int nTimeBlockFrom = kernel.nTimeBlockFrom;
     if (nTimeBlockFrom + nStakeMinAge > nTimeTx) // Min age requirement
         return error("CheckStakeKernelHash() : min age violation");
 
     CBigNum bnTargetPerCoinDay;
     bnTargetPerCoinDay.SetCompact(nBits);
-    int64_t nValueIn = txPrev.vout[prevout.n].nValue;
+    int64_t nValueIn = kernel.nValue;
 
-    uint256 hashBlockFrom = blockFrom.GetHash();
+    const uint256& hashBlockFrom = kernel.hashBlockFrom;
 
-    CBigNum bnCoinDayWeight = CBigNum(nValueIn) * GetWeight((int64_t)txPrev.nTime, (int64_t)nTimeTx) / COIN / (24 * 60 * 60);
+    CBigNum bnCoinDayWeight = CBigNum(nValueIn) * GetWeight((int64_t)kernel.nTimeTxPrev, (int64_t)nTimeTx) / COIN / (24 * 60 * 60);
     targetProofOfStake = (bnCoinDayWeight * bnTargetPerCoinDay).getuint256();
 
     // Calculate hash
@@ -270,7 +270,7 @@ static bool CheckStakeKernelHashV1(unsigned int nBits, const CBlock& blockFrom,
         return false;
     ss << nStakeModifier;
 
-    ss << nTimeBlockFrom << nTxPrevOffset << txPrev.nTime << prevout.n << nTimeTx;
+    ss << nTimeBlockFrom << kernel.nTxPrevOffset << kernel.nTimeTxPrev << kernel.prevout.n << nTimeTx;
     hashProofOfStake = Hash(ss.begin(), ss.end());
     if (fPrintProofOfStake)
     {
@@ -278,10 +278,10 @@ static bool CheckStakeKernelHashV1(unsigned int nBits, const CBlock& blockFrom,
             nStakeModifier, nStakeModifierHeight,
             DateTimeStrFormat(nStakeModifierTime),
             mapBlockIndex[hashBlockFrom]->nHeight,
-            DateTimeStrFormat(blockFrom.GetBlockTime()));
+            DateTimeStrFormat(nTimeBlockFrom));
         LogPrintf("CheckStakeKernelHash() : check modifier=0x%016x nTimeBlockFrom=%u nTxPrevOffset=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
             nStakeModifier,
-            nTimeBlockFrom, nTxPrevOffset, txPrev.nTime, prevout.n, nTimeTx,
+            nTimeBlockFrom, kernel.nTxPrevOffset, kernel.nTimeTxPrev, kernel.prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
 
@@ -294,15 +294,74 @@ static bool CheckStakeKernelHashV1(unsigned int nBits, const CBlock& blockFrom,
             nStakeModifier, nStakeModifierHeight, 
             DateTimeStrFormat(nStakeModifierTime),
             mapBlockIndex[hashBlockFrom]->nHeight,
-            DateTimeStrFormat(blockFrom.GetBlockTime()));
+            DateTimeStrFormat(nTimeBlockFrom));
         LogPrintf("CheckStakeKernelHash() : pass modifier=0x%016x nTimeBlockFrom=%u nTxPrevOffset=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
             nStakeModifier,
-            nTimeBlockFrom, nTxPrevOffset, txPrev.nTime, prevout.n, nTimeTx,
+            nTimeBlockFrom, kernel.nTxPrevOffset, kernel.nTimeTxPrev, kernel.prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
     return true;
 }
 
+CStakeKernelHasher::CStakeKernelHasher(uint64_t nStakeModifier, unsigned int nBits, const CKernelInput& kernel) :
+    nTimeBlockFrom(kernel.nTimeBlockFrom), nTimeTxPrev(kernel.nTimeTxPrev)
+{
+    // Same layout as serializing
+    //     nStakeModifier << nTimeBlockFrom << nTimeTxPrev << prevout.hash << prevout.n << nTimeTx
+    // into a CDataStream
+    unsigned char* p = pchKernel;
+    memcpy(p, &nStakeModifier, 8); p += 8;
+    memcpy(p, &kernel.nTimeBlockFrom, 4); p += 4;
+    memcpy(p, &kernel.nTimeTxPrev, 4); p += 4;
+    memcpy(p, kernel.prevout.hash.begin(), 32); p += 32;
+    memcpy(p, &kernel.prevout.n, 4); p += 4;
+    memset(p, 0, 4);
+
+    // Weighted target, matching CBigNum().SetCompact(nBits) * CBigNum(nValue)
+    unsigned int nSize = nBits >> 24;
+    uint64_t nWord = nBits & 0x007fffff;
+    bool fNegative = nSize >= 1 && (nBits & 0x00800000) != 0;
+    if (nSize <= 3)
+        nWord >>= 8 * (3 - nSize);
+
+    uint64_t nValue = kernel.nValue;
+    if (kernel.nValue < 0)
+    {
+        nValue = -nValue;
+        fNegative = !fNegative;
+    }
+
+    // 23 bit mantissa times 64 bit value, in two halves so nothing overflows
+    uint256 bnHigh = nWord * (nValue >> 32);
+    hashTarget = nWord * (nValue & 0xffffffff);
+    hashTarget += bnHigh << 32;
+
+    if (nSize > 3 && hashTarget != 0)
+    {
+        unsigned int nShift = 8 * (nSize - 3);
+        uint256 bnShifted = hashTarget << nShift;
+        if (nShift >= 256 || (bnShifted >> nShift) != hashTarget)
+            hashTarget = ~uint256(0); // above any hash
+        else
+            hashTarget = bnShifted;
+    }
+
+    fTargetNegative = fNegative && hashTarget != 0;
+}
+
+uint256 CStakeKernelHasher::GetHash(unsigned int nTimeTx)
+{
+    memcpy(pchKernel + 52, &nTimeTx, 4);
+    return Hash(pchKernel, pchKernel + sizeof(pchKernel));
+}
+
+bool CStakeKernelHasher::CheckKernel(unsigned int nTimeTx)
+{
+    if (nTimeTx < nTimeTxPrev || nTimeBlockFrom + nStakeMinAge > nTimeTx)
+        return false;
+    return CheckHash(GetHash(nTimeTx));
+}
+
 // Buxcoin kernel protocol
 // coinstake must meet hash target according to the protocol:
 // kernel (input 0) must meet the formula
@@ -324,34 +383,24 @@ static bool CheckStakeKernelHashV1(unsigned int nBits, const CBlock& blockFrom,
 //   quantities so as to generate blocks faster, degrading the system back into
 //   a proof-of-work situation.
 //
-static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
+static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits, const CKernelInput& kernel, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
 {
-    if (nTimeTx < txPrev.nTime)  // Transaction timestamp violation
+    unsigned int nTimeBlockFrom = kernel.nTimeBlockFrom;
+    if (nTimeTx < kernel.nTimeTxPrev)  // Transaction timestamp violation
         return error("CheckStakeKernelHash() : nTime violation");
 
     if (nTimeBlockFrom + nStakeMinAge > nTimeTx) // Min age requirement
         return error("CheckStakeKernelHash() : min age violation");
 
-    // Base target
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
-
-    // Weighted target
-    int64_t nValueIn = txPrev.vout[prevout.n].nValue;
-    CBigNum bnWeight = CBigNum(nValueIn);
-    bnTarget *= bnWeight;
-
-    targetProofOfStake = bnTarget.getuint256();
+    // Weighted target and hash
+    CStakeKernelHasher hasher(pindexPrev->nStakeModifier, nBits, kernel);
+    targetProofOfStake = hasher.GetTarget();
+    hashProofOfStake = hasher.GetHash(nTimeTx);
 
     uint64_t nStakeModifier = pindexPrev->nStakeModifier;
     int nStakeModifierHeight = pindexPrev->nHeight;
     int64_t nStakeModifierTime = pindexPrev->nTime;
 
-    // Calculate hash
-    CDataStream ss(SER_GETHASH, 0);
-    ss << nStakeModifier << nTimeBlockFrom << txPrev.nTime << prevout.hash << prevout.n << nTimeTx;
-    hashProofOfStake = Hash(ss.begin(), ss.end());
-
     if (fPrintProofOfStake)
     {
         LogPrintf("CheckStakeKernelHash() : using modifier 0x%016x at height=%d timestamp=%s for block from timestamp=%s\n",
@@ -360,12 +409,12 @@ static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits,
             DateTimeStrFormat(nTimeBlockFrom));
         LogPrintf("CheckStakeKernelHash() : check modifier=0x%016x nTimeBlockFrom=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
             nStakeModifier,
-            nTimeBlockFrom, txPrev.nTime, prevout.n, nTimeTx,
+            nTimeBlockFrom, kernel.nTimeTxPrev, kernel.prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
 
     // Now check if proof-of-stake hash meets target protocol
-    if (CBigNum(hashProofOfStake) > bnTarget)
+    if (!hasher.CheckHash(hashProofOfStake))
         return false;
 
     if (fDebug && !fPrintProofOfStake)
@@ -376,19 +425,25 @@ static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits,
             DateTimeStrFormat(nTimeBlockFrom));
         LogPrintf("CheckStakeKernelHash() : pass modifier=0x%016x nTimeBlockFrom=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
             nStakeModifier,
-            nTimeBlockFrom, txPrev.nTime, prevout.n, nTimeTx,
+            nTimeBlockFrom, kernel.nTimeTxPrev, kernel.prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
 
     return true;
 }
 
-bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
+bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CKernelInput& kernel, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
 {
     if (IsProtocolV2(pindexPrev->nHeight+1))
-        return CheckStakeKernelHashV2(pindexPrev, nBits, blockFrom.GetBlockTime(), txPrev, prevout, nTimeTx, hashProofOfStake, targetProofOfStake, fPrintProofOfStake);
+        return CheckStakeKernelHashV2(pindexPrev, nBits, kernel, nTimeTx, hashProofOfStake, targetProofOfStake, fPrintProofOfStake);
     else
-        return CheckStakeKernelHashV1(nBits, blockFrom, nTxPrevOffset, txPrev, prevout, nTimeTx, hashProofOfStake, targetProofOfStake, fPrintProofOfStake);
+        return CheckStakeKernelHashV1(nBits, kernel, nTimeTx, hashProofOfStake, targetProofOfStake, fPrintProofOfStake);
+}
+
+bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
+{
+    CKernelInput kernel(blockFrom, nTxPrevOffset, txPrev, prevout);
+    return CheckStakeKernelHash(pindexPrev, nBits, kernel, nTimeTx, hashProofOfStake, targetProofOfStake, fPrintProofOfStake);
 }
 
 // Check kernel hash target and coinstake signature
@@ -431,26 +486,45 @@ bool CheckCoinStakeTimestamp(int nHeight, int64_t nTimeBlock, int64_t nTimeTx)
         return (nTimeBlock == nTimeTx);	
 }
 
-bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, int64_t* pBlockTime)
+bool GetKernelInput(CTxDB& txdb, const COutPoint& prevout, CKernelInput& kernel)
 {
-    uint256 hashProofOfStake, targetProofOfStake;
-
-    CTxDB txdb("r");
     CTransaction txPrev;
     CTxIndex txindex;
     if (!txPrev.ReadFromDisk(txdb, prevout, txindex))
         return false;
+    if (prevout.n >= txPrev.vout.size())
+        return false;
 
     // Read block header
     CBlock block;
     if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
         return false;
 
-    if (block.GetBlockTime() + nStakeMinAge > nTime)
+    kernel = CKernelInput(block, txindex.pos.nTxPos - txindex.pos.nBlockPos, txPrev, prevout);
+    return true;
+}
+
+bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const CKernelInput& kernel)
+{
+    if (kernel.nTimeBlockFrom + nStakeMinAge > nTime)
+        return false; // only count coins meeting min age requirement
+
+    uint256 hashProofOfStake, targetProofOfStake;
+    return CheckStakeKernelHash(pindexPrev, nBits, kernel, nTime, hashProofOfStake, targetProofOfStake);
+}
+
+bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, int64_t* pBlockTime)
+{
+    CTxDB txdb("r");
+    CKernelInput kernel;
+    if (!GetKernelInput(txdb, prevout, kernel))
+        return false;
+
+    if (kernel.nTimeBlockFrom + nStakeMinAge > nTime)
         return false; // only count coins meeting min age requirement
 
     if (pBlockTime)
-        *pBlockTime = block.GetBlockTime();
+        *pBlockTime = kernel.nTimeBlockFrom;
 
-    return CheckStakeKernelHash(pindexPrev, nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, txPrev, prevout, nTime, hashProofOfStake, targetProofOfStake);
-}
\ No newline at end of file
+    return CheckKernel(pindexPrev, nBits, nTime, kernel);
+}
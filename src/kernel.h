@@ -17,12 +17,63 @@ extern unsigned int nModifierInterval;
 // ratio of group interval length between the last group and the first group
 static const int MODIFIER_INTERVAL_RATIO = 3;
 
+class CTxDB;
+
+// Everything CheckStakeKernelHash needs to know about a staking coin, so a
+// stake search can evaluate it repeatedly without touching the tx database
+// or the block files
+class CKernelInput
+{
+public:
+    uint256 hashBlockFrom;        // block containing txPrev
+    unsigned int nTimeBlockFrom;  // and its timestamp
+    unsigned int nTxPrevOffset;   // offset of txPrev inside that block
+    unsigned int nTimeTxPrev;
+    COutPoint prevout;
+    int64_t nValue;
+
+    CKernelInput() : nTimeBlockFrom(0), nTxPrevOffset(0), nTimeTxPrev(0), nValue(0) {}
+    CKernelInput(const CBlock& blockFrom, unsigned int nTxPrevOffsetIn, const CTransaction& txPrev, const COutPoint& prevoutIn) :
+        hashBlockFrom(blockFrom.GetHash()), nTimeBlockFrom(blockFrom.GetBlockTime()), nTxPrevOffset(nTxPrevOffsetIn),
+        nTimeTxPrev(txPrev.nTime), prevout(prevoutIn), nValue(txPrev.vout[prevoutIn.n].nValue) {}
+};
+
+// Protocol v2 kernel of one staking coin, prepared so that it can be tried
+// against many timestamps: the kernel is serialized once into a fixed buffer
+// of which only nTimeTx changes, and the weighted target is computed once as
+// a uint256. Trying a timestamp needs no allocation and no CBigNum.
+class CStakeKernelHasher
+{
+private:
+    unsigned char pchKernel[56];  // nStakeModifier, nTimeBlockFrom, nTimeTxPrev, prevout, nTimeTx
+    unsigned int nTimeBlockFrom;
+    unsigned int nTimeTxPrev;
+    uint256 hashTarget;           // nBits target times the coin value, saturated at 2^256-1
+    bool fTargetNegative;         // no hash can meet a negative target
+
+public:
+    CStakeKernelHasher(uint64_t nStakeModifier, unsigned int nBits, const CKernelInput& kernel);
+
+    const uint256& GetTarget() const { return hashTarget; }
+
+    // Kernel hash for the given coinstake timestamp
+    uint256 GetHash(unsigned int nTimeTx);
+
+    // Whether a kernel hash meets the weighted target
+    bool CheckHash(const uint256& hashProofOfStake) const { return !fTargetNegative && hashProofOfStake <= hashTarget; }
+
+    // Timestamp and min age checks plus the hash check, without logging,
+    // for use in a kernel search
+    bool CheckKernel(unsigned int nTimeTx);
+};
+
 // Compute the hash modifier for proof-of-stake
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier);
 
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
+bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CKernelInput& kernel, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
 
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
@@ -39,4 +90,10 @@ int64_t GetWeight(int64_t nIntervalBeginning, int64_t nIntervalEnd);
 // Convenient for searching a kernel
 bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, int64_t* pBlockTime = NULL);
 
+// Same as above for kernel input data that is already loaded
+bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const CKernelInput& kernel);
+
+// Load the kernel input data of prevout from the tx database and block file
+bool GetKernelInput(CTxDB& txdb, const COutPoint& prevout, CKernelInput& kernel);
+
 #endif // PPCOIN_KERNEL_H
@@ -6,10 +6,12 @@
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/thread/tss.hpp>
 
 #include "alert.h"
 #include "chainparams.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "db.h"
 #include "init.h"
 #include "kernel.h"
@@ -37,7 +39,7 @@ CCriticalSection cs_main;
 
 CTxMemPool mempool;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 
 CBigNum bnProofOfStakeLimit(~uint256(0) >> 20);
@@ -58,6 +60,7 @@ CBlockIndex* pindexBest = NULL;
 int64_t nTimeBestReceived = 0;
 bool fImporting = false;
 bool fReindex = false;
+int nScriptCheckThreads = 0;
 bool fAddrIndex = false;
 bool fHaveGUI = false;
 
@@ -143,6 +146,219 @@ void ResendWalletTransactions(bool fForce) {
 }
 
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Block download scheduling
+//
+
+void CBlockDownloadQueue::Erase(QueuedBlockList::iterator it)
+{
+    set<NodeId> setPeers(it->setSources);
+    setPeers.insert(it->setStalled.begin(), it->setStalled.end());
+    setPeers.insert(it->nodeContinue);
+    setPeers.insert(it->nodeInFlight);
+    setPeers.erase(-1);
+    BOOST_FOREACH(NodeId nodeid, setPeers)
+    {
+        map<NodeId, set<uint256> >::iterator mi = mapPeerBlocks.find(nodeid);
+        if (mi == mapPeerBlocks.end())
+            continue;
+        mi->second.erase(it->hash);
+        if (mi->second.empty())
+            mapPeerBlocks.erase(mi);
+    }
+    if (it->nodeInFlight != -1)
+        mapInFlight[it->nodeInFlight]--;
+    mapBlocks.erase(it->hash);
+    lBlocks.erase(it);
+}
+
+// Take the block back from the peer it was requested from. With fStalled
+// that peer is not asked for it again.
+void CBlockDownloadQueue::ReleaseInFlight(CQueuedBlock& queued, bool fStalled)
+{
+    NodeId nodeid = queued.nodeInFlight;
+    mapInFlight[nodeid]--;
+    queued.nodeInFlight = -1;
+    if (fStalled)
+    {
+        queued.setSources.erase(nodeid);
+        queued.setStalled.insert(nodeid);
+        if (queued.nodeContinue == nodeid)
+            queued.nodeContinue = -1;
+    }
+}
+
+// Clear every mention of nodeid, returns whether anyone is left to ask
+bool CBlockDownloadQueue::ForgetPeer(CQueuedBlock& queued, NodeId nodeid)
+{
+    queued.setSources.erase(nodeid);
+    queued.setStalled.erase(nodeid);
+    if (queued.nodeContinue == nodeid)
+        queued.nodeContinue = -1;
+    if (queued.nodeInFlight == nodeid)
+        ReleaseInFlight(queued, false);
+    return !queued.setSources.empty() || queued.nodeInFlight != -1;
+}
+
+bool CBlockDownloadQueue::Queue(NodeId nodeid, const uint256& hash, bool fContinue)
+{
+    LOCK(cs);
+    map<NodeId, set<uint256> >::iterator mp = mapPeerBlocks.find(nodeid);
+    if (mp != mapPeerBlocks.end() && mp->second.size() >= MAX_QUEUED_BLOCKS_PER_PEER && !mp->second.count(hash))
+        return false;
+    map<uint256, QueuedBlockList::iterator>::iterator mi = mapBlocks.find(hash);
+    if (mi == mapBlocks.end())
+    {
+        if (lBlocks.size() >= MAX_QUEUED_BLOCKS)
+            return false;
+        CQueuedBlock queued;
+        queued.hash = hash;
+        queued.nodeContinue = -1;
+        queued.nodeInFlight = -1;
+        queued.nTimeRequested = 0;
+        mi = mapBlocks.insert(make_pair(hash, lBlocks.insert(lBlocks.end(), queued))).first;
+    }
+
+    CQueuedBlock& queued = *mi->second;
+    if (queued.setStalled.count(nodeid))
+        return false;
+    queued.setSources.insert(nodeid);
+    if (fContinue)
+        queued.nodeContinue = nodeid;
+    mapPeerBlocks[nodeid].insert(hash);
+    return true;
+}
+
+bool CBlockDownloadQueue::IsQueued(const uint256& hash)
+{
+    LOCK(cs);
+    return mapBlocks.count(hash);
+}
+
+bool CBlockDownloadQueue::IsEmpty()
+{
+    LOCK(cs);
+    return lBlocks.empty();
+}
+
+void CBlockDownloadQueue::Received(const uint256& hash)
+{
+    LOCK(cs);
+    map<uint256, QueuedBlockList::iterator>::iterator mi = mapBlocks.find(hash);
+    if (mi != mapBlocks.end())
+        Erase(mi->second);
+}
+
+void CBlockDownloadQueue::NotFound(NodeId nodeid, const uint256& hash)
+{
+    LOCK(cs);
+    map<uint256, QueuedBlockList::iterator>::iterator mi = mapBlocks.find(hash);
+    if (mi == mapBlocks.end())
+        return;
+    CQueuedBlock& queued = *mi->second;
+    if (queued.nodeInFlight != nodeid)
+        return;
+    LogPrint("net", "block %s not found at peer=%d\n", hash.ToString(), nodeid);
+    ReleaseInFlight(queued, true);
+}
+
+void CBlockDownloadQueue::RemovePeer(NodeId nodeid)
+{
+    LOCK(cs);
+    map<NodeId, set<uint256> >::iterator mi = mapPeerBlocks.find(nodeid);
+    if (mi == mapPeerBlocks.end())
+    {
+        mapInFlight.erase(nodeid);
+        return;
+    }
+    set<uint256> setHashes;
+    setHashes.swap(mi->second);
+    mapPeerBlocks.erase(mi);
+
+    BOOST_FOREACH(const uint256& hash, setHashes)
+    {
+        map<uint256, QueuedBlockList::iterator>::iterator mb = mapBlocks.find(hash);
+        if (mb == mapBlocks.end())
+            continue;
+        if (!ForgetPeer(*mb->second, nodeid))
+            Erase(mb->second);
+    }
+    mapInFlight.erase(nodeid);
+}
+
+void CBlockDownloadQueue::Schedule(NodeId nodeid, bool fAhead, int64_t nNow, vector<CInv>& vGetData)
+{
+    LOCK(cs);
+    unsigned int nWindow = 0;
+    QueuedBlockList::iterator it = lBlocks.begin();
+    while (it != lBlocks.end() && nWindow++ < BLOCK_DOWNLOAD_WINDOW)
+    {
+        QueuedBlockList::iterator itCur = it++;
+        CQueuedBlock& queued = *itCur;
+
+        if (mapBlockIndex.count(queued.hash))
+        {
+            Erase(itCur);
+            continue;
+        }
+
+        if (queued.nodeInFlight != -1 && nNow - queued.nTimeRequested > BLOCK_DOWNLOAD_TIMEOUT)
+        {
+            LogPrint("net", "block %s timed out from peer=%d\n", queued.hash.ToString(), queued.nodeInFlight);
+            ReleaseInFlight(queued, true);
+            if (queued.setSources.empty() && !fAhead)
+            {
+                Erase(itCur);
+                continue;
+            }
+        }
+
+        if (queued.nodeInFlight != -1 || mapInFlight[nodeid] >= MAX_BLOCKS_IN_TRANSIT_PER_PEER)
+            continue;
+        if (queued.setStalled.count(nodeid))
+            continue;
+        if (queued.nodeContinue != -1 ? queued.nodeContinue != nodeid : !(queued.setSources.count(nodeid) || fAhead))
+            continue;
+
+        queued.nodeInFlight = nodeid;
+        queued.nTimeRequested = nNow;
+        mapInFlight[nodeid]++;
+        mapPeerBlocks[nodeid].insert(queued.hash);
+        LogPrint("net", "sending getdata: %s to peer=%d\n", CInv(MSG_BLOCK, queued.hash).ToString(), nodeid);
+        vGetData.push_back(CInv(MSG_BLOCK, queued.hash));
+    }
+}
+
+unsigned int CBlockDownloadQueue::GetSize()
+{
+    LOCK(cs);
+    return lBlocks.size();
+}
+
+int CBlockDownloadQueue::GetInFlight(NodeId nodeid)
+{
+    LOCK(cs);
+    map<NodeId, int>::iterator mi = mapInFlight.find(nodeid);
+    return mi == mapInFlight.end() ? 0 : mi->second;
+}
+
+unsigned int CBlockDownloadQueue::GetPeerEntries(NodeId nodeid)
+{
+    LOCK(cs);
+    map<NodeId, set<uint256> >::iterator mi = mapPeerBlocks.find(nodeid);
+    return mi == mapPeerBlocks.end() ? 0 : mi->second.size();
+}
+
+static CBlockDownloadQueue blockDownloadQueue;
+
+// Hand the blocks of a disconnected peer to the others
+void static FinalizeNode(NodeId nodeid)
+{
+    blockDownloadQueue.RemovePeer(nodeid);
+}
+
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // Registration of network node signals.
@@ -152,12 +368,14 @@ void RegisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.ProcessMessages.connect(&ProcessMessages);
     nodeSignals.SendMessages.connect(&SendMessages);
+    nodeSignals.FinalizeNode.connect(&FinalizeNode);
 }
 
 void UnregisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.ProcessMessages.disconnect(&ProcessMessages);
     nodeSignals.SendMessages.disconnect(&SendMessages);
+    nodeSignals.FinalizeNode.disconnect(&FinalizeNode);
 }
 
 bool AbortNode(const std::string &strMessage, const std::string &userMessage) {
@@ -526,7 +744,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     vMerkleBranch = pblock->GetMerkleBranch(nIndex);
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -753,6 +971,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
     setValidatedTx.insert(hash);
 
     SyncWithWallets(tx, NULL);
+    SyncMasternodeCollateral(tx);
 
     LogPrint("mempool", "AcceptToMemoryPool : accepted %s (poolsz %u)\n",
            hash.ToString(),
@@ -897,7 +1116,7 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
     AssertLockHeld(cs_main);
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -992,7 +1211,7 @@ int CTxIndex::GetDepthInMainChain() const
     if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
         return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1037,22 +1256,31 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
+// Blocks of the best chain indexed by height
+static std::vector<CBlockIndex*> vBlockIndexByHeight;
+static CCriticalSection cs_vBlockIndexByHeight;
+
+void SetBlockIndexByHeight(CBlockIndex* pindexNew)
+{
+    LOCK(cs_vBlockIndexByHeight);
+    if (pindexNew == NULL)
+    {
+        vBlockIndexByHeight.clear();
+        return;
+    }
+
+    // Only the heights above the fork point need to be filled in
+    vBlockIndexByHeight.resize(pindexNew->nHeight + 1);
+    for (CBlockIndex* pindex = pindexNew; pindex && vBlockIndexByHeight[pindex->nHeight] != pindex; pindex = pindex->pprev)
+        vBlockIndexByHeight[pindex->nHeight] = pindex;
+}
+
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    LOCK(cs_vBlockIndexByHeight);
+    if (nHeight < 0 || nHeight >= (int)vBlockIndexByHeight.size())
+        return NULL;
+    return vBlockIndexByHeight[nHeight];
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
@@ -1335,6 +1563,36 @@ void CBlock::UpdateTime(const CBlockIndex* pindexPrev)
     nTime = max(GetBlockTime(), GetAdjustedTime());
 }
 
+uint256 CBlock::BuildMerkleTree() const
+{
+    // Size the tree up front, so every level can be hashed in one batch
+    // straight from the level below into its place in vMerkleTree
+    size_t nTreeSize = vtx.empty() ? 0 : 1;
+    for (size_t nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+        nTreeSize += nSize;
+
+    vMerkleTree.clear();
+    vMerkleTree.resize(nTreeSize);
+    for (size_t i = 0; i < vtx.size(); i++)
+        vMerkleTree[i] = vtx[i].GetHash();
+
+    size_t j = 0;
+    for (size_t nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+    {
+        // Neighbouring nodes are already laid out as 64 byte inputs
+        SHA256D64((unsigned char*)&vMerkleTree[j + nSize], (const unsigned char*)&vMerkleTree[j], nSize / 2);
+
+        // An odd node out is paired with itself
+        if (nSize & 1)
+        {
+            const uint256& hashLast = vMerkleTree[j + nSize - 1];
+            vMerkleTree[j + nSize + nSize / 2] = Hash(BEGIN(hashLast), END(hashLast), BEGIN(hashLast), END(hashLast));
+        }
+        j += nSize;
+    }
+    return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
+}
+
 
 
 
@@ -1472,8 +1730,22 @@ int64_t CTransaction::GetValueIn(const MapPrevTx& inputs) const
 
 }
 
-bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags, bool fValidateSig)
+bool CScriptCheck::operator()() const {
+    const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType))
+        return error("CScriptCheck() : %s VerifySignature failed on input %u", ptxTo->GetHash().ToString(), nIn);
+    return true;
+}
+
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadScriptCheck() {
+    RenameThread("RenosCoin-scriptch");
+    scriptcheckqueue.Thread();
+}
+
+bool CTransaction::ConnectInputs(CTxDB& txdb, const MapPrevTx& inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
+    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags, bool fValidateSig, std::vector<CScriptCheck> *pvChecks)
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1485,10 +1757,11 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
         int64_t nFees = 0;
         for (unsigned int i = 0; i < vin.size(); i++)
         {
-            COutPoint prevout = vin[i].prevout;
-            assert(inputs.count(prevout.hash) > 0);
-            CTxIndex& txindex = inputs[prevout.hash].first;
-            CTransaction& txPrev = inputs[prevout.hash].second;
+            const COutPoint& prevout = vin[i].prevout;
+            MapPrevTx::const_iterator mi = inputs.find(prevout.hash);
+            assert(mi != inputs.end());
+            const CTxIndex& txindex = mi->second.first;
+            const CTransaction& txPrev = mi->second.second;
 
             if (prevout.n >= txPrev.vout.size() || prevout.n >= txindex.vSpent.size())
                 return DoS(100, error("ConnectInputs() : %s prevout.n out of range %d %u %u prev tx %s\n%s", GetHash().ToString(), prevout.n, txPrev.vout.size(), txindex.vSpent.size(), prevout.hash.ToString(), txPrev.ToString()));
@@ -1514,10 +1787,11 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
         // Helps prevent CPU exhaustion attacks.
         for (unsigned int i = 0; i < vin.size(); i++)
         {
-            COutPoint prevout = vin[i].prevout;
-            assert(inputs.count(prevout.hash) > 0);
-            CTxIndex& txindex = inputs[prevout.hash].first;
-            CTransaction& txPrev = inputs[prevout.hash].second;
+            const COutPoint& prevout = vin[i].prevout;
+            MapPrevTx::const_iterator mi = inputs.find(prevout.hash);
+            assert(mi != inputs.end());
+            const CTxIndex& txindex = mi->second.first;
+            const CTransaction& txPrev = mi->second.second;
 
             // Check for conflicts (double-spend)
             // This doesn't trigger the DoS code on purpose; if it did, it would make it easier
@@ -1532,8 +1806,11 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             // still computed and checked, and any change will be caught at the next checkpoint.
             if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
+                // Let the caller run it on the script check threads
+                if (pvChecks)
+                    pvChecks->push_back(CScriptCheck(txPrev, *this, i, flags, 0));
                 // Verify signature
-                if (!VerifySignature(txPrev, *this, i, flags, 0))
+                else if (!VerifySignature(txPrev, *this, i, flags, 0))
                 {
                     if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
                         // Check whether the failure was caused by a
@@ -1557,13 +1834,15 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             }
 	   }
 
-            // Mark outpoints as spent
-            txindex.vSpent[prevout.n] = posThisTx;
-
-            // Write back
+            // Mark outpoints as spent. inputs is left untouched; the spend is
+            // recorded in mapTestPool, which FetchInputs already consulted
+            // for this hash, so the pool entry is the one to update.
             if (fBlock || fMiner)
             {
-                mapTestPool[prevout.hash] = txindex;
+                map<uint256, CTxIndex>::iterator miPool = mapTestPool.find(prevout.hash);
+                if (miPool == mapTestPool.end())
+                    miPool = mapTestPool.insert(make_pair(prevout.hash, txindex)).first;
+                miPool->second.vSpent[prevout.n] = posThisTx;
             }
         }
 
@@ -1591,30 +1870,6 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
     return true;
 }
 
-bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
-{
-    // Disconnect in reverse order
-    for (int i = vtx.size()-1; i >= 0; i--)
-        if (!vtx[i].DisconnectInputs(txdb))
-            return false;
-
-    // Update block index on disk without changing it in memory.
-    // The memory index structure will be changed after the db commits.
-    if (pindex->pprev)
-    {
-        CDiskBlockIndex blockindexPrev(pindex->pprev);
-        blockindexPrev.hashNext = 0;
-        if (!txdb.WriteBlockIndex(blockindexPrev))
-            return error("DisconnectBlock() : WriteBlockIndex failed");
-    }
-
-    // ppcoin: clean up wallet after disconnecting coinstake
-    BOOST_FOREACH(CTransaction& tx, vtx)
-        SyncWithWallets(tx, this, false);
-
-    return true;
-}
-
 bool static BuildAddrIndex(const CScript &script, std::vector<uint160>& addrIds)
 {
     CScript::const_iterator pc = script.begin();
@@ -1649,7 +1904,73 @@ bool static BuildAddrIndex(const CScript &script, std::vector<uint160>& addrIds)
     }
 }
 
-bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint256> &vtxhash) {
+// Adds (or with fErase, removes) the address index entries of tx at nHeight:
+// one for every address it pays to and one for every address it spends from.
+bool static UpdateAddressIndex(CTxDB& txdb, CTransaction& tx, int nHeight, bool fErase)
+{
+    uint256 hashTx = tx.GetHash();
+    std::vector<uint160> addrIds;
+
+    // inputs
+    if (!tx.IsCoinBase())
+    {
+        MapPrevTx mapInputs;
+        map<uint256, CTxIndex> mapQueuedChangesT;
+        bool fInvalid;
+        if (!tx.FetchInputs(txdb, mapQueuedChangesT, true, false, mapInputs, fInvalid))
+            return false;
+
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            BuildAddrIndex(tx.GetOutputFor(txin, mapInputs).scriptPubKey, addrIds);
+    }
+
+    // outputs
+    BOOST_FOREACH(const CTxOut &atxout, tx.vout)
+        BuildAddrIndex(atxout.scriptPubKey, addrIds);
+
+    sort(addrIds.begin(), addrIds.end());
+    addrIds.erase(unique(addrIds.begin(), addrIds.end()), addrIds.end());
+    BOOST_FOREACH(const uint160& addrId, addrIds)
+    {
+        bool fOk = fErase ? txdb.EraseAddrIndex(addrId, nHeight, hashTx) : txdb.WriteAddrIndex(addrId, nHeight, hashTx);
+        if (!fOk)
+            LogPrintf("UpdateAddressIndex(): %s failed addrId: %s txhash: %s\n", fErase ? "EraseAddrIndex" : "WriteAddrIndex", addrId.ToString(), hashTx.ToString());
+    }
+    return true;
+}
+
+bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
+{
+    // Drop the address index entries this block added
+    if (fAddrIndex)
+        BOOST_FOREACH(CTransaction& tx, vtx)
+            if (!UpdateAddressIndex(txdb, tx, pindex->nHeight, true))
+                LogPrintf("DisconnectBlock() : %s unable to remove address index entries\n", tx.GetHash().ToString());
+
+    // Disconnect in reverse order
+    for (int i = vtx.size()-1; i >= 0; i--)
+        if (!vtx[i].DisconnectInputs(txdb))
+            return false;
+
+    // Update block index on disk without changing it in memory.
+    // The memory index structure will be changed after the db commits.
+    if (pindex->pprev)
+    {
+        CDiskBlockIndex blockindexPrev(pindex->pprev);
+        blockindexPrev.hashNext = 0;
+        if (!txdb.WriteBlockIndex(blockindexPrev))
+            return error("DisconnectBlock() : WriteBlockIndex failed");
+    }
+
+    // ppcoin: clean up wallet after disconnecting coinstake
+    BOOST_FOREACH(CTransaction& tx, vtx)
+        SyncWithWallets(tx, this, false);
+    SyncMasternodeCollateral(*this, false);
+
+    return true;
+}
+
+bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint256> &vtxhash, int nSkip, int nCount) {
     uint160 addrid = 0;
     const CKeyID *pkeyid = boost::get<CKeyID>(&dest);
     if (pkeyid)
@@ -1667,7 +1988,7 @@ bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint2
 
     LOCK(cs_main);
     CTxDB txdb("r");
-    if(!txdb.ReadAddrIndex(addrid, vtxhash))
+    if(!txdb.ReadAddrIndex(addrid, vtxhash, nSkip, nCount))
     {
 	LogPrintf("FindTransactionsByDestination(): txdb.ReadAddrIndex failed\n");
 	return false;
@@ -1675,51 +1996,11 @@ bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint2
     return true;
 }
 
-void CBlock::RebuildAddressIndex(CTxDB& txdb)
+void CBlock::RebuildAddressIndex(CTxDB& txdb, int nHeight)
 {
     BOOST_FOREACH(CTransaction& tx, vtx)
-    {
-        uint256 hashTx = tx.GetHash();
-	// inputs
-	if(!tx.IsCoinBase()) 
-	{
-            MapPrevTx mapInputs;
-	    map<uint256, CTxIndex> mapQueuedChangesT;
-	    bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapQueuedChangesT, true, false, mapInputs, fInvalid))
-                return;
-
-	    MapPrevTx::const_iterator mi;
-	    for(MapPrevTx::const_iterator mi = mapInputs.begin(); mi != mapInputs.end(); ++mi)
-	    {
-		    BOOST_FOREACH(const CTxOut &atxout, (*mi).second.second.vout)
-		    {
-			std::vector<uint160> addrIds;
-			if(BuildAddrIndex(atxout.scriptPubKey, addrIds))
-			{
-                            BOOST_FOREACH(uint160 addrId, addrIds)
-		            {
-			        if(!txdb.WriteAddrIndex(addrId, hashTx))
-				    LogPrintf("RebuildAddressIndex(): txins WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-                            }
-			}
-		    }
-	    }
- 	    
-        }
-	// outputs
-	BOOST_FOREACH(const CTxOut &atxout, tx.vout) {
-	    std::vector<uint160> addrIds;
-            if(BuildAddrIndex(atxout.scriptPubKey, addrIds))
-	    {
-		BOOST_FOREACH(uint160 addrId, addrIds)
-		{
-		    if(!txdb.WriteAddrIndex(addrId, hashTx))
-		        LogPrintf("RebuildAddressIndex(): txouts WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-                }
-	    }
-	}
-    }
+        if (!UpdateAddressIndex(txdb, tx, nHeight, false))
+            return;
 }
 
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
@@ -1728,8 +2009,13 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     if (!CheckBlock(!fJustCheck, !fJustCheck, false))
         return false;
 
+    int64_t nTimeStart = GetTimeMicros();
     unsigned int flags = SCRIPT_VERIFY_NOCACHE;
 
+    // Script checks are handed to the worker threads as each transaction's
+    // cheap checks pass; a single failure fails the whole block below.
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+
     //// issue here: it doesn't know the version
     unsigned int nTxPos;
     if (fJustCheck)
@@ -1805,13 +2091,20 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
                 nStakeReward = nTxValueOut - nTxValueIn;
 
 	    
-            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags))
+            std::vector<CScriptCheck> vChecks;
+            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags, true, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
+            control.Add(vChecks);
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
     }
-    
+
+    if (!control.Wait())
+        return DoS(100, error("ConnectBlock() : one of the input scripts failed to verify"));
+    int64_t nTimeConnect = GetTimeMicros() - nTimeStart;
+    LogPrint("bench", "- Connect %u transactions (%d inputs): %.2fms (%.3fms/tx)\n", (unsigned)vtx.size(), nInputs, 0.001 * nTimeConnect, 0.001 * nTimeConnect / vtx.size());
+
     if (IsProofOfWork())
     {
         int64_t nReward = GetProofOfWorkReward(pindex->nHeight, nFees);
@@ -1852,51 +2145,11 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 
 
     // Write Address Index
-    BOOST_FOREACH(CTransaction& tx, vtx)
-    {
-        uint256 hashTx = tx.GetHash();
-	// inputs
-	if(!tx.IsCoinBase()) 
-	{
-            MapPrevTx mapInputs;
-	    map<uint256, CTxIndex> mapQueuedChangesT;
-	    bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapQueuedChangesT, true, false, mapInputs, fInvalid))
+    if (fAddrIndex)
+        BOOST_FOREACH(CTransaction& tx, vtx)
+            if (!UpdateAddressIndex(txdb, tx, pindex->nHeight, false))
                 return false;
 
-	    MapPrevTx::const_iterator mi;
-	    for(MapPrevTx::const_iterator mi = mapInputs.begin(); mi != mapInputs.end(); ++mi)
-	    {
-		    BOOST_FOREACH(const CTxOut &atxout, (*mi).second.second.vout)
-		    {
-			std::vector<uint160> addrIds;
-			if(BuildAddrIndex(atxout.scriptPubKey, addrIds))
-			{
-                            BOOST_FOREACH(uint160 addrId, addrIds)
-		            {
-			        if(!txdb.WriteAddrIndex(addrId, hashTx))
-				    LogPrintf("ConnectBlock(): txins WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-                            }
-			}
-		    }
-	    }
- 	    
-        }
-
-	// outputs
-	BOOST_FOREACH(const CTxOut &atxout, tx.vout) {
-	    std::vector<uint160> addrIds;
-            if(BuildAddrIndex(atxout.scriptPubKey, addrIds))
-	    {
-		BOOST_FOREACH(uint160 addrId, addrIds)
-		{
-		    if(!txdb.WriteAddrIndex(addrId, hashTx))
-		        LogPrintf("ConnectBlock(): txouts WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-                }
-	    }
-	}
-    }
-
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
     if (pindex->pprev)
@@ -1907,9 +2160,13 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return error("ConnectBlock() : WriteBlockIndex failed");
     }
 
+    int64_t nTimeIndex = GetTimeMicros() - nTimeStart - nTimeConnect;
+    LogPrint("bench", "- Write tx/address index (%u txs): %.2fms\n", (unsigned)vtx.size(), 0.001 * nTimeIndex);
+
     // Watch for transactions paying to me
     BOOST_FOREACH(CTransaction& tx, vtx)
         SyncWithWallets(tx, this);
+    SyncMasternodeCollateral(*this, true);
 
     return true;
 }
@@ -1953,6 +2210,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
         CBlock block;
         if (!block.ReadFromDisk(pindex))
             return error("Reorganize() : ReadFromDisk for disconnect failed");
+        block.CacheTxHashes();
         if (!block.DisconnectBlock(txdb, pindex))
             return error("Reorganize() : DisconnectBlock %s failed", pindex->GetBlockHash().ToString());
 
@@ -1972,6 +2230,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
         CBlock block;
         if (!block.ReadFromDisk(pindex))
             return error("Reorganize() : ReadFromDisk for connect failed");
+        block.CacheTxHashes();
         if (!block.ConnectBlock(txdb, pindex))
         {
             // Invalid block
@@ -2095,6 +2354,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
                 LogPrintf("SetBestChain() : ReadFromDisk failed\n");
                 break;
             }
+            block.CacheTxHashes();
             if (!txdb.TxnBegin()) {
                 LogPrintf("SetBestChain() : TxnBegin 2 failed\n");
                 break;
@@ -2116,7 +2376,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = hash;
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
+    SetBlockIndexByHeight(pindexBest);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
@@ -2217,7 +2477,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     if (!pindexNew)
         return error("AddToBlockIndex() : new CBlockIndex failed");
     pindexNew->phashBlock = &hash;
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
@@ -2242,7 +2502,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
 
     // Add to mapBlockIndex
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     if (pindexNew->IsProofOfStake())
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
     pindexNew->phashBlock = &((*mi).first);
@@ -2451,7 +2711,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("AcceptBlock() : prev block not found"));
     CBlockIndex* pindexPrev = (*mi).second;
@@ -2603,6 +2863,7 @@ bool static IsCanonicalBlockSignature(CBlock* pblock)
 bool ProcessBlock(CNode* pfrom, CBlock* pblock)
 {
     AssertLockHeld(cs_main);
+    uint64_t nBlockHashesStart = GetBlockHashCount();
 
     // Check for duplicate
     uint256 hash = pblock->GetHash();
@@ -2675,12 +2936,17 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
             if (pblock->IsProofOfStake())
                 setStakeSeenOrphan.insert(pblock->GetProofOfStake());
 
-            // Ask this guy to fill in what we're missing
-            PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(hash));
-            // ppcoin: getblocks may not obtain the ancestor block rejected
-            // earlier by duplicate-stake check so we ask for it again directly
-            if (!IsInitialBlockDownload())
-                pfrom->AskFor(CInv(MSG_BLOCK, WantedByOrphan(pblock2)));
+            // Blocks downloaded from several peers arrive out of order. If the
+            // missing ancestor is already on its way just keep this one until then.
+            if (!blockDownloadQueue.IsQueued(WantedByOrphan(pblock2)))
+            {
+                // Ask this guy to fill in what we're missing
+                PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(hash));
+                // ppcoin: getblocks may not obtain the ancestor block rejected
+                // earlier by duplicate-stake check so we ask for it again directly
+                if (!IsInitialBlockDownload())
+                    pfrom->AskFor(CInv(MSG_BLOCK, WantedByOrphan(pblock2)));
+            }
         }
         return true;
     }
@@ -2715,6 +2981,7 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
     }
 
     LogPrintf("ProcessBlock: ACCEPTED\n");
+    LogPrint("bench", "- X11 header hashes: %u for %u accepted blocks\n", GetBlockHashCount() - nBlockHashesStart, vWorkQueue.size());
 
     // ppcoin: if responsible for sync-checkpoint send it
     if (pfrom && !CSyncCheckpoint::strMasterPrivKey.empty())
@@ -2866,6 +3133,95 @@ FILE* AppendBlockFile(unsigned int& nFileRet)
     }
 }
 
+// X11 header hashes computed per thread, see CBlock::GetPoWHash
+static boost::thread_specific_ptr<uint64_t> pnBlockHashCount;
+
+void CountBlockHash()
+{
+    if (!pnBlockHashCount.get())
+        pnBlockHashCount.reset(new uint64_t(0));
+    ++*pnBlockHashCount;
+}
+
+uint64_t GetBlockHashCount()
+{
+    return pnBlockHashCount.get() ? *pnBlockHashCount : 0;
+}
+
+bool CRawBlockCache::Get(const uint256& hash, CSharedMessage& msg)
+{
+    LOCK(cs);
+    map<uint256, MessageList::iterator>::iterator mi = mapMessages.find(hash);
+    if (mi == mapMessages.end())
+        return false;
+    lMessages.splice(lMessages.begin(), lMessages, mi->second);
+    msg = mi->second->second;
+    return true;
+}
+
+void CRawBlockCache::Insert(const uint256& hash, const CSharedMessage& msg)
+{
+    LOCK(cs);
+    // one block must not be able to flush everything else
+    if (msg->size() > nMaxSize / 4 || mapMessages.count(hash))
+        return;
+    lMessages.push_front(make_pair(hash, msg));
+    mapMessages[hash] = lMessages.begin();
+    nSize += msg->size();
+    while (nSize > nMaxSize)
+    {
+        nSize -= lMessages.back().second->size();
+        mapMessages.erase(lMessages.back().first);
+        lMessages.pop_back();
+    }
+}
+
+// Peers catching up tend to ask for the same stretch of the chain one after another
+static CRawBlockCache rawBlockCache(MAX_RAW_BLOCK_CACHE_SIZE);
+
+bool ReadRawBlockFromDisk(CSharedMessage& msg, const CBlockIndex* pindex)
+{
+    const uint256 hash = pindex->GetBlockHash();
+    if (rawBlockCache.Get(hash, msg))
+        return true;
+
+    // The block is preceded by the message start and its size, see CBlock::WriteToDisk
+    const unsigned int nHeaderSize = MESSAGE_START_SIZE + sizeof(unsigned int);
+    if (pindex->nBlockPos < nHeaderSize)
+        return error("ReadRawBlockFromDisk() : invalid block position %u", pindex->nBlockPos);
+    CAutoFile filein = CAutoFile(OpenBlockFile(pindex->nFile, pindex->nBlockPos - nHeaderSize, "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("ReadRawBlockFromDisk() : OpenBlockFile failed");
+
+    // Read the block straight into the payload of the message
+    MessageStartChars pchMessageStart;
+    unsigned int nSize;
+    CDataStream ssMsg(SER_NETWORK, PROTOCOL_VERSION);
+    ssMsg << CMessageHeader("block", 0);
+    try {
+        filein >> FLATDATA(pchMessageStart) >> nSize;
+        if (memcmp(pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE) != 0)
+            return error("ReadRawBlockFromDisk() : no message start before block %s", hash.ToString());
+        // The header alone is 80 bytes
+        if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+            return error("ReadRawBlockFromDisk() : invalid size %u for block %s", nSize, hash.ToString());
+        ssMsg.resize(CMessageHeader::HEADER_SIZE + nSize);
+        filein.read(&ssMsg[CMessageHeader::HEADER_SIZE], nSize);
+    }
+    catch (std::exception &e) {
+        return error("%s() : I/O error", __PRETTY_FUNCTION__);
+    }
+
+    // Only the header is checked, the rest was validated when the block was accepted
+    const char* pblock = &ssMsg[CMessageHeader::HEADER_SIZE];
+    if (Hash9(pblock, pblock + 80) != hash)
+        return error("ReadRawBlockFromDisk() : hash doesn't match index for block %s", hash.ToString());
+
+    msg = MakeSharedMessage(ssMsg);
+    rawBlockCache.Insert(hash, msg);
+    return true;
+}
+
 bool LoadBlockIndex(bool fAllowNew)
 {
     LOCK(cs_main);
@@ -2930,7 +3286,7 @@ void PrintBlockTree()
     AssertLockHeld(cs_main);
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -3211,17 +3567,19 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 
 
 
+// Messages that change state shared between peers are handled one at a time,
+// the handler threads only process those concerning a single peer in parallel
+static CCriticalSection cs_ProcessMessage;
+
+// Answers as much of vRecvGetData as the send buffer allows. An item whose
+// lookup needs a lock that is busy is left for the next call, so the
+// responses stay in order.
 void static ProcessGetData(CNode* pfrom)
 {
-    TRY_LOCK(cs_main, lockMain);
-    if(!lockMain)
-        return;
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
 
     vector<CInv> vNotFound;
 
-    //LOCK(cs_main);
-
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -3230,17 +3588,38 @@ void static ProcessGetData(CNode* pfrom)
         const CInv &inv = *it;
         {
             boost::this_thread::interruption_point();
-            it++;
 
             if (inv.type == MSG_BLOCK)
             {
+                // Only the index lookup needs cs_main, the block is read
+                // from disk without it
+                CBlockIndex* pindex = NULL;
+                uint256 hashBest;
+                {
+                    TRY_LOCK(cs_main, lockMain);
+                    if (!lockMain)
+                        break;
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                        pindex = (*mi).second;
+                    hashBest = hashBestChain;
+                }
+                it++;
+
                 // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                if (pindex)
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
+                    // The block is stored the way it goes on the wire, so pass the
+                    // bytes on as they are instead of decoding and encoding it again
+                    CSharedMessage msg;
+                    if (ReadRawBlockFromDisk(msg, pindex))
+                        pfrom->PushSharedMessage(msg);
+                    else
+                    {
+                        CBlock block;
+                        block.ReadFromDisk(pindex);
+                        pfrom->PushMessage("block", block);
+                    }
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -3249,7 +3628,7 @@ void static ProcessGetData(CNode* pfrom)
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
+                        vInv.push_back(CInv(MSG_BLOCK, hashBest));
                         pfrom->PushMessage("inv", vInv);
                         pfrom->hashContinue = 0;
                     }
@@ -3261,76 +3640,89 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    RelayMap::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushSharedMessage((*mi).second);
                         pushed = true;
                     }
                 }
-                if (!pushed && inv.type == MSG_TX) {
-                    if(mapDarksendBroadcastTxes.count(inv.hash)){
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss <<
-                            mapDarksendBroadcastTxes[inv.hash].tx <<
-                            mapDarksendBroadcastTxes[inv.hash].vin <<
-                            mapDarksendBroadcastTxes[inv.hash].vchSig <<
-                            mapDarksendBroadcastTxes[inv.hash].sigTime;
-
-                        pfrom->PushMessage("dstx", ss);
-                        pushed = true;
-                    } else {
-                        CTransaction tx;
-                        if (mempool.lookup(inv.hash, tx)) {
+                if (!pushed)
+                {
+                    // The darksend, instantx, spork and masternode maps are
+                    // changed by the handlers of other peers' messages
+                    TRY_LOCK(cs_ProcessMessage, lockProcess);
+                    if (!lockProcess)
+                        break;
+
+                    if (!pushed && inv.type == MSG_TX) {
+                        if(mapDarksendBroadcastTxes.count(inv.hash)){
                             CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                             ss.reserve(1000);
-                            ss << tx;
-                            pfrom->PushMessage("tx", ss);
+                            ss <<
+                                mapDarksendBroadcastTxes[inv.hash].tx <<
+                                mapDarksendBroadcastTxes[inv.hash].vin <<
+                                mapDarksendBroadcastTxes[inv.hash].vchSig <<
+                                mapDarksendBroadcastTxes[inv.hash].sigTime;
+
+                            pfrom->PushMessage("dstx", ss);
                             pushed = true;
+                        } else {
+                            CTransaction tx;
+                            if (mempool.lookup(inv.hash, tx)) {
+                                CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                                ss.reserve(1000);
+                                ss << tx;
+                                pfrom->PushMessage("tx", ss);
+                                pushed = true;
+                            }
                         }
                     }
-                }
-                if (!pushed && inv.type == MSG_TXLOCK_VOTE) {
-                    if(mapTxLockVote.count(inv.hash)){
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mapTxLockVote[inv.hash];
-                        pfrom->PushMessage("txlvote", ss);
-                        pushed = true;
+                    if (!pushed && inv.type == MSG_TXLOCK_VOTE) {
+                        if(mapTxLockVote.count(inv.hash)){
+                            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                            ss.reserve(1000);
+                            ss << mapTxLockVote[inv.hash];
+                            pfrom->PushMessage("txlvote", ss);
+                            pushed = true;
+                        }
                     }
-                }
-                if (!pushed && inv.type == MSG_TXLOCK_REQUEST) {
-                    if(mapTxLockReq.count(inv.hash)){
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mapTxLockReq[inv.hash];
-                        pfrom->PushMessage("txlreq", ss);
-                        pushed = true;
+                    if (!pushed && inv.type == MSG_TXLOCK_REQUEST) {
+                        if(mapTxLockReq.count(inv.hash)){
+                            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                            ss.reserve(1000);
+                            ss << mapTxLockReq[inv.hash];
+                            pfrom->PushMessage("txlreq", ss);
+                            pushed = true;
+                        }
                     }
-                }
-                if (!pushed && inv.type == MSG_SPORK) {
-                    if(mapSporks.count(inv.hash)){
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mapSporks[inv.hash];
-                        pfrom->PushMessage("spork", ss);
-                        pushed = true;
+                    if (!pushed && inv.type == MSG_SPORK) {
+                        if(mapSporks.count(inv.hash)){
+                            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                            ss.reserve(1000);
+                            ss << mapSporks[inv.hash];
+                            pfrom->PushMessage("spork", ss);
+                            pushed = true;
+                        }
                     }
-                }
-                if (!pushed && inv.type == MSG_MASTERNODE_WINNER) {
-                    if(mapSeenMasternodeVotes.count(inv.hash)){
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        int a = 0;
-                        ss.reserve(1000);
-                        ss << mapSeenMasternodeVotes[inv.hash] << a;
-                        pfrom->PushMessage("mnw", ss);
-                        pushed = true;
+                    if (!pushed && inv.type == MSG_MASTERNODE_WINNER) {
+                        if(mapSeenMasternodeVotes.count(inv.hash)){
+                            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                            int a = 0;
+                            ss.reserve(1000);
+                            ss << mapSeenMasternodeVotes[inv.hash] << a;
+                            pfrom->PushMessage("mnw", ss);
+                            pushed = true;
+                        }
                     }
                 }
+                it++;
+
                 if (!pushed) {
                     vNotFound.push_back(inv);
                 }
             }
+            else
+                it++;
 
             // Track requests for our stuff.
             g_signals.Inventory(inv.hash);
@@ -3591,10 +3983,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LogPrint("net", "  got inventory: %s  %s\n", inv.ToString(), fAlreadyHave ? "have" : "new");
 
             if (!fAlreadyHave) {
-                if (!fImporting)
-                    pfrom->AskFor(inv);
+                if (!fImporting) {
+                    if (inv.type == MSG_BLOCK)
+                        blockDownloadQueue.Queue(pfrom->GetId(), inv.hash, nInv == nLastBlock);
+                    else
+                        pfrom->AskFor(inv);
+                }
             } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
-                PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(inv.hash));
+                if (!blockDownloadQueue.IsQueued(WantedByOrphan(mapOrphanBlocks[inv.hash])))
+                    PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(inv.hash));
             } else if (nInv == nLastBlock) {
                 // In case we are on a very long side-chain, it is possible that we already have
                 // the last block in an inv bundle sent in response to getblocks. Try to detect
@@ -3692,7 +4089,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3724,6 +4121,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vector<uint256> vEraseQueue;
         CTransaction tx;
         vRecv >> tx;
+        tx.CacheHash();
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
@@ -3790,6 +4188,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     {
         CBlock block;
         vRecv >> block;
+        block.CacheTxHashes();
         uint256 hashBlock = block.GetHash();
 
         LogPrint("net", "received block %s\n", hashBlock.ToString());
@@ -3799,15 +4198,38 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         LOCK(cs_main);
 
+        blockDownloadQueue.Received(hashBlock);
         if (ProcessBlock(pfrom, &block))
             mapAlreadyAskedFor.erase(inv);
-        if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+        if (block.nDoS)
+        {
+            pfrom->Misbehaving(block.nDoS);
+            // don't wait for the rest of what it promised
+            blockDownloadQueue.RemovePeer(pfrom->GetId());
+        }
 
         if (fSecMsgEnabled)
             SecureMsgScanBlock(block);
     }
 
 
+    else if (strCommand == "notfound")
+    {
+        vector<CInv> vInv;
+        vRecv >> vInv;
+        if (vInv.size() > MAX_INV_SZ)
+        {
+            pfrom->Misbehaving(20);
+            return error("message notfound size() = %u", vInv.size());
+        }
+
+        // Blocks the peer can't serve after all go straight back to the queue
+        BOOST_FOREACH(const CInv& inv, vInv)
+            if (inv.type == MSG_BLOCK)
+                blockDownloadQueue.NotFound(pfrom->GetId(), inv.hash);
+    }
+
+
     else if (strCommand == "getaddr")
     {
         // Don't return addresses older than nCutOff timestamp
@@ -4045,11 +4467,18 @@ bool ProcessMessages(CNode* pfrom)
             continue;
         }
 
-        // Process message
+        // Process message, in parallel with other peers' messages when it
+        // only concerns this peer
         bool fRet = false;
         try
         {
-            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            if (strCommand == "getdata" || strCommand == "ping" || strCommand == "pong")
+                fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            else
+            {
+                LOCK(cs_ProcessMessage);
+                fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            }
             boost::this_thread::interruption_point();
         }
         catch (std::ios_base::failure& e)
@@ -4094,178 +4523,216 @@ bool ProcessMessages(CNode* pfrom)
 
 bool SendMessages(CNode* pto, bool fSendTrickle)
 {
-    TRY_LOCK(cs_main, lockMain);
-    if (lockMain) {
-        // Don't send anything until we get their version message
-        if (pto->nVersion == 0)
-            return true;
+    // Don't send anything until we get their version message
+    if (pto->nVersion == 0)
+        return true;
 
-        //
-        // Message: ping
-        //
-        bool pingSend = false;
-        if (pto->fPingQueued) {
-            // RPC ping request by user
-            pingSend = true;
-        }
-        if (pto->nPingNonceSent == 0 && pto->nPingUsecStart + PING_INTERVAL * 1000000 < GetTimeMicros()) {
-            // Ping automatically sent as a latency probe & keepalive.
-            pingSend = true;
+    //
+    // Message: ping
+    //
+    bool pingSend = false;
+    if (pto->fPingQueued) {
+        // RPC ping request by user
+        pingSend = true;
+    }
+    if (pto->nPingNonceSent == 0 && pto->nPingUsecStart + PING_INTERVAL * 1000000 < GetTimeMicros()) {
+        // Ping automatically sent as a latency probe & keepalive.
+        pingSend = true;
+    }
+    if (pingSend) {
+        uint64_t nonce = 0;
+        while (nonce == 0) {
+            RAND_bytes((unsigned char*)&nonce, sizeof(nonce));
         }
-        if (pingSend) {
-            uint64_t nonce = 0;
-            while (nonce == 0) {
-                RAND_bytes((unsigned char*)&nonce, sizeof(nonce));
-            }
-            pto->fPingQueued = false;
-            pto->nPingUsecStart = GetTimeMicros();
-            if (pto->nVersion > BIP0031_VERSION) {
-                pto->nPingNonceSent = nonce;
-                pto->PushMessage("ping", nonce);
-            } else {
-                // Peer is too old to support ping command with nonce, pong will never arrive.
-                pto->nPingNonceSent = 0;
-                pto->PushMessage("ping");
-            }
+        pto->fPingQueued = false;
+        pto->nPingUsecStart = GetTimeMicros();
+        if (pto->nVersion > BIP0031_VERSION) {
+            pto->nPingNonceSent = nonce;
+            pto->PushMessage("ping", nonce);
+        } else {
+            // Peer is too old to support ping command with nonce, pong will never arrive.
+            pto->nPingNonceSent = 0;
+            pto->PushMessage("ping");
         }
+    }
 
+    // Start block sync, resend wallet transactions that haven't gotten in a
+    // block yet. Both need the chain, the resend only runs on trickle passes
+    // as it is not specific to this peer.
+    bool fStartSync = pto->fStartSync && !fImporting && !fReindex;
+    if (fStartSync || fSendTrickle)
+    {
         TRY_LOCK(cs_main, lockMain);
-        if(!lockMain)
-            return true;
+        if (lockMain)
+        {
+            if (fStartSync) {
+                pto->fStartSync = false;
+                PushGetBlocks(pto, pindexBest, uint256(0));
+            }
 
-        // Start block sync
-        if (pto->fStartSync && !fImporting && !fReindex) {
-            pto->fStartSync = false;
-            PushGetBlocks(pto, pindexBest, uint256(0));
+            if (fSendTrickle)
+                ResendWalletTransactions();
         }
+    }
 
-        // Resend wallet transactions that haven't gotten in a block yet
-        ResendWalletTransactions();
-
-        // Address refresh broadcast
-        static int64_t nLastRebroadcast;
-        if (!IsInitialBlockDownload() && (GetTime() - nLastRebroadcast > 24 * 60 * 60))
+    // The known and queued addresses of every peer are changed by the
+    // handlers of other peers' messages
+    {
+        TRY_LOCK(cs_ProcessMessage, lockProcess);
+        if (lockProcess)
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
+            // Address refresh broadcast
+            static int64_t nLastRebroadcast;
+            bool fRebroadcast = false;
+            if (GetTime() - nLastRebroadcast > 24 * 60 * 60)
+            {
+                TRY_LOCK(cs_main, lockMain);
+                if (lockMain)
+                    fRebroadcast = !IsInitialBlockDownload();
+            }
+            if (fRebroadcast)
             {
-                // Periodically clear setAddrKnown to allow refresh broadcasts
-                if (nLastRebroadcast)
-                    pnode->setAddrKnown.clear();
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                {
+                    // Periodically clear setAddrKnown to allow refresh broadcasts
+                    if (nLastRebroadcast)
+                        pnode->setAddrKnown.clear();
 
-                // Rebroadcast our address
-                AdvertizeLocal(pnode);
+                    // Rebroadcast our address
+                    AdvertizeLocal(pnode);
+                }
+                if (!vNodes.empty())
+                    nLastRebroadcast = GetTime();
             }
-            if (!vNodes.empty())
-                nLastRebroadcast = GetTime();
-        }
 
-        //
-        // Message: addr
-        //
-        if (fSendTrickle)
-        {
-            vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
+            //
+            // Message: addr
+            //
+            if (fSendTrickle)
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                vector<CAddress> vAddr;
+                vAddr.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
                 {
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
+                    // returns true if wasn't already contained in the set
+                    if (pto->setAddrKnown.insert(addr).second)
                     {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
+                        vAddr.push_back(addr);
+                        // receiver rejects addr messages larger than 1000
+                        if (vAddr.size() >= 1000)
+                        {
+                            pto->PushMessage("addr", vAddr);
+                            vAddr.clear();
+                        }
                     }
                 }
+                pto->vAddrToSend.clear();
+                if (!vAddr.empty())
+                    pto->PushMessage("addr", vAddr);
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage("addr", vAddr);
         }
+    }
 
 
-        //
-        // Message: inventory
-        //
-        vector<CInv> vInv;
-        vector<CInv> vInvWait;
+    //
+    // Message: inventory
+    //
+    vector<CInv> vInv;
+    vector<CInv> vInvWait;
+    {
+        LOCK(pto->cs_inventory);
+        vInv.reserve(pto->vInventoryToSend.size());
+        vInvWait.reserve(pto->vInventoryToSend.size());
+        BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
         {
-            LOCK(pto->cs_inventory);
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
-            BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
+            if (pto->setInventoryKnown.count(inv))
+                continue;
+
+            // trickle out tx inv to protect privacy
+            if (inv.type == MSG_TX && !fSendTrickle)
             {
-                if (pto->setInventoryKnown.count(inv))
-                    continue;
+                // 1/4 of tx invs blast to all immediately
+                static uint256 hashSalt = GetRandHash();
+                uint256 hashRand = inv.hash ^ hashSalt;
+                hashRand = Hash(BEGIN(hashRand), END(hashRand));
+                bool fTrickleWait = ((hashRand & 3) != 0);
 
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
+                if (fTrickleWait)
                 {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
-
-                    if (fTrickleWait)
-                    {
-                        vInvWait.push_back(inv);
-                        continue;
-                    }
+                    vInvWait.push_back(inv);
+                    continue;
                 }
+            }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+            // returns true if wasn't already contained in the set
+            if (pto->setInventoryKnown.insert(inv).second)
+            {
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000)
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
-            pto->vInventoryToSend = vInvWait;
         }
-        if (!vInv.empty())
-            pto->PushMessage("inv", vInv);
+        pto->vInventoryToSend = vInvWait;
+    }
+    if (!vInv.empty())
+        pto->PushMessage("inv", vInv);
 
 
-        //
-        // Message: getdata
-        //
-        vector<CInv> vGetData;
-        int64_t nNow = GetTime() * 1000000;
-        CTxDB txdb("r");
-        while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
+    //
+    // Message: getdata
+    //
+    // Only looks at the chain, through AlreadyHave and the block download
+    // queue, when a request is actually due
+    int64_t nNow = GetTime() * 1000000;
+    bool fDownload = !fImporting && !fReindex && !pto->fClient && !pto->fDisconnect && pto->fSuccessfullyConnected &&
+        (pto->nVersion < NOBLKS_VERSION_START || pto->nVersion >= NOBLKS_VERSION_END) && !blockDownloadQueue.IsEmpty();
+    bool fAskFor = !pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow;
+    if (fDownload || fAskFor)
+    {
+        TRY_LOCK(cs_ProcessMessage, lockProcess);
+        if (lockProcess)
         {
-            const CInv& inv = (*pto->mapAskFor.begin()).second;
-            if (!AlreadyHave(txdb, inv))
+            TRY_LOCK(cs_main, lockMain);
+            if (lockMain)
             {
-                if (fDebug)
-                    LogPrint("net", "sending getdata: %s\n", inv.ToString());
-                vGetData.push_back(inv);
-                if (vGetData.size() >= 1000)
+                vector<CInv> vGetData;
+                if (fDownload)
                 {
-                    pto->PushMessage("getdata", vGetData);
-                    vGetData.clear();
+                    // A peer that was ahead of us when it connected most likely has
+                    // what we are missing, even if it has not announced it
+                    blockDownloadQueue.Schedule(pto->GetId(), pto->nStartingHeight > nBestHeight, GetTime(), vGetData);
                 }
-                mapAlreadyAskedFor[inv] = nNow;
+                CTxDB txdb("r");
+                while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
+                {
+                    const CInv& inv = (*pto->mapAskFor.begin()).second;
+                    if (!AlreadyHave(txdb, inv))
+                    {
+                        if (fDebug)
+                            LogPrint("net", "sending getdata: %s\n", inv.ToString());
+                        vGetData.push_back(inv);
+                        if (vGetData.size() >= 1000)
+                        {
+                            pto->PushMessage("getdata", vGetData);
+                            vGetData.clear();
+                        }
+                        mapAlreadyAskedFor[inv] = nNow;
+                    }
+                    pto->mapAskFor.erase(pto->mapAskFor.begin());
+                }
+                if (!vGetData.empty())
+                    pto->PushMessage("getdata", vGetData);
             }
-            pto->mapAskFor.erase(pto->mapAskFor.begin());
         }
-        if (!vGetData.empty())
-            pto->PushMessage("getdata", vGetData);
+    }
 
-        if (fSecMsgEnabled)
-            SecureMsgSendData(pto, fSendTrickle); // should be in cs_main?
+    if (fSecMsgEnabled)
+        SecureMsgSendData(pto, fSendTrickle);
 
-    }
     return true;
 }
 
@@ -13,8 +13,11 @@
 #include "script.h"
 #include "hashblock.h"
 
+#include <limits>
 #include <list>
 
+#include <boost/unordered_map.hpp>
+
 class CValidationState;
 
 #define START_MASTERNODE_PAYMENTS_TESTNET 1432907775 
@@ -76,6 +79,18 @@ static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
 static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 500;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
+/** Number of blocks that can be requested from a single peer at once */
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Only blocks this far ahead of the first one still missing are requested */
+static const unsigned int BLOCK_DOWNLOAD_WINDOW = 256;
+/** Seconds a peer gets to deliver a requested block before it is asked elsewhere */
+static const int64_t BLOCK_DOWNLOAD_TIMEOUT = 60;
+/** Blocks one peer can have waiting in the download queue, two getblocks replies */
+static const unsigned int MAX_QUEUED_BLOCKS_PER_PEER = 1000;
+/** Blocks that can be waiting in the download queue in total */
+static const unsigned int MAX_QUEUED_BLOCKS = 4000;
+/** Total size of the serialized blocks kept in memory for answering getdata */
+static const unsigned int MAX_RAW_BLOCK_CACHE_SIZE = 8 * 1024 * 1024;
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
 static const int64_t MIN_TX_FEE = 100;
 /** Fees smaller than this (in satoshi) are considered zero fee (for relaying) */
@@ -92,6 +107,8 @@ static const int MODIFIER_INTERVAL_SWITCH = 1;
 inline bool MoneyRange(int64_t nValue) { return (nValue >= 0 && nValue <= MAX_MONEY); }
 /** Threshold for nLockTime: below this value it is interpreted as block number, otherwise as UNIX timestamp. */
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
+/** Maximum number of script-checking threads allowed */
+static const int MAX_SCRIPTCHECK_THREADS = 16;
 
 inline bool IsProtocolV1RetargetingFixed(int nHeight) { return TestNet() || nHeight > 0; }
 inline bool IsProtocolV2(int nHeight) { return TestNet() || nHeight > 0; }
@@ -104,10 +121,17 @@ inline unsigned int GetTargetSpacing(int nHeight) { return IsProtocolV2(nHeight)
 
 inline int64_t GetMNCollateral() { return 30000; }
 
+struct BlockHasher
+{
+    // block hashes are already uniformly distributed in their low bits
+    size_t operator()(const uint256& hash) const { return hash.Get64(); }
+};
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern BlockMap mapBlockIndex;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern CBlockIndex* pindexGenesisBlock;
 extern unsigned int nStakeMinAge;
@@ -121,10 +145,14 @@ extern CBlockIndex* pindexBest;
 extern uint64_t nLastBlockTx;
 extern uint64_t nLastBlockSize;
 extern int64_t nLastCoinStakeSearchInterval;
+extern int64_t nLastCoinStakeSearchDuration;
+extern uint64_t nLastCoinStakeSearchKernels;
 extern const std::string strMessageMagic;
 extern int64_t nTimeBestReceived;
 extern bool fImporting;
 extern bool fReindex;
+extern int nScriptCheckThreads;
+extern bool fAddrIndex;
 struct COrphanBlock;
 extern std::map<uint256, COrphanBlock*> mapOrphanBlocks;
 extern bool fHaveGUI;
@@ -142,6 +170,7 @@ class CReserveKey;
 class CTxDB;
 class CTxIndex;
 class CWalletInterface;
+class CScriptCheck;
 
 /** Register a wallet to receive updates from core */
 void RegisterWallet(CWalletInterface* pwalletIn);
@@ -165,12 +194,24 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock);
 bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
 FILE* AppendBlockFile(unsigned int& nFileRet);
+/** Count an X11 block header hash computed by the current thread */
+void CountBlockHash();
+/** Number of X11 block header hashes the current thread has computed */
+uint64_t GetBlockHashCount();
+/** Read a block from its blk file as a complete "block" message, without
+ *  decoding it, so it can be queued to peers as it is */
+bool ReadRawBlockFromDisk(CSharedMessage& msg, const CBlockIndex* pindex);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
+/** Return the block of the best chain at nHeight, or NULL if there is none */
 CBlockIndex* FindBlockByHeight(int nHeight);
+/** Make pindexNew the tip of the chain FindBlockByHeight looks in */
+void SetBlockIndexByHeight(CBlockIndex* pindexNew);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles);
+/** Run an instance of the script checking thread */
+void ThreadScriptCheck();
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake);
@@ -194,7 +235,7 @@ bool AcceptableInputs(CTxMemPool& pool, const CTransaction &txo, bool fLimitFree
                         bool* pfMissingInputs);
 
 
-bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint256> &vtxhash);
+bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint256> &vtxhash, int nSkip = 0, int nCount = std::numeric_limits<int>::max());
 
 int GetInputAge(CTxIn& vin);
 /** Abort with a message */
@@ -205,6 +246,92 @@ void Misbehaving(NodeId nodeid, int howmuch);
 int64_t GetMasternodePayment(int nHeight, int64_t blockValue);
 
 
+/** Blocks that were announced to us and still have to be downloaded, in the
+ *  order they were announced (chain order for getblocks replies), with the
+ *  peers each one can be requested from. Every peer has an index of the
+ *  entries that mention it, so dropping a peer doesn't scan the queue. */
+class CBlockDownloadQueue
+{
+private:
+    struct CQueuedBlock
+    {
+        uint256 hash;
+        // Peers that announced it, and peers that failed to deliver it
+        std::set<NodeId> setSources;
+        std::set<NodeId> setStalled;
+        // Peer that announced it last in a getblocks reply. Serving it is what
+        // makes that peer send the next batch (hashContinue), so it is asked
+        // from that peer.
+        NodeId nodeContinue;
+        // Peer it is currently requested from (-1 if none), and since when
+        NodeId nodeInFlight;
+        int64_t nTimeRequested;
+    };
+    typedef std::list<CQueuedBlock> QueuedBlockList;
+
+    CCriticalSection cs;
+    QueuedBlockList lBlocks;
+    std::map<uint256, QueuedBlockList::iterator> mapBlocks;
+    // Entries each peer is mentioned in, in any role
+    std::map<NodeId, std::set<uint256> > mapPeerBlocks;
+    // Number of blocks requested from each peer
+    std::map<NodeId, int> mapInFlight;
+
+    void Erase(QueuedBlockList::iterator it);
+    void ReleaseInFlight(CQueuedBlock& queued, bool fStalled);
+    bool ForgetPeer(CQueuedBlock& queued, NodeId nodeid);
+
+public:
+    /** Remember that nodeid has the block. Fails if the queue or the peer's
+     *  share of it is full, or the peer already failed to deliver it. */
+    bool Queue(NodeId nodeid, const uint256& hash, bool fContinue);
+    /** Whether the block is queued or already requested from a peer */
+    bool IsQueued(const uint256& hash);
+    bool IsEmpty();
+    /** The block arrived, no matter from whom, so stop waiting for it */
+    void Received(const uint256& hash);
+    /** nodeid does not have the block after all, ask someone else at once */
+    void NotFound(NodeId nodeid, const uint256& hash);
+    /** Drop nodeid from every entry, and the entries only it could serve */
+    void RemovePeer(NodeId nodeid);
+    /** Add getdata requests for the blocks nodeid should download now,
+     *  taking over the ones other peers have not delivered in time. fAhead
+     *  means the peer may have blocks it has not announced. */
+    void Schedule(NodeId nodeid, bool fAhead, int64_t nNow, std::vector<CInv>& vGetData);
+
+    unsigned int GetSize();
+    int GetInFlight(NodeId nodeid);
+    unsigned int GetPeerEntries(NodeId nodeid);
+};
+
+/** Recently served "block" messages by block hash. Once their total size
+ *  passes nMaxSize the least recently used ones are dropped. The messages are
+ *  shared with the send queues of the peers they went to, never copied. */
+class CRawBlockCache
+{
+private:
+    typedef std::list<std::pair<uint256, CSharedMessage> > MessageList;
+
+    CCriticalSection cs;
+    MessageList lMessages; // most recently used first
+    std::map<uint256, MessageList::iterator> mapMessages;
+    size_t nSize;
+    size_t nMaxSize;
+
+public:
+    CRawBlockCache(size_t nMaxSizeIn) : nSize(0), nMaxSize(nMaxSizeIn) {}
+
+    bool Get(const uint256& hash, CSharedMessage& msg);
+    void Insert(const uint256& hash, const CSharedMessage& msg);
+
+    size_t GetSize()
+    {
+        LOCK(cs);
+        return nSize;
+    }
+};
+
+
 /** Position on disk for a particular transaction. */
 class CDiskTxPos
 {
@@ -284,16 +411,41 @@ public:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
 
+private:
+    // memory only: the hash, kept only once CacheHash() said nothing will
+    // change the transaction any more. Copies don't keep it, so a copy can
+    // be changed like any other transaction.
+    mutable uint256 hashCached;
+    mutable bool fHashCached;
+
+public:
     CTransaction()
     {
         SetNull();
     }
 
     CTransaction(int nVersion, unsigned int nTime, const std::vector<CTxIn>& vin, const std::vector<CTxOut>& vout, unsigned int nLockTime)
-        : nVersion(nVersion), nTime(nTime), vin(vin), vout(vout), nLockTime(nLockTime), nDoS(0)
+        : nVersion(nVersion), nTime(nTime), vin(vin), vout(vout), nLockTime(nLockTime), nDoS(0), fHashCached(false)
+    {
+    }
+
+    CTransaction(const CTransaction& tx)
+        : nVersion(tx.nVersion), nTime(tx.nTime), vin(tx.vin), vout(tx.vout), nLockTime(tx.nLockTime), nDoS(tx.nDoS), fHashCached(false)
     {
     }
 
+    CTransaction& operator=(const CTransaction& tx)
+    {
+        nVersion = tx.nVersion;
+        nTime = tx.nTime;
+        vin = tx.vin;
+        vout = tx.vout;
+        nLockTime = tx.nLockTime;
+        nDoS = tx.nDoS;
+        fHashCached = false;
+        return *this;
+    }
+
     IMPLEMENT_SERIALIZE
     (
         READWRITE(this->nVersion);
@@ -302,6 +454,8 @@ public:
         READWRITE(vin);
         READWRITE(vout);
         READWRITE(nLockTime);
+        if (fRead)
+            fHashCached = false;
     )
 
     void SetNull()
@@ -312,6 +466,7 @@ public:
         vout.clear();
         nLockTime = 0;
         nDoS = 0;  // Denial-of-service prevention
+        fHashCached = false;
     }
 
     bool IsNull() const
@@ -321,9 +476,19 @@ public:
 
     uint256 GetHash() const
     {
+        if (fHashCached)
+            return hashCached;
         return SerializeHash(*this);
     }
 
+    // Only for transactions nothing changes again: received from a peer or
+    // read from the block files for validation, or held by the mempool
+    void CacheHash()
+    {
+        hashCached = SerializeHash(*this);
+        fHashCached = true;
+    }
+
     bool IsCoinBase() const
     {
         return (vin.size() == 1 && vin[0].prevout.IsNull() && vout.size() >= 1);
@@ -447,11 +612,13 @@ public:
         @param[in] pindexBlock
         @param[in] fBlock	true if called from ConnectBlock
         @param[in] fMiner	true if called from CreateNewBlock
+        @param[out] pvChecks	if non-NULL, script checks are appended here instead of being run
         @return Returns true if all checks succeed
      */
-    bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
+    bool ConnectInputs(CTxDB& txdb, const MapPrevTx& inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS, bool fValidateSig = true);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS, bool fValidateSig = true,
+                       std::vector<CScriptCheck> *pvChecks = NULL);
     bool CheckTransaction() const;
     bool GetCoinAge(CTxDB& txdb, uint64_t& nCoinAge) const;  // ppcoin: get transaction coin age
 
@@ -497,6 +664,34 @@ unsigned int GetLegacySigOpCount(const CTransaction& tx);
  */
 unsigned int GetP2SHSigOpCount(const CTransaction& tx, const MapPrevTx& mapInputs);
 
+/** Closure representing one script verification.
+ *  Note that this stores a reference to the spending transaction */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction *ptxTo;
+    unsigned int nIn;
+    unsigned int nFlags;
+    int nHashType;
+
+public:
+    CScriptCheck() : ptxTo(0), nIn(0), nFlags(0), nHashType(0) {}
+    CScriptCheck(const CTransaction& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
+        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
+
+    bool operator()() const;
+
+    void swap(CScriptCheck &check) {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(nFlags, check.nFlags);
+        std::swap(nHashType, check.nHashType);
+    }
+};
+
 /** Check for standard transaction types
     @return True if all outputs (scriptPubKeys) use only standard transaction forms
 */
@@ -659,6 +854,13 @@ public:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
 
+private:
+    // memory only: X11 hash of the header and the header bytes it was computed from
+    mutable uint256 hashCached;
+    mutable unsigned char pchHashedHeader[80];
+    mutable bool fHashCached;
+
+public:
     CBlock()
     {
         SetNull();
@@ -699,6 +901,7 @@ public:
         vchBlockSig.clear();
         vMerkleTree.clear();
         nDoS = 0;
+        fHashCached = false;
     }
 
     bool IsNull() const
@@ -708,18 +911,35 @@ public:
 
     uint256 GetHash() const
     {
-        if (nVersion > 6)
-            //return Hash(BEGIN(nVersion), END(nNonce));
-			return Hash9(BEGIN(nVersion), END(nNonce));
-        else
-            return GetPoWHash();
+        // Both versions hash the header with X11
+        //return Hash(BEGIN(nVersion), END(nNonce));
+        return GetPoWHash();
     }
 
     uint256 GetPoWHash() const
     {
 		//return scrypt_blockhash(CVOIDBEGIN(nVersion)); scrypt algo
 		//return Hash(BEGIN(nVersion), END(nNonce));    sha256 algo
-		return Hash9(BEGIN(nVersion), END(nNonce)); // X... algo series
+        // X... algo series. The header fields are public and get changed in place
+        // (nonce, time), so the hash is kept only while the header bytes match.
+        const char* pbegin = BEGIN(nVersion);
+        assert(END(nNonce) - pbegin == sizeof(pchHashedHeader));
+        if (!fHashCached || memcmp(pchHashedHeader, pbegin, sizeof(pchHashedHeader)) != 0)
+        {
+            hashCached = Hash9(BEGIN(nVersion), END(nNonce));
+            memcpy(pchHashedHeader, pbegin, sizeof(pchHashedHeader));
+            fHashCached = true;
+            CountBlockHash();
+        }
+        return hashCached;
+    }
+
+    // Use a hash that is already known for the current header, such as the one in the block index
+    void SetHash(const uint256& hash) const
+    {
+        hashCached = hash;
+        memcpy(pchHashedHeader, BEGIN(nVersion), sizeof(pchHashedHeader));
+        fHashCached = true;
     }
 
     int64_t GetBlockTime() const
@@ -763,23 +983,13 @@ public:
         return maxTransactionTime;
     }
 
-    uint256 BuildMerkleTree() const
+    uint256 BuildMerkleTree() const;
+
+    // See CTransaction::CacheHash(), for blocks only read to be validated
+    void CacheTxHashes()
     {
-        vMerkleTree.clear();
-        BOOST_FOREACH(const CTransaction& tx, vtx)
-            vMerkleTree.push_back(tx.GetHash());
-        int j = 0;
-        for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
-        {
-            for (int i = 0; i < nSize; i += 2)
-            {
-                int i2 = std::min(i+1, nSize-1);
-                vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                           BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
-            }
-            j += nSize;
-        }
-        return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
+        BOOST_FOREACH(CTransaction& tx, vtx)
+            tx.CacheHash();
     }
 
     std::vector<uint256> GetMerkleBranch(int nIndex) const
@@ -900,7 +1110,7 @@ public:
     bool AcceptBlock();
     bool SignBlock(CWallet& keystore, int64_t nFees);
     bool CheckBlockSignature() const;
-    void RebuildAddressIndex(CTxDB& txdb);
+    void RebuildAddressIndex(CTxDB& txdb, int nHeight);
 
 private:
     bool SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew);
@@ -1022,6 +1232,8 @@ public:
         block.nTime          = nTime;
         block.nBits          = nBits;
         block.nNonce         = nNonce;
+        if (phashBlock)
+            block.SetHash(*phashBlock);
         return block;
     }
 
@@ -1251,7 +1463,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1302,7 +1514,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1321,7 +1533,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1337,7 +1549,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -24,8 +24,6 @@ map<uint256, int> mapSeenMasternodeScanningErrors;
 std::map<CNetAddr, int64_t> askedForMasternodeList;
 // which masternodes we've asked for
 std::map<COutPoint, int64_t> askedForMasternodeListEntry;
-// cache block hashes as we calculate them
-std::map<int64_t, uint256> mapCacheBlockHashes;
 
 // manage the masternode connections
 void ProcessMasternodeConnections(){
@@ -420,14 +418,77 @@ int GetMasternodeByVin(CTxIn& vin)
     return -1;
 }
 
+// Scores of the masternode list for the last few (mod, height) pairs, in
+// vecMasternodes order. Payment voting and ranking ask for several heights
+// around the tip in turn, so one entry per height avoids recomputing them all
+// on every call. Each entry remembers the block hash it was computed for and
+// the list it scored, so a reorg or a list change simply causes a rebuild.
+struct CMasternodeScores
+{
+    uint256 hashBlock;
+    std::vector<COutPoint> vecPrevouts;
+    std::vector<unsigned int> vecScores;
+};
+
+static const unsigned int MAX_MASTERNODE_SCORE_CACHE = 8;
+static std::map<std::pair<int, int64_t>, CMasternodeScores> mapMasternodeScores;
+
+static const std::vector<unsigned int>& GetMasternodeScores(int mod, int64_t nBlockHeight)
+{
+    AssertLockHeld(cs_masternodes);
+
+    // an unknown height scores every masternode 0
+    uint256 hash = 0;
+    GetBlockHash(hash, nBlockHeight);
+
+    std::pair<int, int64_t> key = make_pair(mod, nBlockHeight);
+    std::map<std::pair<int, int64_t>, CMasternodeScores>::iterator it = mapMasternodeScores.find(key);
+    if(it != mapMasternodeScores.end()){
+        const CMasternodeScores& scores = it->second;
+        bool fValid = scores.hashBlock == hash && scores.vecPrevouts.size() == vecMasternodes.size();
+        for (unsigned int i = 0; fValid && i < vecMasternodes.size(); i++)
+            fValid = scores.vecPrevouts[i] == vecMasternodes[i].vin.prevout;
+        if(fValid)
+            return scores.vecScores;
+    } else {
+        // make room by dropping the lowest height, which is the least likely
+        // to be asked for again
+        if(mapMasternodeScores.size() >= MAX_MASTERNODE_SCORE_CACHE){
+            std::map<std::pair<int, int64_t>, CMasternodeScores>::iterator itOldest = mapMasternodeScores.begin();
+            for (std::map<std::pair<int, int64_t>, CMasternodeScores>::iterator mi = mapMasternodeScores.begin(); mi != mapMasternodeScores.end(); ++mi)
+                if(mi->first.second < itOldest->first.second) itOldest = mi;
+            mapMasternodeScores.erase(itOldest);
+        }
+        it = mapMasternodeScores.insert(make_pair(key, CMasternodeScores())).first;
+    }
+
+    CMasternodeScores& scores = it->second;
+    scores.hashBlock = hash;
+    scores.vecPrevouts.resize(vecMasternodes.size());
+    scores.vecScores.resize(vecMasternodes.size());
+    for (unsigned int i = 0; i < vecMasternodes.size(); i++)
+    {
+        uint256 n = vecMasternodes[i].CalculateScore(mod, nBlockHeight);
+        unsigned int n2 = 0;
+        memcpy(&n2, &n, sizeof(n2));
+
+        scores.vecPrevouts[i] = vecMasternodes[i].vin.prevout;
+        scores.vecScores[i] = n2;
+    }
+
+    return scores.vecScores;
+}
+
 int GetCurrentMasterNode(int mod, int64_t nBlockHeight, int minProtocol)
 {
     int i = 0;
     unsigned int score = 0;
     int winner = -1;
     LOCK(cs_masternodes);
+    const std::vector<unsigned int>& vecScores = GetMasternodeScores(mod, nBlockHeight);
     // scan for winner
-    BOOST_FOREACH(CMasterNode mn, vecMasternodes) {
+    for (unsigned int j = 0; j < vecMasternodes.size(); j++) {
+        CMasterNode& mn = vecMasternodes[j];
         mn.Check();
         if(mn.protocolVersion < minProtocol) continue;
         if(!mn.IsEnabled()) {
@@ -435,12 +496,8 @@ int GetCurrentMasterNode(int mod, int64_t nBlockHeight, int minProtocol)
             continue;
         }
 
-        // calculate the score for each masternode
-        uint256 n = mn.CalculateScore(mod, nBlockHeight);
-        unsigned int n2 = 0;
-        memcpy(&n2, &n, sizeof(n2));
-
         // determine the winner
+        unsigned int n2 = vecScores[j];
         if(n2 > score){
             score = n2;
             winner = i;
@@ -457,9 +514,11 @@ int GetMasternodeByRank(int findRank, int64_t nBlockHeight, int minProtocol)
     int i = 0;
 
     std::vector<pair<unsigned int, int> > vecMasternodeScores;
+    const std::vector<unsigned int>& vecScores = GetMasternodeScores(1, nBlockHeight);
 
     i = 0;
-    BOOST_FOREACH(CMasterNode mn, vecMasternodes) {
+    for (unsigned int j = 0; j < vecMasternodes.size(); j++) {
+        CMasterNode& mn = vecMasternodes[j];
         mn.Check();
         if(mn.protocolVersion < minProtocol) continue;
         if(!mn.IsEnabled()) {
@@ -467,11 +526,7 @@ int GetMasternodeByRank(int findRank, int64_t nBlockHeight, int minProtocol)
             continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        unsigned int n2 = 0;
-        memcpy(&n2, &n, sizeof(n2));
-
-        vecMasternodeScores.push_back(make_pair(n2, i));
+        vecMasternodeScores.push_back(make_pair(vecScores[j], i));
         i++;
     }
 
@@ -490,8 +545,10 @@ int GetMasternodeRank(CTxIn& vin, int64_t nBlockHeight, int minProtocol)
 {
     LOCK(cs_masternodes);
     std::vector<pair<unsigned int, CTxIn> > vecMasternodeScores;
+    const std::vector<unsigned int>& vecScores = GetMasternodeScores(1, nBlockHeight);
 
-    BOOST_FOREACH(CMasterNode& mn, vecMasternodes) {
+    for (unsigned int j = 0; j < vecMasternodes.size(); j++) {
+        CMasterNode& mn = vecMasternodes[j];
         mn.Check();
 
         if(mn.protocolVersion < minProtocol) continue;
@@ -499,11 +556,7 @@ int GetMasternodeRank(CTxIn& vin, int64_t nBlockHeight, int minProtocol)
             continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        unsigned int n2 = 0;
-        memcpy(&n2, &n, sizeof(n2));
-
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
+        vecMasternodeScores.push_back(make_pair(vecScores[j], mn.vin));
     }
 
     sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareValueOnly());
@@ -519,7 +572,7 @@ int GetMasternodeRank(CTxIn& vin, int64_t nBlockHeight, int minProtocol)
     return -1;
 }
 
-//Get the last hash that matches the modulus given. Processed in reverse order
+//Get the hash of the block before nBlockHeight (the tip's parent for 0, the tip for negative heights)
 bool GetBlockHash(uint256& hash, int nBlockHeight)
 {
     if (pindexBest == NULL) return false;
@@ -527,34 +580,16 @@ bool GetBlockHash(uint256& hash, int nBlockHeight)
     if(nBlockHeight == 0)
         nBlockHeight = pindexBest->nHeight;
 
-    if(mapCacheBlockHashes.count(nBlockHeight)){
-        hash = mapCacheBlockHashes[nBlockHeight];
-        return true;
-    }
-
-    const CBlockIndex *BlockLastSolved = pindexBest;
-    const CBlockIndex *BlockReading = pindexBest;
+    if (pindexBest->nHeight == 0 || pindexBest->nHeight+1 < nBlockHeight) return false;
 
-    if (BlockLastSolved == NULL || BlockLastSolved->nHeight == 0 || pindexBest->nHeight+1 < nBlockHeight) return false;
+    int nHeight = nBlockHeight > 0 ? nBlockHeight - 1 : pindexBest->nHeight;
+    if (nHeight <= 0) return false;
 
-    int nBlocksAgo = 0;
-    if(nBlockHeight > 0) nBlocksAgo = (pindexBest->nHeight+1)-nBlockHeight;
-    assert(nBlocksAgo >= 0);
+    CBlockIndex* pindex = FindBlockByHeight(nHeight);
+    if (pindex == NULL) return false;
 
-    int n = 0;
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if(n >= nBlocksAgo){
-            hash = BlockReading->GetBlockHash();
-            mapCacheBlockHashes[nBlockHeight] = hash;
-            return true;
-        }
-        n++;
-
-        if (BlockReading->pprev == NULL) { assert(BlockReading); break; }
-        BlockReading = BlockReading->pprev;
-    }
-
-    return false;
+    hash = pindex->GetBlockHash();
+    return true;
 }
 
 //
@@ -582,7 +617,10 @@ uint256 CMasterNode::CalculateScore(int mod, int64_t nBlockHeight)
 void CMasterNode::Check()
 {
     //once spent, stop doing the checks
-    if(enabled==3) return;
+    if(nCollateralState == MASTERNODE_COLLATERAL_SPENT){
+        enabled = 3;
+        return;
+    }
 
 
     if(!UpdatedWithin(MASTERNODE_REMOVAL_SECONDS)){
@@ -595,7 +633,12 @@ void CMasterNode::Check()
         return;
     }
 
-    if(!unitTest){
+    // the collateral is only run through the mempool while its state is
+    // unknown, or once a minute while it is pending; otherwise
+    // SyncMasternodeCollateral keeps its state up to date
+    if(!unitTest && (nCollateralState == MASTERNODE_COLLATERAL_UNKNOWN ||
+                     (nCollateralState == MASTERNODE_COLLATERAL_PENDING &&
+                      GetTime() - nCollateralCheckTime >= MASTERNODE_COLLATERAL_RECHECK_SECONDS))){
         CValidationState state;
         CTransaction tx = CTransaction();
         CTxOut vout = CTxOut(2999*COIN, darkSendPool.collateralPubKey);
@@ -603,16 +646,77 @@ void CMasterNode::Check()
         tx.vout.push_back(vout);
 
         //if(!AcceptableInputs(mempool, state, tx)){
-        bool* pfMissingInputs;
-	if(!AcceptableInputs(mempool, tx, false, pfMissingInputs)){
-            enabled = 3;
-            return;
+        bool fMissingInputs = false;
+        nCollateralCheckTime = GetTime();
+        if(!AcceptableInputs(mempool, tx, false, &fMissingInputs)){
+            // a spend that is not confirmed yet may still be dropped from
+            // the mempool, so only a failure against the chain is final
+            bool fMempoolSpent = false;
+            {
+                LOCK(mempool.cs);
+                fMempoolSpent = mempool.mapNextTx.count(vin.prevout) != 0;
+            }
+            nCollateralState = (fMissingInputs || fMempoolSpent) ? MASTERNODE_COLLATERAL_PENDING : MASTERNODE_COLLATERAL_SPENT;
+        } else {
+            nCollateralState = MASTERNODE_COLLATERAL_UNSPENT;
         }
     }
 
+    if(nCollateralState == MASTERNODE_COLLATERAL_SPENT){
+        enabled = 3;
+        return;
+    }
+    if(nCollateralState == MASTERNODE_COLLATERAL_PENDING){
+        enabled = 5; // disabled, but kept in the list until the spend confirms
+        return;
+    }
+
     enabled = 1; // OK
 }
 
+static void SyncMasternodeCollateral(const std::set<COutPoint>& setPrevouts, int nState)
+{
+    if(setPrevouts.empty()) return;
+
+    LOCK(cs_masternodes);
+    BOOST_FOREACH(CMasterNode& mn, vecMasternodes) {
+        if(!setPrevouts.count(mn.vin.prevout)) continue;
+
+        // a mempool spend never overrides a confirmed one
+        if(nState == MASTERNODE_COLLATERAL_PENDING && mn.nCollateralState == MASTERNODE_COLLATERAL_SPENT) continue;
+
+        mn.nCollateralState = nState;
+        mn.nCollateralCheckTime = GetTime();
+        if(fDebug) LogPrintf("SyncMasternodeCollateral - collateral %s of masternode %s %s\n", mn.vin.prevout.ToString().c_str(),
+            mn.addr.ToString().c_str(), nState == MASTERNODE_COLLATERAL_SPENT ? "spent" :
+            nState == MASTERNODE_COLLATERAL_PENDING ? "spent in the mempool" : "needs a recheck");
+    }
+}
+
+void SyncMasternodeCollateral(const CTransaction& tx)
+{
+    if(fLiteMode || tx.IsCoinBase()) return;
+
+    std::set<COutPoint> setPrevouts;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        setPrevouts.insert(txin.prevout);
+    SyncMasternodeCollateral(setPrevouts, MASTERNODE_COLLATERAL_PENDING);
+}
+
+void SyncMasternodeCollateral(const CBlock& block, bool fConnect)
+{
+    if(fLiteMode) return;
+
+    std::set<COutPoint> setPrevouts;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        if(tx.IsCoinBase()) continue;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            setPrevouts.insert(txin.prevout);
+    }
+    // a spend that is undone has to be checked against the mempool again
+    SyncMasternodeCollateral(setPrevouts, fConnect ? MASTERNODE_COLLATERAL_SPENT : MASTERNODE_COLLATERAL_UNKNOWN);
+}
+
 bool CMasternodePayments::CheckSignature(CMasternodePaymentWinner& winner)
 {
     //note: need to investigate why this is failing
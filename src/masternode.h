@@ -38,6 +38,13 @@ class uint256;
 #define MASTERNODE_EXPIRATION_SECONDS          (43265*60) //Old 65*60
 #define MASTERNODE_REMOVAL_SECONDS             (43270*60) //Old 70*60
 
+// cached state of a masternode's collateral input
+#define MASTERNODE_COLLATERAL_UNKNOWN          0 // needs a mempool check
+#define MASTERNODE_COLLATERAL_UNSPENT          1
+#define MASTERNODE_COLLATERAL_SPENT            2 // spent in the best chain
+#define MASTERNODE_COLLATERAL_PENDING          3 // spent in the mempool only, or input not found yet
+#define MASTERNODE_COLLATERAL_RECHECK_SECONDS  (1*60)
+
 using namespace std;
 
 class CMasternodePaymentWinner;
@@ -47,7 +54,6 @@ extern std::vector<CMasterNode> vecMasternodes;
 extern CMasternodePayments masternodePayments;
 extern std::vector<CTxIn> vecMasternodeAskedFor;
 extern map<uint256, CMasternodePaymentWinner> mapSeenMasternodeVotes;
-extern map<int64_t, uint256> mapCacheBlockHashes;
 
 
 // manage the masternode connections
@@ -57,6 +63,11 @@ int CountMasternodesAboveProtocol(int protocolVersion);
 
 void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
+// update the cached collateral state of the masternode list for a
+// transaction accepted to the memory pool or a block (dis)connected
+void SyncMasternodeCollateral(const CTransaction& tx);
+void SyncMasternodeCollateral(const CBlock& block, bool fConnect);
+
 //
 // The Masternode Class. For managing the darksend process. It contains the input of the 30000 RenosCoin, signature to prove
 // it's the one who own that ip address and code for calculating the payment election.
@@ -76,6 +87,8 @@ public:
     int cacheInputAge;
     int cacheInputAgeBlock;
     int enabled;
+    int nCollateralState;
+    int64_t nCollateralCheckTime;
     bool unitTest;
     bool allowFreeTx;
     int protocolVersion;
@@ -92,6 +105,8 @@ public:
         sig = newSig;
         now = newNow;
         enabled = 1;
+        nCollateralState = MASTERNODE_COLLATERAL_UNKNOWN;
+        nCollateralCheckTime = 0;
         lastTimeSeen = 0;
         unitTest = false;
         cacheInputAge = 0;
@@ -159,6 +174,7 @@ int GetCurrentMasterNode(int mod=1, int64_t nBlockHeight=0, int minProtocol=CMas
 int GetMasternodeByVin(CTxIn& vin);
 int GetMasternodeRank(CTxIn& vin, int64_t nBlockHeight=0, int minProtocol=CMasterNode::minProtoVersion);
 int GetMasternodeByRank(int findRank, int64_t nBlockHeight=0, int minProtocol=CMasterNode::minProtoVersion);
+bool GetBlockHash(uint256& hash, int nBlockHeight);
 
 
 // for storing the winning payments
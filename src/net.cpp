@@ -17,6 +17,9 @@
 #include <string.h>
 #endif
 
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniwget.h>
 #include <miniupnpc/miniupnpc.h>
@@ -50,14 +53,21 @@ static map<CNetAddr, LocalServiceInfo> mapLocalHost;
 static bool vfReachable[NET_MAX] = {};
 static bool vfLimited[NET_MAX] = {};
 static CNode* pnodeLocalHost = NULL;
-static CNode* pnodeSync = NULL;
+// Handler threads and the socket thread both touch this, so it is only read
+// and changed through the __sync builtins below
+static CNode* volatile pnodeSync = NULL;
+
+static bool IsSyncNode(CNode* pnode) {
+    return __sync_val_compare_and_swap(&pnodeSync, (CNode*)NULL, (CNode*)NULL) == pnode;
+}
+
 uint64_t nLocalHostNonce = 0;
 static std::vector<SOCKET> vhListenSocket;
 CAddrMan addrman;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+RelayMap mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 map<CInv, int64_t> mapAlreadyAskedFor;
@@ -76,6 +86,19 @@ CCriticalSection cs_nLastNodeId;
 
 static CSemaphore *semOutbound = NULL;
 
+// Wakes ThreadMessageHandler when there is work for it before its timer runs out
+static boost::condition_variable condMsgProc;
+static boost::mutex mutexMsgProc;
+static bool fMsgProcWake = false;
+
+// The node that is sent the trickled messages next, whichever handler thread
+// gets to it. A new one is picked every TRICKLE_INTERVAL ms, as often as an
+// idle handler thread used to pick one.
+static const int64_t TRICKLE_INTERVAL = 100;
+static CCriticalSection cs_nodeTrickle;
+static NodeId nodeTrickle = -1;
+static int64_t nNextTrickle = 0;
+
 // Signals for message handling
 static CNodeSignals g_signals;
 CNodeSignals& GetNodeSignals() { return g_signals; }
@@ -86,6 +109,15 @@ void AddOneShot(string strDest)
     vOneShots.push_back(strDest);
 }
 
+static void WakeMessageHandler()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutexMsgProc);
+        fMsgProcWake = true;
+    }
+    condMsgProc.notify_one();
+}
+
 unsigned short GetListenPort()
 {
     return (unsigned short)(GetArg("-port", Params().GetDefaultPort()));
@@ -354,6 +386,72 @@ CNode* FindNode(const CService& addr)
     return NULL;
 }
 
+#ifdef USE_EPOLL
+// epoll instance watching the listen sockets and every node socket, -1 when
+// ThreadSocketHandler uses select()
+static int hSocketEvents = -1;
+#endif
+
+void InitSocketEvents()
+{
+#ifdef USE_EPOLL
+    if (hSocketEvents != -1)
+    {
+        close(hSocketEvents);
+        hSocketEvents = -1;
+    }
+
+    if (GetArg("-socketevents", DEFAULT_SOCKET_EVENTS) == "epoll")
+    {
+        hSocketEvents = epoll_create1(EPOLL_CLOEXEC);
+        if (hSocketEvents == -1)
+            LogPrintf("epoll_create1 failed: %d\n", errno);
+
+        // listen sockets are level-triggered, one connection is accepted a round
+        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        {
+            if (hSocketEvents == -1 || hListenSocket == INVALID_SOCKET)
+                continue;
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = NULL;
+            if (epoll_ctl(hSocketEvents, EPOLL_CTL_ADD, hListenSocket, &event) == SOCKET_ERROR)
+            {
+                LogPrintf("epoll_ctl failed for listen socket: %d\n", errno);
+                close(hSocketEvents);
+                hSocketEvents = -1;
+            }
+        }
+    }
+
+    LogPrintf("Using %s for socket events\n", hSocketEvents != -1 ? "epoll" : "select");
+#else
+    LogPrintf("Using select for socket events\n");
+#endif
+}
+
+// Watch the socket of a new node, before any other thread can close it. With
+// epoll it is registered once for both directions, edge-triggered, so the
+// registration never has to follow vSendMsg: whether the socket is worth a
+// recv or send is kept in the node instead.
+static bool AddSocketEvents(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    if (hSocketEvents == -1)
+        return true;
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(hSocketEvents, EPOLL_CTL_ADD, pnode->hSocket, &event) == SOCKET_ERROR)
+    {
+        LogPrintf("epoll_ctl failed: %d\n", errno);
+        return false;
+    }
+#endif
+    return true;
+}
+
 CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool darkSendMaster)
 {
     if (pszDest == NULL) {
@@ -401,6 +499,8 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool darkSendMaste
         // Add node
         CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
         pnode->AddRef();
+        if (!AddSocketEvents(pnode))
+            pnode->CloseSocketDisconnect();
 
         {
             LOCK(cs_vNodes);
@@ -424,6 +524,13 @@ void CNode::CloseSocketDisconnect()
     if (hSocket != INVALID_SOCKET)
     {
         LogPrint("net", "disconnecting node %s\n", addrName);
+#ifdef USE_EPOLL
+        // Closing the socket only ends the registration once no other process
+        // (a -blocknotify child say) shares it, until then epoll would keep
+        // reporting events for this node after it is deleted
+        if (hSocketEvents != -1)
+            epoll_ctl(hSocketEvents, EPOLL_CTL_DEL, hSocket, NULL);
+#endif
         closesocket(hSocket);
         hSocket = INVALID_SOCKET;
     }
@@ -434,8 +541,7 @@ void CNode::CloseSocketDisconnect()
         vRecvMsg.clear();
 
     // if this was the sync node, we'll need a new one
-    if (this == pnodeSync)
-        pnodeSync = NULL;
+    __sync_bool_compare_and_swap(&pnodeSync, this, (CNode*)NULL);
 }
 
 void CNode::PushVersion()
@@ -520,8 +626,9 @@ void CNode::copyStats(CNodeStats &stats)
     X(nStartingHeight);
     X(nMisbehavior);
     X(nSendBytes);
+    X(nSendCalls);
     X(nRecvBytes);
-    stats.fSyncNode = (this == pnodeSync);
+    stats.fSyncNode = IsSyncNode(this);
 
     // It is common for nodes with good ping times to suddenly become lagged,
     // due to a new block arriving or other large transfer.
@@ -544,7 +651,8 @@ void CNode::copyStats(CNodeStats &stats)
 #undef X
 
 // requires LOCK(cs_vRecvMsg)
-bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
+// fComplete is set when at least one message was completed
+bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& fComplete)
 {
     while (nBytes > 0) {
 
@@ -568,8 +676,10 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         pch += handled;
         nBytes -= handled;
 
-        if (msg.complete())
+        if (msg.complete()) {
             msg.nTime = GetTimeMicros();
+            fComplete = true;
+        }
     }
 
     return true;
@@ -630,26 +740,90 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 
 
+CSharedMessage MakeSharedMessage(CDataStream& ss)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+
+    boost::shared_ptr<CSerializeData> msg(new CSerializeData());
+    ss.GetAndClear(*msg);
+    return msg;
+}
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    // the message handler stops processing a node's messages while its send
+    // buffer is full, it has to be woken when the buffer drains again
+    unsigned int nSendBufferSize = SendBufferSize();
+    bool fSendFull = pnode->nSendSize >= nSendBufferSize;
+
+    std::deque<CSharedMessage>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
+        size_t nOffered = 0;
+#ifdef WIN32
+        const CSerializeData &data = **it;
         assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        nOffered = data.size() - pnode->nSendOffset;
+        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nOffered, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Hand the kernel as many queued messages as one call takes, the
+        // first one from where the last call left off
+        struct iovec iov[MAX_SEND_IOVECS];
+        int nIov = 0;
+        size_t nOffset = pnode->nSendOffset;
+        for (std::deque<CSharedMessage>::iterator itIov = it; itIov != pnode->vSendMsg.end() && nIov < MAX_SEND_IOVECS; itIov++)
+        {
+            const CSerializeData &data = **itIov;
+            assert(data.size() > nOffset);
+            iov[nIov].iov_base = (void*)&data[nOffset];
+            iov[nIov].iov_len = data.size() - nOffset;
+            nOffered += iov[nIov].iov_len;
+            nIov++;
+            nOffset = 0;
+            // keep the total within what the return value can report
+            if (nOffered >= 0x10000000)
+                break;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+        pnode->nSendCalls++;
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+
+            // Drop the messages that went out whole and remember how far
+            // the next one got
+            size_t nSent = nBytes;
+            while (nSent > 0) {
+                const CSerializeData &data = **it;
+                size_t nRemaining = data.size() - pnode->nSendOffset;
+                if (nSent < nRemaining) {
+                    pnode->nSendOffset += nSent;
+                    break;
+                }
+                nSent -= nRemaining;
                 pnode->nSendOffset = 0;
                 pnode->nSendSize -= data.size();
                 it++;
-            } else {
-                // could not send full message; stop sending more
+            }
+
+            if ((size_t)nBytes < nOffered) {
+                // could not send everything offered; stop sending more
                 break;
             }
         } else {
@@ -672,77 +846,139 @@ void SocketSendData(CNode *pnode)
         assert(pnode->nSendSize == 0);
     }
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+
+    if (fSendFull && pnode->nSendSize < nSendBufferSize)
+        WakeMessageHandler();
 }
 
 static list<CNode*> vNodesDisconnected;
 
+static void InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %ds\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %ds\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
 
+    // epoll keeps a wait from costing anything per idle socket and isn't
+    // limited to FD_SETSIZE sockets, select() is the fallback
+    bool fEpoll = false;
+#ifdef USE_EPOLL
+    fEpoll = hSocketEvents != -1;
+#endif
+    // With epoll a round only services the nodes epoll reported and the ones
+    // an earlier round left work for. Dropping disconnected nodes and the
+    // inactivity checks visit every node, so they run every
+    // SOCKET_SWEEP_INTERVAL instead of every round. Nodes are only deleted
+    // by this thread, which takes them out of setNodesPending first.
+    set<CNode*> setNodesPending;
+    bool fMoreWork = false;
+    int64_t nLastSweep = 0;
+
     while (true)
     {
-        //
-        // Disconnect nodes
-        //
+        int64_t nNow = GetTimeMillis();
+        if (!fEpoll || nNow - nLastSweep >= SOCKET_SWEEP_INTERVAL)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            nLastSweep = nNow;
+
+            //
+            // Disconnect nodes
+            //
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
+                LOCK(cs_vNodes);
+                // Disconnect unused nodes
+                vector<CNode*> vNodesCopy = vNodes;
+                BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                    if (pnode->fDisconnect ||
+                        (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
+                    {
+                        // remove from vNodes
+                        vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                        // release outbound grant (if any)
+                        pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+                        // close socket and cleanup
+                        pnode->CloseSocketDisconnect();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
+                        // hold in disconnected pool until all refs are released
+                        if (pnode->fNetworkNode || pnode->fInbound)
+                            pnode->Release();
+                        vNodesDisconnected.push_back(pnode);
+                    }
                 }
             }
-        }
-        {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                // Delete disconnected nodes
+                list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+                BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
                 {
-                    bool fDelete = false;
+                    // wait until threads are done using it
+                    if (pnode->GetRefCount() <= 0)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        bool fDelete = false;
                         {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
+                            TRY_LOCK(pnode->cs_vSend, lockSend);
+                            if (lockSend)
                             {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
+                                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                                if (lockRecv)
+                                {
+                                    TRY_LOCK(pnode->cs_inventory, lockInv);
+                                    if (lockInv)
+                                        fDelete = true;
+                                }
                             }
                         }
-                    }
-                    if (fDelete)
-                    {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
+                        if (fDelete)
+                        {
+                            vNodesDisconnected.remove(pnode);
+                            setNodesPending.erase(pnode);
+                            delete pnode;
+                        }
                     }
                 }
             }
-        }
-        if(vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+            if(vNodes.size() != nPrevNodeCount) {
+                nPrevNodeCount = vNodes.size();
+                uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+            }
+
+            //
+            // Inactivity checking
+            //
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                    InactivityCheck(pnode);
+            }
         }
 
 
@@ -761,50 +997,88 @@ void ThreadSocketHandler()
         FD_ZERO(&fdsetError);
         SOCKET hSocketMax = 0;
         bool have_fds = false;
+        bool fListenReady = false;
 
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
-        }
+#ifdef USE_EPOLL
+        if (fEpoll)
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
+            struct epoll_event events[256];
+            int nEvents = epoll_wait(hSocketEvents, events, 256, fMoreWork ? 0 : timeout.tv_usec/1000);
+            boost::this_thread::interruption_point();
+
+            if (nEvents == SOCKET_ERROR)
             {
-                if (pnode->hSocket == INVALID_SOCKET)
+                if (errno != EINTR)
+                {
+                    LogPrintf("socket epoll_wait error %d\n", errno);
+                    MilliSleep(timeout.tv_usec/1000);
+                }
+                nEvents = 0;
+            }
+
+            for (int i = 0; i < nEvents; i++)
+            {
+                CNode* pnode = (CNode*)events[i].data.ptr;
+                if (pnode == NULL)
+                {
+                    fListenReady = true;
                     continue;
+                }
+                if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                    pnode->fSocketReadable = true;
+                if (events[i].events & EPOLLOUT)
+                    pnode->fSocketWritable = true;
+                setNodesPending.insert(pnode);
+            }
+            fMoreWork = false;
+        }
+        else
+#endif
+        {
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
+                FD_SET(hListenSocket, &fdsetRecv);
+                hSocketMax = max(hSocketMax, hListenSocket);
+                have_fds = true;
+            }
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
                 {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend) {
-                        // do not read, if draining write queue
-                        if (!pnode->vSendMsg.empty())
-                            FD_SET(pnode->hSocket, &fdsetSend);
-                        else
-                            FD_SET(pnode->hSocket, &fdsetRecv);
-                        FD_SET(pnode->hSocket, &fdsetError);
-                        hSocketMax = max(hSocketMax, pnode->hSocket);
-                        have_fds = true;
+                    if (pnode->hSocket == INVALID_SOCKET || !IsSelectableSocket(pnode->hSocket))
+                        continue;
+                    {
+                        TRY_LOCK(pnode->cs_vSend, lockSend);
+                        if (lockSend) {
+                            // do not read, if draining write queue
+                            if (!pnode->vSendMsg.empty())
+                                FD_SET(pnode->hSocket, &fdsetSend);
+                            else
+                                FD_SET(pnode->hSocket, &fdsetRecv);
+                            FD_SET(pnode->hSocket, &fdsetError);
+                            hSocketMax = max(hSocketMax, pnode->hSocket);
+                            have_fds = true;
+                        }
                     }
                 }
             }
-        }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
+            int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                                 &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+            boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
+            if (nSelect == SOCKET_ERROR)
             {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %d\n", nErr);
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+                if (have_fds)
+                {
+                    int nErr = WSAGetLastError();
+                    LogPrintf("socket select error %d\n", nErr);
+                    for (unsigned int i = 0; i <= hSocketMax; i++)
+                        FD_SET(i, &fdsetRecv);
+                }
+                FD_ZERO(&fdsetSend);
+                FD_ZERO(&fdsetError);
+                MilliSleep(timeout.tv_usec/1000);
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
         }
 
 
@@ -812,7 +1086,7 @@ void ThreadSocketHandler()
         // Accept new connections
         //
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        if (hListenSocket != INVALID_SOCKET && (fEpoll ? fListenReady : FD_ISSET(hListenSocket, &fdsetRecv)))
         {
             struct sockaddr_storage sockaddr;
             socklen_t len = sizeof(sockaddr);
@@ -841,6 +1115,11 @@ void ThreadSocketHandler()
             {
                 closesocket(hSocket);
             }
+            else if (!fEpoll && !IsSelectableSocket(hSocket))
+            {
+                LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
+                closesocket(hSocket);
+            }
             else if (CNode::IsBanned(addr))
             {
                 LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
@@ -851,6 +1130,9 @@ void ThreadSocketHandler()
                 LogPrint("net", "accepted connection %s\n", addr.ToString());
                 CNode* pnode = new CNode(hSocket, addr, "", true);
                 pnode->AddRef();
+                if (!AddSocketEvents(pnode))
+                    pnode->CloseSocketDisconnect();
+                setNodesPending.insert(pnode);
                 {
                     LOCK(cs_vNodes);
                     vNodes.push_back(pnode);
@@ -863,9 +1145,15 @@ void ThreadSocketHandler()
         // Service each socket
         //
         vector<CNode*> vNodesCopy;
+        if (fEpoll)
+        {
+            vNodesCopy.assign(setNodesPending.begin(), setNodesPending.end());
+            setNodesPending.clear();
+        }
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
+            if (!fEpoll)
+                vNodesCopy = vNodes;
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 pnode->AddRef();
         }
@@ -878,48 +1166,70 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            if (!fEpoll && !IsSelectableSocket(pnode->hSocket))
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
+                LogPrintf("socket %d can't be used with select, disconnecting\n", pnode->hSocket);
+                pnode->CloseSocketDisconnect();
+                continue;
+            }
+
+            // with epoll do not read, if draining write queue
+            bool fRecv = fEpoll ? pnode->fSocketReadable && pnode->nSendSize == 0
+                                : FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError);
+            if (fRecv)
+            {
+                bool fComplete = false;
                 {
-                    if (pnode->GetTotalRecvSize() > ReceiveFloodSize()) {
-                        if (!pnode->fDisconnect)
-                            LogPrintf("socket recv flood control disconnect (%u bytes)\n", pnode->GetTotalRecvSize());
-                        pnode->CloseSocketDisconnect();
-                    }
-                    else {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
+                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                    if (lockRecv)
+                    {
+                        if (pnode->GetTotalRecvSize() > ReceiveFloodSize()) {
                             if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
+                                LogPrintf("socket recv flood control disconnect (%u bytes)\n", pnode->GetTotalRecvSize());
                             pnode->CloseSocketDisconnect();
                         }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                        else {
+                            // typical socket buffer is 8K-64K
+                            char pchBuf[0x10000];
+                            int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                            if (nBytes > 0)
+                            {
+                                if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, fComplete))
+                                    pnode->CloseSocketDisconnect();
+                                pnode->nLastRecv = GetTime();
+                                pnode->nRecvBytes += nBytes;
+                                pnode->RecordBytesRecv(nBytes);
+                            }
+                            else if (nBytes == 0)
                             {
+                                // socket closed gracefully
                                 if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %d\n", nErr);
+                                    LogPrint("net", "socket closed\n");
                                 pnode->CloseSocketDisconnect();
                             }
+                            else if (nBytes < 0)
+                            {
+                                // error
+                                int nErr = WSAGetLastError();
+                                if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                                {
+                                    if (!pnode->fDisconnect)
+                                        LogPrintf("socket recv error %d\n", nErr);
+                                    pnode->CloseSocketDisconnect();
+                                }
+                            }
+
+                            // a full buffer may have left more to read, anything
+                            // less drained the socket until the next edge
+                            if (nBytes == (int)sizeof(pchBuf))
+                                fMoreWork = true;
+                            else
+                                pnode->fSocketReadable = false;
                         }
                     }
                 }
+                if (fComplete)
+                    WakeMessageHandler();
             }
 
             //
@@ -927,40 +1237,26 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            bool fSend = fEpoll ? pnode->fSocketWritable && pnode->nSendSize > 0
+                                : FD_ISSET(pnode->hSocket, &fdsetSend);
+            if (fSend)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
-                    SocketSendData(pnode);
-            }
-
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
                 {
-                    LogPrintf("socket sending timeout: %ds\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %ds\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
+                    SocketSendData(pnode);
+                    // a send that left data queued filled the socket buffer,
+                    // epoll reports when there is room again
+                    if (pnode->nSendSize > 0)
+                        pnode->fSocketWritable = false;
                 }
             }
+
+            // a recv or send a busy lock put off, or a recv put off until
+            // the send queue drained, gets no new edge from epoll
+            if (fEpoll && pnode->hSocket != INVALID_SOCKET &&
+                ((pnode->fSocketReadable && pnode->nSendSize == 0) || (pnode->fSocketWritable && pnode->nSendSize > 0)))
+                setNodesPending.insert(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1407,10 +1703,9 @@ void static StartSync(const vector<CNode*> &vNodes) {
         }
     }
     // if a new sync candidate was found, start sync!
-    if (pnodeNewSync) {
+    // only if no sync node was set meanwhile
+    if (pnodeNewSync && __sync_bool_compare_and_swap(&pnodeSync, (CNode*)NULL, pnodeNewSync))
         pnodeNewSync->fStartSync = true;
-        pnodeSync = pnodeNewSync;
-    }
 }
 
 void ThreadMessageHandler()
@@ -1426,18 +1721,25 @@ void ThreadMessageHandler()
             vNodesCopy = vNodes;
             BOOST_FOREACH(CNode* pnode, vNodesCopy) {
                 pnode->AddRef();
-                if (pnode == pnodeSync)
+                if (IsSyncNode(pnode))
                     fHaveSyncNode = true;
             }
+
+            // under cs_vNodes so that only one handler thread picks a sync node
+            if (!fHaveSyncNode)
+                StartSync(vNodesCopy);
         }
 
-        if (!fHaveSyncNode)
-            StartSync(vNodesCopy);
+        {
+            LOCK(cs_nodeTrickle);
+            if (!vNodesCopy.empty() && GetTimeMillis() >= nNextTrickle)
+            {
+                nodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())]->GetId();
+                nNextTrickle = GetTimeMillis() + TRICKLE_INTERVAL;
+            }
+        }
 
         // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
 
         bool fSleep = true;
 
@@ -1446,15 +1748,28 @@ void ThreadMessageHandler()
             if (pnode->fDisconnect)
                 continue;
 
+            // Another handler thread is working on this node
+            TRY_LOCK(pnode->cs_vProcessMsg, lockProcess);
+            if (!lockProcess)
+                continue;
+
             // Receive messages
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
                 {
+                    size_t nGetData = pnode->vRecvGetData.size();
+                    size_t nRecvMsg = pnode->vRecvMsg.size();
+
                     if (!g_signals.ProcessMessages(pnode))
                         pnode->CloseSocketDisconnect();
 
-                    if (pnode->nSendSize < SendBufferSize())
+                    // A node where nothing could be done is waiting for a lock
+                    // that ProcessGetData only tries, cs_main or
+                    // cs_ProcessMessage. It is retried after the timed wait
+                    // instead of spinning while another thread holds the lock.
+                    bool fProgress = pnode->vRecvGetData.size() != nGetData || pnode->vRecvMsg.size() != nRecvMsg;
+                    if (fProgress && pnode->nSendSize < SendBufferSize())
                     {
                         if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
                         {
@@ -1469,7 +1784,18 @@ void ThreadMessageHandler()
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
-                    g_signals.SendMessages(pnode, pnode == pnodeTrickle);
+                {
+                    bool fSendTrickle = false;
+                    {
+                        LOCK(cs_nodeTrickle);
+                        if (pnode->GetId() == nodeTrickle)
+                        {
+                            fSendTrickle = true;
+                            nodeTrickle = -1;
+                        }
+                    }
+                    g_signals.SendMessages(pnode, fSendTrickle);
+                }
             }
             boost::this_thread::interruption_point();
         }
@@ -1480,8 +1806,15 @@ void ThreadMessageHandler()
                 pnode->Release();
         }
 
-        if (fSleep)
-            MilliSleep(100);
+        // Wait for a message to arrive or a send buffer to drain, unless that
+        // already happened during this pass. The timer stays so SendMessages
+        // still runs its pings and trickles when idle.
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMsgProc);
+            if (fSleep && !fMsgProcWake)
+                condMsgProc.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+            fMsgProcWake = false;
+        }
     }
 }
 
@@ -1682,8 +2015,14 @@ void StartNode(boost::thread_group& threadGroup)
     // Initiate outbound connections
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
-    // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    // Process messages, -msghandlers=0 means one thread per core and <0
+    // leaves that many cores free
+    int nMessageHandlers = GetArg("-msghandlers", 0);
+    if (nMessageHandlers <= 0)
+        nMessageHandlers += boost::thread::hardware_concurrency();
+    nMessageHandlers = std::max(1, std::min(nMessageHandlers, MAX_MESSAGE_HANDLER_THREADS));
+    for (int i = 0; i < nMessageHandlers; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
@@ -1717,6 +2056,10 @@ public:
             if (hListenSocket != INVALID_SOCKET)
                 if (closesocket(hListenSocket) == SOCKET_ERROR)
                     LogPrintf("closesocket(hListenSocket) failed with error %d\n", WSAGetLastError());
+#ifdef USE_EPOLL
+        if (hSocketEvents != -1)
+            close(hSocketEvents);
+#endif
 
 #ifdef WIN32
         // Shutdown Windows Sockets
@@ -1737,6 +2080,15 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash)
 void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss)
 {
     CInv inv(MSG_TX, hash);
+
+    // The tx message is built once, every peer that asks for the transaction
+    // is sent the same buffer
+    CDataStream ssMsg(SER_NETWORK, PROTOCOL_VERSION);
+    ssMsg.reserve(CMessageHeader::HEADER_SIZE + ss.size());
+    ssMsg << CMessageHeader(inv.GetCommand(), 0);
+    ssMsg.write(&ss[0], ss.size());
+    CSharedMessage msg = MakeSharedMessage(ssMsg);
+
     {
         LOCK(cs_mapRelay);
         // Expire old relay messages
@@ -1747,7 +2099,7 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
         }
 
         // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        mapRelay.insert(std::make_pair(inv, msg));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
 
@@ -1758,6 +2110,10 @@ void RelayTransactionLockReq(const CTransaction& tx, const uint256& hash, bool r
 {
     CInv inv(MSG_TXLOCK_REQUEST, tx.GetHash());
 
+    CDataStream ssMsg(SER_NETWORK, PROTOCOL_VERSION);
+    ssMsg << CMessageHeader("txlreq", 0) << tx;
+    CSharedMessage msg = MakeSharedMessage(ssMsg);
+
     //broadcast the new lock
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
@@ -1765,7 +2121,7 @@ void RelayTransactionLockReq(const CTransaction& tx, const uint256& hash, bool r
         if(!relayToAll && !pnode->fRelayTxes)
             continue;
 
-        pnode->PushMessage("txlreq", tx);
+        pnode->PushSharedMessage(msg);
     }
 
 }
@@ -8,7 +8,9 @@
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
+#include <boost/unordered_map.hpp>
 #include <openssl/rand.h>
 
 
@@ -33,6 +35,23 @@ static const int PING_INTERVAL = 1 * 60;
 /** Time after which to disconnect, after waiting for a ping response (or inactivity). */
 static const int TIMEOUT_INTERVAL = 20 * 60;
 
+/** How ThreadSocketHandler waits for its sockets, -socketevents=<mode> */
+#ifdef USE_EPOLL
+static const char DEFAULT_SOCKET_EVENTS[] = "epoll";
+#else
+static const char DEFAULT_SOCKET_EVENTS[] = "select";
+#endif
+
+/** With epoll, how often ThreadSocketHandler visits every node to drop
+ *  disconnected ones and check for inactivity (in milliseconds) */
+static const int64_t SOCKET_SWEEP_INTERVAL = 100;
+
+/** Maximum number of ThreadMessageHandler threads, -msghandlers=<n> */
+static const int MAX_MESSAGE_HANDLER_THREADS = 8;
+
+/** Most queued messages SocketSendData hands to one sendmsg() call */
+static const int MAX_SEND_IOVECS = 64;
+
 inline unsigned int ReceiveFloodSize() { return 2000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 5000*GetArg("-maxsendbuffer", 1*1000); }
 
@@ -48,19 +67,37 @@ unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::string()));
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
+void InitSocketEvents();
+void ThreadSocketHandler();
 void SocketSendData(CNode *pnode);
 
+/** A complete message, header included, that can be queued to any number of
+ *  peers without being copied. Never changed once it is shared. */
+typedef boost::shared_ptr<const CSerializeData> CSharedMessage;
+
+/** Set the size and checksum in the header ss begins with, and move the message
+ *  out of ss */
+CSharedMessage MakeSharedMessage(CDataStream& ss);
+
+struct CInvHasher
+{
+    // inventory hashes are already uniformly distributed in their low bits
+    size_t operator()(const CInv& inv) const { return inv.hash.Get64() + inv.type; }
+};
+typedef boost::unordered_map<CInv, CSharedMessage, CInvHasher> RelayMap;
+
+typedef int NodeId;
+
 // Signals for message handling
 struct CNodeSignals
 {
     boost::signals2::signal<bool (CNode*)> ProcessMessages;
     boost::signals2::signal<bool (CNode*, bool)> SendMessages;
+    boost::signals2::signal<void (NodeId)> FinalizeNode;
 };
 
 CNodeSignals& GetNodeSignals();
 
-typedef int NodeId;
-
 enum
 {
     LOCAL_NONE,   // unknown
@@ -107,7 +144,7 @@ extern CAddrMan addrman;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern RelayMap mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern std::map<CInv, int64_t> mapAlreadyAskedFor;
@@ -135,6 +172,7 @@ public:
     int nStartingHeight;
     int nMisbehavior;
     uint64_t nSendBytes;
+    uint64_t nSendCalls;
     uint64_t nRecvBytes;
     bool fSyncNode;
     double dPingTime;
@@ -221,12 +259,16 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    uint64_t nSendCalls; // socket send calls, nSendBytes / nSendCalls is the batching achieved
+    std::deque<CSharedMessage> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    // Held by the message handler thread working on this node, so that its
+    // messages are handled in order and by one thread at a time
+    CCriticalSection cs_vProcessMsg;
     uint64_t nRecvBytes;
     int nRecvVersion;
 
@@ -248,6 +290,11 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    // Edge-triggered socket readiness, only used by ThreadSocketHandler with
+    // epoll: set when epoll reports the socket ready, cleared once a recv or
+    // send runs dry
+    bool fSocketReadable;
+    bool fSocketWritable;
     // We use fRelayTxes for two purposes -
     // a) it allows us to not relay tx invs before receiving the peer's version message
     // b) the peer may tell us in their version message that we should not relay tx invs
@@ -308,6 +355,7 @@ public:
         nLastSend = 0;
         nLastRecv = 0;
         nSendBytes = 0;
+        nSendCalls = 0;
         nRecvBytes = 0;
         nTimeConnected = GetTime();
         addr = addrIn;
@@ -320,6 +368,8 @@ public:
         fNetworkNode = false;
         fSuccessfullyConnected = false;
         fDisconnect = false;
+        fSocketReadable = true;
+        fSocketWritable = true;
         nRefCount = 0;
         nSendSize = 0;
         nSendOffset = 0;
@@ -354,6 +404,7 @@ public:
             closesocket(hSocket);
             hSocket = INVALID_SOCKET;
         }
+        GetNodeSignals().FinalizeNode(GetId());
     }
 
 private:
@@ -387,7 +438,7 @@ public:
     }
 
     // requires LOCK(cs_vRecvMsg)
-    bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
+    bool ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& fComplete);
 
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
@@ -495,28 +546,32 @@ public:
         if (ssSend.size() == 0)
             return;
 
-        // Set the size
-        unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-        memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+        CSharedMessage msg = MakeSharedMessage(ssSend);
 
-        // Set the checksum
-        uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-        memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+        LogPrint("net", "(%d bytes)\n", msg->size() - CMessageHeader::HEADER_SIZE);
 
-        LogPrint("net", "(%d bytes)\n", nSize);
+        QueueMessage(msg);
+
+        LEAVE_CRITICAL_SECTION(cs_vSend);
+    }
 
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
-        nSendSize += (*it).size();
+    // requires LOCK(cs_vSend)
+    void QueueMessage(const CSharedMessage& msg)
+    {
+        vSendMsg.push_back(msg);
+        nSendSize += msg->size();
 
         // If write queue empty, attempt "optimistic write"
-        if (it == vSendMsg.begin())
+        if (vSendMsg.size() == 1)
             SocketSendData(this);
+    }
 
-        LEAVE_CRITICAL_SECTION(cs_vSend);
+    // Send a message that was built once for several peers
+    void PushSharedMessage(const CSharedMessage& msg)
+    {
+        LOCK(cs_vSend);
+        LogPrint("net", "sending: shared message (%d bytes)\n", msg->size() - CMessageHeader::HEADER_SIZE);
+        QueueMessage(msg);
     }
 
     void PushVersion();
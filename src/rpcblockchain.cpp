@@ -221,10 +221,15 @@ Value getblockhash(const Array& params, bool fHelp)
             "Returns hash of block in best-block-chain at <index>.");
 
     int nHeight = params[0].get_int();
+
+    // the range check and the lookup have to see the same best chain
+    LOCK(cs_main);
     if (nHeight < 0 || nHeight > nBestHeight)
         throw runtime_error("Block number out of range.");
 
     CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
+    if (!pblockindex)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Block number out of range");
     return pblockindex->phashBlock->GetHex();
 }
 
@@ -258,18 +263,19 @@ Value getblockbynumber(const Array& params, bool fHelp)
             "Returns details of a block with given block-number.");
 
     int nHeight = params[0].get_int();
+
+    // the range check and the lookup have to see the same best chain
+    LOCK(cs_main);
     if (nHeight < 0 || nHeight > nBestHeight)
         throw runtime_error("Block number out of range.");
 
-    CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-
-    uint256 hash = *pblockindex->phashBlock;
+    CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
+    if (!pblockindex)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Block number out of range");
 
-    pblockindex = mapBlockIndex[hash];
-    block.ReadFromDisk(pblockindex, true);
+    CBlock block;
+    if (!block.ReadFromDisk(pblockindex, true))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
 
     return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
 }
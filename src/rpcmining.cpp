@@ -139,6 +139,8 @@ Value getstakinginfo(const Array& params, bool fHelp)
 
     obj.push_back(Pair("difficulty", GetDifficulty(GetLastBlockIndex(pindexBest, true))));
     obj.push_back(Pair("search-interval", (int)nLastCoinStakeSearchInterval));
+    obj.push_back(Pair("search-latency", nLastCoinStakeSearchDuration / 1000.0));
+    obj.push_back(Pair("kernelspersec", nLastCoinStakeSearchDuration ? (uint64_t)(nLastCoinStakeSearchKernels * 1000000 / nLastCoinStakeSearchDuration) : (uint64_t)0));
 
     obj.push_back(Pair("weight", (uint64_t)nWeight));
     obj.push_back(Pair("netstakeweight", (uint64_t)nNetworkWeight));
@@ -83,6 +83,9 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("lastsend", (int64_t)stats.nLastSend));
         obj.push_back(Pair("lastrecv", (int64_t)stats.nLastRecv));
         obj.push_back(Pair("bytessent", (int64_t)stats.nSendBytes));
+        obj.push_back(Pair("sendcalls", (int64_t)stats.nSendCalls));
+        if (stats.nSendCalls > 0)
+            obj.push_back(Pair("bytespersendcall", (double)stats.nSendBytes / stats.nSendCalls));
         obj.push_back(Pair("bytesrecv", (int64_t)stats.nRecvBytes));
         obj.push_back(Pair("conntime", (int64_t)stats.nTimeConnected));
         obj.push_back(Pair("pingtime", stats.dPingTime));
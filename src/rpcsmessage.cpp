@@ -869,10 +869,12 @@ Value smsgbuckets(const Array& params, bool fHelp)
             for (it = smsgBuckets.begin(); it != smsgBuckets.end(); ++it)
             {
                 std::string sFile = boost::lexical_cast<std::string>(it->first) + "_01.dat";
+                std::string sIndex = boost::lexical_cast<std::string>(it->first) + "_01.idx";
                 
                 try {
                     boost::filesystem::path fullPath = GetDataDir() / "smsgStore" / sFile;
                     boost::filesystem::remove(fullPath);
+                    boost::filesystem::remove(GetDataDir() / "smsgStore" / sIndex);
                 } catch (const boost::filesystem::filesystem_error& ex)
                 {
                     //objM.push_back(Pair("file size, error", ex.what()));
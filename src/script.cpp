@@ -4,8 +4,8 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
 
 using namespace std;
 using namespace boost;
@@ -2172,56 +2172,86 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTrans
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
-
+//
+// Each entry is a 256-bit digest of (salt, signature hash, public key,
+// signature) stored in a fixed-size 4-way set-associative table. The salt is
+// random per process so nobody can pre-compute which entries collide. Sets
+// are guarded by a small array of striped locks, so the script check threads
+// don't serialize on a cache-wide mutex, and a full set just overwrites one
+// of its ways instead of searching for something to evict.
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    static const unsigned int WAYS = 4;
+    static const unsigned int LOCK_STRIPES = 64;
+
+    unsigned char salt[32];
+    std::vector<uint256> vEntries;
+    uint64_t nSets;
+    boost::mutex csStripes[LOCK_STRIPES];
+
+    uint256 ComputeEntry(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+    {
+        // The public key length is implied by its first byte, so hashing it
+        // before the signature keeps the encoding unambiguous.
+        uint256 entry;
+        CSHA256().Write(salt, sizeof(salt))
+                 .Write(hash.begin(), 32)
+                 .Write(pubKey.begin(), pubKey.size())
+                 .Write(vchSig.empty() ? NULL : &vchSig[0], vchSig.size())
+                 .Finalize(entry.begin());
+        return entry;
+    }
 
 public:
+    CSignatureCache() : nSets(0)
+    {
+        GetRandBytes(salt, sizeof(salt));
+
+        // -maxsigcachesize is in megabytes; 0 disables the cache
+        int64_t nMaxCacheSizeMB = std::max((int64_t)0, std::min((int64_t)16384, GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE)));
+        nSets = ((uint64_t)nMaxCacheSizeMB << 20) / (sizeof(uint256) * WAYS);
+        vEntries.resize(nSets * WAYS);
+    }
+
     bool
     Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        if (nSets == 0)
+            return false;
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+        uint256 entry = ComputeEntry(hash, vchSig, pubKey);
+        uint64_t nSet = entry.Get64(0) % nSets;
+        const uint256* pways = &vEntries[nSet * WAYS];
+
+        boost::unique_lock<boost::mutex> lock(csStripes[nSet % LOCK_STRIPES]);
+        for (unsigned int i = 0; i < WAYS; i++)
+            if (pways[i] == entry)
+                return true;
         return false;
     }
 
     void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
+        if (nSets == 0)
+            return;
+
+        uint256 entry = ComputeEntry(hash, vchSig, pubKey);
+        uint64_t nSet = entry.Get64(0) % nSets;
+        uint256* pways = &vEntries[nSet * WAYS];
+
+        boost::unique_lock<boost::mutex> lock(csStripes[nSet % LOCK_STRIPES]);
+        // Take an empty way if there is one, otherwise overwrite one chosen by
+        // other (salted, so unpredictable) bits of the digest.
+        unsigned int nWay = entry.Get64(1) % WAYS;
+        for (unsigned int i = 0; i < WAYS; i++)
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            if (pways[i] == entry)
+                return;
+            if (pways[i] == 0)
+                nWay = i;
         }
-
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        pways[nWay] = entry;
     }
 };
 
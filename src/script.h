@@ -28,6 +28,7 @@ class BaseSignatureChecker;
 
 static const unsigned int MAX_SCRIPT_ELEMENT_SIZE = 520; // bytes
 static const unsigned int MAX_OP_RETURN_RELAY = 40;      // bytes
+static const int64_t DEFAULT_MAX_SIG_CACHE_SIZE = 10;    // megabytes
 
 template <typename T>
 std::vector<unsigned char> ToByteVector(const T& in)
@@ -1177,7 +1177,11 @@ public:
     }
 
     void GetAndClear(CSerializeData &data) {
-        data.insert(data.end(), begin(), end());
+        // hand over the buffer itself when there is nothing to append to
+        if (data.empty() && nReadPos == 0)
+            vch.swap(data);
+        else
+            data.insert(data.end(), begin(), end());
         clear();
     }
 };
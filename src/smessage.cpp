@@ -13,6 +13,13 @@ Notes:
         -smsgscanchain      Scan the block chain for public key addresses on startup
 
 
+    Bucket Store
+        Messages are appended to a bucket file, time_01.dat, for each SMSG_BUCKET_LEN
+        time_01.idx holds the timestamp, sample and offset of each message in time_01.dat
+        At startup only the indexes are read, an index is rebuilt if it doesn't match its bucket file
+        Expiring a bucket removes both files
+
+
     Wallet Locked
         A copy of each incoming message is stored in bucket files ending in _wl.dat
         wl (wallet locked) bucket files are deleted if they expire, like normal buckets
@@ -46,9 +53,11 @@ Notes:
 
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string/predicate.hpp>
+#include <boost/shared_ptr.hpp>
 
 
 #include "base58.h"
+#include "checkqueue.h"
 #include "db.h"
 #include "init.h" // pwalletMain
 #include "main.h"
@@ -86,6 +95,204 @@ leveldb::DB *smsgDB = NULL;
 
 namespace fs = boost::filesystem;
 
+// -- Receiving keys of the enabled smsgAddresses, unpacked from the wallet once
+//    instead of for every message and address. Guarded by cs_smsgScanKeys
+//    alone, so the wallet can clear it the moment it locks without waiting
+//    for cs_smsg.
+class SecMsgScanKey
+{
+public:
+    std::string sAddress;
+    bool fReceiveAnon;
+    boost::shared_ptr<CECKey> pkey;
+};
+
+static std::map<std::string, boost::shared_ptr<CECKey> > mapSmsgScanKeys;
+static CCriticalSection cs_smsgScanKeys;
+
+static void SecureMsgClearScanKeys()
+{
+    // -- EC_KEY_free clears the private key
+    LOCK(cs_smsgScanKeys);
+    mapSmsgScanKeys.clear();
+}
+
+static void SecureMsgWalletStatusChanged(CCryptoKeyStore* wallet)
+{
+    // -- connected to the wallet while secure messaging runs
+    if (wallet->IsLocked())
+        SecureMsgClearScanKeys();
+}
+
+static void SecureMsgGetScanKeys(std::vector<SecMsgScanKey>& vKeys)
+{
+    // -- cs_smsg must be held and the wallet unlocked
+    //    Keys missing from the cache are read from the wallet without holding
+    //    cs_smsgScanKeys, the wallet calls SecureMsgWalletStatusChanged with
+    //    its own locks held.
+    std::map<std::string, boost::shared_ptr<CECKey> > mapCached, mapKeys;
+    {
+        LOCK(cs_smsgScanKeys);
+        mapCached = mapSmsgScanKeys;
+    }
+
+    for (std::vector<SecMsgAddress>::iterator it = smsgAddresses.begin(); it != smsgAddresses.end(); ++it)
+    {
+        if (!it->fReceiveEnabled)
+            continue;
+
+        SecMsgScanKey scanKey;
+        scanKey.sAddress = CBitcoinAddress(it->sAddress).ToString();
+        scanKey.fReceiveAnon = it->fReceiveAnon;
+
+        std::map<std::string, boost::shared_ptr<CECKey> >::iterator mi = mapCached.find(scanKey.sAddress);
+        if (mi != mapCached.end())
+        {
+            scanKey.pkey = mi->second;
+        } else
+        {
+            CBitcoinAddress coinAddress(scanKey.sAddress);
+            CKeyID ckid;
+            CKey key;
+            if (!coinAddress.GetKeyID(ckid)
+                || !pwalletMain->GetKey(ckid, key))
+            {
+                if (fDebugSmsg)
+                    LogPrintf("Could not get private key for %s.\n", scanKey.sAddress.c_str());
+                continue;
+            };
+
+            scanKey.pkey.reset(new CECKey());
+            scanKey.pkey->SetSecretBytes(key.begin());
+            ECDH_set_method(scanKey.pkey->GetECKey(), ECDH_OpenSSL());
+        };
+
+        mapKeys[scanKey.sAddress] = scanKey.pkey;
+        vKeys.push_back(scanKey);
+    };
+
+    // -- keys of addresses no longer receiving are dropped. Nothing is kept
+    //    if the wallet locked meanwhile, its notification may already have
+    //    cleared the cache.
+    LOCK(cs_smsgScanKeys);
+    if (pwalletMain->IsLocked())
+        mapSmsgScanKeys.clear();
+    else
+        mapSmsgScanKeys.swap(mapKeys);
+}
+
+static int SecureMsgTrialDecrypt(const std::vector<SecMsgScanKey>& vKeys, uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload)
+{
+    /* Find which of the receiving keys a message was encrypted to.
+       Only the shared secret and MAC are computed for each key, the message is
+       not decrypted.
+
+        returns
+            index into vKeys of the key the MAC matched with
+            -1 if no key matched, or on error
+    */
+
+    SecureMessage* psmsg = (SecureMessage*) pHeader;
+
+    if (psmsg->version[0] != 1)
+        return -1;
+
+    // -- key R is the same for every key tried
+    CPubKey cpkR(psmsg->cpkR, psmsg->cpkR+33);
+    if (!cpkR.IsValid())
+        return -1;
+
+    CECKey ecKeyR;
+    if (!ecKeyR.SetPubKey(cpkR))
+        return -1;
+    const EC_POINT* pubR = EC_KEY_get0_public_key(ecKeyR.GetECKey());
+
+    uint8_t vchP[32];
+    uint8_t vchHashed[64];
+    uint8_t MAC[32];
+    int nMatch = -1;
+
+    HMAC_CTX ctx;
+    HMAC_CTX_init(&ctx);
+
+    for (unsigned int i = 0; i < vKeys.size(); ++i)
+    {
+        // -- P = kR, key_m is the last 32 bytes of SHA512(P)
+        if (ECDH_compute_key(vchP, 32, pubR, vKeys[i].pkey->GetECKey(), NULL) != 32)
+            continue;
+        SHA512(vchP, 32, vchHashed);
+
+        uint32_t nBytes = 32;
+        if (!HMAC_Init_ex(&ctx, &vchHashed[32], 32, EVP_sha256(), NULL)
+            || !HMAC_Update(&ctx, (uint8_t*) &psmsg->timestamp, sizeof(psmsg->timestamp))
+            || !HMAC_Update(&ctx, pPayload, nPayload)
+            || !HMAC_Final(&ctx, MAC, &nBytes)
+            || nBytes != 32)
+            continue;
+
+        if (memcmp(MAC, psmsg->mac, 32) == 0)
+        {
+            nMatch = i;
+            break;
+        };
+    };
+
+    HMAC_CTX_cleanup(&ctx);
+    OPENSSL_cleanse(vchP, sizeof(vchP));
+    OPENSSL_cleanse(vchHashed, sizeof(vchHashed));
+
+    return nMatch;
+}
+
+/** Trial decryption of one incoming message, queued on a CCheckQueue so a
+ *  batch of messages is spread over the scan threads.
+ */
+class SecMsgScanCheck
+{
+private:
+    const std::vector<SecMsgScanKey>* pvKeys;
+    uint8_t* pHeader;
+    uint8_t* pPayload;
+    int* pnMatch;
+
+public:
+    SecMsgScanCheck() : pvKeys(NULL), pHeader(NULL), pPayload(NULL), pnMatch(NULL) {}
+    SecMsgScanCheck(const std::vector<SecMsgScanKey>& vKeys, uint8_t* pHeaderIn, uint8_t* pPayloadIn, int& nMatch) :
+        pvKeys(&vKeys), pHeader(pHeaderIn), pPayload(pPayloadIn), pnMatch(&nMatch) {}
+
+    bool operator()()
+    {
+        *pnMatch = SecureMsgTrialDecrypt(*pvKeys, pHeader, pPayload, ((SecureMessage*) pHeader)->nPayload);
+        return true;
+    }
+
+    void swap(SecMsgScanCheck& check)
+    {
+        std::swap(pvKeys, check.pvKeys);
+        std::swap(pHeader, check.pHeader);
+        std::swap(pPayload, check.pPayload);
+        std::swap(pnMatch, check.pnMatch);
+    }
+};
+
+static CCheckQueue<SecMsgScanCheck> smsgscanqueue(16);
+static int nSmsgScanThreads = 0;
+
+static void ThreadSecureMsgScan()
+{
+    smsgscanqueue.Thread();
+}
+
+static void SecureMsgStartScanThreads()
+{
+    nSmsgScanThreads = std::min((int)boost::thread::hardware_concurrency(), SMSG_MAX_SCAN_THREADS);
+    if (nSmsgScanThreads <= 1)
+        nSmsgScanThreads = 0;
+
+    for (int i = 0; i < nSmsgScanThreads - 1; i++)
+        threadGroupSmsg.create_thread(boost::bind(&TraceThread<void (*)()>, "smsg-scan", &ThreadSecureMsgScan));
+}
+
 bool SecMsgCrypter::SetKey(const std::vector<uint8_t>& vchNewKey, uint8_t* chNewIV)
 {
     if (vchNewKey.size() < sizeof(chKey))
@@ -615,6 +822,17 @@ void ThreadSecureMsg()
                         LogPrintf("Path %s does not exist \n", fullPath.string().c_str());
                     };
                     
+                    fullPath = GetDataDir() / "smsgStore" / (fileName + "_01.idx");
+                    if (fs::exists(fullPath))
+                    {
+                        try {
+                            fs::remove(fullPath);
+                        } catch (const fs::filesystem_error& ex)
+                        {
+                            LogPrintf("Error removing index file %s.\n", ex.what());
+                        };
+                    };
+
                     // -- look for a wl file, it stores incoming messages when wallet is locked
                     fullPath = GetDataDir() / "smsgStore" / (fileName + "_01_wl.dat");
                     if (fs::exists(fullPath))
@@ -753,10 +971,147 @@ void ThreadSecureMsgPow()
     };
 };
 
+// -- Bucket index, <bucket>_01.idx, has a record for every message appended to
+//    <bucket>_01.dat, so the token set of a bucket is loaded without reading
+//    the messages. An index that doesn't account for the whole bucket file
+//    exactly is rebuilt from the bucket file.
+#pragma pack(push, 1)
+class SecMsgIndexRecord
+{
+public:
+    int64_t   timestamp;
+    uint8_t   sample[8];
+    int64_t   offset;
+    uint32_t  nPayload;
+};
+#pragma pack(pop)
+
+static int SecureMsgWriteIndex(const fs::path& pathIdx, const SecMsgIndexRecord* pRecords, size_t nRecords, bool fAppend)
+{
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fopen(pathIdx.string().c_str(), fAppend ? "ab" : "wb")))
+    {
+        LogPrintf("Error opening index file: %s\n", strerror(errno));
+        return 1;
+    };
+
+    if (nRecords > 0
+        && fwrite(pRecords, sizeof(SecMsgIndexRecord), nRecords, fp) != nRecords)
+    {
+        LogPrintf("fwrite index failed: %s\n", strerror(errno));
+        fclose(fp);
+        return 1;
+    };
+
+    fclose(fp);
+    return 0;
+};
+
+static bool SecureMsgReadIndex(const fs::path& pathIdx, uint64_t nDatSize, std::vector<SecMsgIndexRecord>& vRecords)
+{
+    if (!fs::exists(pathIdx))
+        return false;
+
+    uint64_t nIdxSize = fs::file_size(pathIdx);
+    if (nIdxSize % sizeof(SecMsgIndexRecord) != 0)
+        return false;
+
+    vRecords.resize(nIdxSize / sizeof(SecMsgIndexRecord));
+
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fopen(pathIdx.string().c_str(), "rb")))
+    {
+        LogPrintf("Error opening index file: %s\n", strerror(errno));
+        return false;
+    };
+
+    bool fOk = vRecords.empty()
+        || fread(&vRecords[0], sizeof(SecMsgIndexRecord), vRecords.size(), fp) == vRecords.size();
+    fclose(fp);
+    if (!fOk)
+        return false;
+
+    // -- the records must tile the bucket file
+    int64_t nEnd = 0;
+    for (std::vector<SecMsgIndexRecord>::iterator it = vRecords.begin(); it != vRecords.end(); ++it)
+    {
+        if (it->offset != nEnd)
+            return false;
+        nEnd += SMSG_HDR_LEN + it->nPayload;
+    };
+    if ((uint64_t)nEnd != nDatSize)
+        return false;
+
+    return true;
+};
+
+static bool SecureMsgRebuildIndex(const fs::path& pathDat, const fs::path& pathIdx, std::vector<SecMsgIndexRecord>& vRecords)
+{
+    // -- read the headers of every message in the bucket file
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fopen(pathDat.string().c_str(), "rb")))
+    {
+        LogPrintf("Error opening file: %s\n", strerror(errno));
+        return false;
+    };
+
+    vRecords.clear();
+    SecureMessage smsg;
+    for (;;)
+    {
+        SecMsgIndexRecord record;
+        record.offset = ftell(fp);
+        errno = 0;
+        if (fread(&smsg.hash[0], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
+        {
+            if (errno != 0)
+            {
+                LogPrintf("fread header failed: %s\n", strerror(errno));
+            } else
+            {
+                //LogPrintf("End of file.\n");
+            };
+            break;
+        };
+        record.timestamp = smsg.timestamp;
+        record.nPayload = smsg.nPayload;
+
+        if (smsg.nPayload < 8)
+            break;
+
+        if (fread(record.sample, sizeof(uint8_t), 8, fp) != 8)
+        {
+            LogPrintf("fread data failed: %s\n", strerror(errno));
+            break;
+        };
+
+        if (fseek(fp, smsg.nPayload-8, SEEK_CUR) != 0)
+        {
+            LogPrintf("fseek, strerror: %s.\n", strerror(errno));
+            break;
+        };
+
+        vRecords.push_back(record);
+    };
+
+    fclose(fp);
+
+    // -- a bucket file with a broken tail keeps being rescanned at startup,
+    //    as its index never covers the whole file
+    if (SecureMsgWriteIndex(pathIdx, vRecords.empty() ? NULL : &vRecords[0], vRecords.size(), false) != 0)
+        LogPrintf("Could not write index %s.\n", pathIdx.string().c_str());
+
+    return true;
+};
+
 int SecureMsgBuildBucketSet()
 {
     /*
-        Build the bucket set by scanning the files in the smsgStore dir.
+        Build the bucket set from the bucket indexes in the smsgStore dir,
+        an index is rebuilt from its bucket file if it doesn't match.
 
         smsgBuckets should be empty
     */
@@ -787,6 +1142,24 @@ int SecureMsgBuildBucketSet()
 
         std::string fileType = (*itd).path().extension().string();
 
+        if (fileType.compare(".idx") == 0)
+        {
+            // -- indexes are read with their bucket file, only expire them here
+            std::string fileName = (*itd).path().filename().string();
+            size_t sep = fileName.find_first_of("_");
+            if (sep != std::string::npos
+                && boost::lexical_cast<int64_t>(fileName.substr(0, sep)) < now - SMSG_RETENTION)
+            {
+                try {
+                    fs::remove((*itd).path());
+                } catch (const fs::filesystem_error& ex)
+                {
+                    LogPrintf("Error removing index file %s, %s.\n", fileName.c_str(), ex.what());
+                };
+            };
+            continue;
+        };
+
         if (fileType.compare(".dat") != 0)
             continue;
 
@@ -827,62 +1200,43 @@ int SecureMsgBuildBucketSet()
             continue;
         };
 
+        fs::path pathIdx = (*itd).path();
+        pathIdx.replace_extension(".idx");
+
+        std::vector<SecMsgIndexRecord> vRecords;
+        bool fIndexed = false;
+        try {
+            fIndexed = SecureMsgReadIndex(pathIdx, fs::file_size((*itd).path()), vRecords);
+        } catch (const fs::filesystem_error& ex)
+        {
+            LogPrintf("Error reading index %s, %s.\n", pathIdx.string().c_str(), ex.what());
+        };
+
+        if (!fIndexed)
+        {
+            if (fDebugSmsg)
+                LogPrintf("Rebuilding index for %s.\n", fileName.c_str());
+            if (!SecureMsgRebuildIndex((*itd).path(), pathIdx, vRecords))
+                continue;
+        };
+
         size_t nTokenSetSize = 0;
-        SecureMessage smsg;
         {
             LOCK(cs_smsg);
-            
-            std::set<SecMsgToken>& tokenSet = smsgBuckets[fileTime].setTokens;
-            
-            FILE *fp;
 
-            if (!(fp = fopen((*itd).path().string().c_str(), "rb")))
-            {
-                LogPrintf("Error opening file: %s\n", strerror(errno));
-                continue;
-            };
+            std::set<SecMsgToken>& tokenSet = smsgBuckets[fileTime].setTokens;
 
-            for (;;)
+            for (std::vector<SecMsgIndexRecord>::iterator it = vRecords.begin(); it != vRecords.end(); ++it)
             {
-                long int ofs = ftell(fp);
                 SecMsgToken token;
-                token.offset = ofs;
-                errno = 0;
-                if (fread(&smsg.hash[0], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
-                {
-                    if (errno != 0)
-                    {
-                        LogPrintf("fread header failed: %s\n", strerror(errno));
-                    } else
-                    {
-                        //LogPrintf("End of file.\n");
-                    };
-                    break;
-                };
-                token.timestamp = smsg.timestamp;
-
-                if (smsg.nPayload < 8)
-                    continue;
-
-                if (fread(token.sample, sizeof(uint8_t), 8, fp) != 8)
-                {
-                    LogPrintf("fread data failed: %s\n", strerror(errno));
-                    break;
-                };
-
-                if (fseek(fp, smsg.nPayload-8, SEEK_CUR) != 0)
-                {
-                    LogPrintf("fseek, strerror: %s.\n", strerror(errno));
-                    break;
-                };
-
+                token.timestamp = it->timestamp;
+                memcpy(token.sample, it->sample, 8);
+                token.offset = it->offset;
                 tokenSet.insert(token);
             };
 
-            fclose(fp);
-            
             smsgBuckets[fileTime].hashBucket();
-            
+
             nTokenSetSize = tokenSet.size();
         } // LOCK(cs_smsg);
         
@@ -1120,6 +1474,9 @@ bool SecureMsgStart(bool fDontStart, bool fScanChain)
     
     threadGroupSmsg.create_thread(boost::bind(&TraceThread<void (*)()>, "smsg", &ThreadSecureMsg));
     threadGroupSmsg.create_thread(boost::bind(&TraceThread<void (*)()>, "smsg-pow", &ThreadSecureMsgPow));
+    SecureMsgStartScanThreads();
+    if (pwalletMain)
+        pwalletMain->NotifyStatusChanged.connect(&SecureMsgWalletStatusChanged);
     
     /*
     // -- start threads
@@ -1150,6 +1507,10 @@ bool SecureMsgShutdown()
     threadGroupSmsg.interrupt_all();
     threadGroupSmsg.join_all();
 
+    if (pwalletMain)
+        pwalletMain->NotifyStatusChanged.disconnect(&SecureMsgWalletStatusChanged);
+    SecureMsgClearScanKeys();
+
     if (smsgDB)
     {
         LOCK(cs_smsgDB);
@@ -1198,6 +1559,9 @@ bool SecureMsgEnable()
     // -- start threads
     threadGroupSmsg.create_thread(boost::bind(&TraceThread<void (*)()>, "smsg", &ThreadSecureMsg));
     threadGroupSmsg.create_thread(boost::bind(&TraceThread<void (*)()>, "smsg-pow", &ThreadSecureMsgPow));
+    SecureMsgStartScanThreads();
+    if (pwalletMain)
+        pwalletMain->NotifyStatusChanged.connect(&SecureMsgWalletStatusChanged);
     /*
     if (!NewThread(ThreadSecureMsg, NULL)
         || !NewThread(ThreadSecureMsgPow, NULL))
@@ -1263,6 +1627,9 @@ bool SecureMsgDisable()
             LogPrintf("Failed to save smsg.ini\n");
 
         smsgAddresses.clear();
+        if (pwalletMain)
+            pwalletMain->NotifyStatusChanged.disconnect(&SecureMsgWalletStatusChanged);
+        SecureMsgClearScanKeys();
 
     } // LOCK(cs_smsg);
 
@@ -2128,6 +2495,74 @@ bool SecureMsgScanBlockChain()
     return true;
 };
 
+static int SecureMsgScanFile(FILE *fp, uint32_t& nMessages, uint32_t& nFoundMessages)
+{
+    /*
+    Scan the messages of a bucket file, SMSG_SCAN_BATCH at a time.
+    Doesn't report to gui.
+
+    returns
+        0 success,
+        1 error
+    */
+
+    std::vector<std::vector<uint8_t> > vBatch(SMSG_SCAN_BATCH);
+    std::vector<std::pair<uint8_t*, uint8_t*> > vMessages;
+    vMessages.reserve(SMSG_SCAN_BATCH);
+
+    bool fEnd = false;
+    while (!fEnd)
+    {
+        vMessages.clear();
+        while (vMessages.size() < SMSG_SCAN_BATCH)
+        {
+            std::vector<uint8_t>& vchData = vBatch[vMessages.size()];
+            SecureMessage smsg;
+
+            errno = 0;
+            if (fread(&smsg.hash[0], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
+            {
+                if (errno != 0)
+                {
+                    LogPrintf("fread header failed: %s\n", strerror(errno));
+                } else
+                {
+                    //LogPrintf("End of file.\n");
+                };
+                fEnd = true;
+                break;
+            };
+
+            try { vchData.resize(SMSG_HDR_LEN + smsg.nPayload); } catch (std::exception& e)
+            {
+                LogPrintf("SecureMsgScanFile(): Could not resize vchData, %u, %s\n", smsg.nPayload, e.what());
+                return 1;
+            };
+            memcpy(&vchData[0], &smsg.hash[0], SMSG_HDR_LEN);
+
+            if (fread(&vchData[0] + SMSG_HDR_LEN, sizeof(uint8_t), smsg.nPayload, fp) != smsg.nPayload)
+            {
+                LogPrintf("fread data failed: %s\n", strerror(errno));
+                fEnd = true;
+                break;
+            };
+
+            vMessages.push_back(std::make_pair(&vchData[0], &vchData[0] + SMSG_HDR_LEN));
+        };
+
+        if (vMessages.empty())
+            break;
+
+        uint32_t nFound = 0;
+        if (SecureMsgScanMessages(vMessages, false, nFound) == 0)
+            nFoundMessages += nFound;
+
+        nMessages += vMessages.size();
+    };
+
+    return 0;
+};
+
 bool SecureMsgScanBuckets()
 {
     if (fDebugSmsg)
@@ -2153,9 +2588,6 @@ bool SecureMsgScanBuckets()
         return 0; // not an error
     };
 
-    SecureMessage smsg;
-    std::vector<uint8_t> vchData;
-
     for (fs::directory_iterator itd(pathSmsgDir) ; itd != itend ; ++itd)
     {
         if (!fs::is_regular_file(itd->status()))
@@ -2213,47 +2645,10 @@ bool SecureMsgScanBuckets()
                 continue;
             };
 
-            for (;;)
+            if (SecureMsgScanFile(fp, nMessages, nFoundMessages) != 0)
             {
-                errno = 0;
-                if (fread(&smsg.hash[0], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
-                {
-                    if (errno != 0)
-                    {
-                        LogPrintf("fread header failed: %s\n", strerror(errno));
-                    } else
-                    {
-                        //LogPrintf("End of file.\n");
-                    };
-                    break;
-                };
-
-                try { vchData.resize(smsg.nPayload); } catch (std::exception& e)
-                {
-                    LogPrintf("SecureMsgWalletUnlocked(): Could not resize vchData, %u, %s\n", smsg.nPayload, e.what());
-                    fclose(fp);
-                    return 1;
-                };
-
-                if (fread(&vchData[0], sizeof(uint8_t), smsg.nPayload, fp) != smsg.nPayload)
-                {
-                    LogPrintf("fread data failed: %s\n", strerror(errno));
-                    break;
-                };
-
-                // -- don't report to gui,
-                int rv = SecureMsgScanMessage(&smsg.hash[0], &vchData[0], smsg.nPayload, false);
-
-                if (rv == 0)
-                {
-                    nFoundMessages++;
-                } else
-                if (rv != 0)
-                {
-                    // SecureMsgScanMessage failed
-                };
-
-                nMessages ++;
+                fclose(fp);
+                return 1;
             };
 
             fclose(fp);
@@ -2307,9 +2702,6 @@ int SecureMsgWalletUnlocked()
         return 0; // not an error
     };
 
-    SecureMessage smsg;
-    std::vector<uint8_t> vchData;
-
     for (fs::directory_iterator itd(pathSmsgDir) ; itd != itend ; ++itd)
     {
         if (!fs::is_regular_file(itd->status()))
@@ -2358,47 +2750,10 @@ int SecureMsgWalletUnlocked()
                 continue;
             };
 
-            for (;;)
+            if (SecureMsgScanFile(fp, nMessages, nFoundMessages) != 0)
             {
-                errno = 0;
-                if (fread(&smsg.hash[0], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
-                {
-                    if (errno != 0)
-                    {
-                        LogPrintf("fread header failed: %s\n", strerror(errno));
-                    } else
-                    {
-                        //LogPrintf("End of file.\n");
-                    };
-                    break;
-                };
-
-                try { vchData.resize(smsg.nPayload); } catch (std::exception& e)
-                {
-                    LogPrintf("SecureMsgWalletUnlocked(): Could not resize vchData, %u, %s\n", smsg.nPayload, e.what());
-                    fclose(fp);
-                    return 1;
-                };
-
-                if (fread(&vchData[0], sizeof(uint8_t), smsg.nPayload, fp) != smsg.nPayload)
-                {
-                    LogPrintf("fread data failed: %s\n", strerror(errno));
-                    break;
-                };
-
-                // -- don't report to gui,
-                int rv = SecureMsgScanMessage(&smsg.hash[0], &vchData[0], smsg.nPayload, false);
-
-                if (rv == 0)
-                {
-                    nFoundMessages++;
-                } else
-                if (rv != 0)
-                {
-                    // SecureMsgScanMessage failed
-                };
-
-                nMessages ++;
+                fclose(fp);
+                return 1;
             };
 
             fclose(fp);
@@ -2476,60 +2831,103 @@ int SecureMsgScanMessage(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload,
     if (fDebugSmsg)
         LogPrintf("SecureMsgScanMessage()\n");
 
-    if (pwalletMain->IsLocked())
-    {
-        if (fDebugSmsg)
-            LogPrintf("ScanMessage: Wallet is locked, storing message to scan later.\n");
+    std::vector<std::pair<uint8_t*, uint8_t*> > vMessages;
+    vMessages.push_back(std::make_pair(pHeader, pPayload));
 
-        int rv;
-        if ((rv = SecureMsgStoreUnscanned(pHeader, pPayload, nPayload)) != 0)
-            return 1;
+    uint32_t nFound;
+    return SecureMsgScanMessages(vMessages, reportToGui, nFound);
+};
 
-        return 3;
-    };
+int SecureMsgScanMessages(std::vector<std::pair<uint8_t*, uint8_t*> >& vMessages, bool reportToGui, uint32_t& nFound)
+{
+    /*
+    Check a batch of messages (header, payload) against the owned addresses,
+    adding those that belong to this node to the inbox db.
 
-    std::string addressTo;
-    MessageData msg; // placeholder
-    bool fOwnMessage = false;
+    The messages are first matched to a receiving key by their MAC alone,
+    spread over the scan threads. Only messages that matched are decrypted.
 
-    for (std::vector<SecMsgAddress>::iterator it = smsgAddresses.begin(); it != smsgAddresses.end(); ++it)
-    {
-        if (!it->fReceiveEnabled)
-            continue;
+    returns
+        0 success,
+        1 error
+        3 wallet is locked - messages stored for scanning later.
+    */
 
-        CBitcoinAddress coinAddress(it->sAddress);
-        addressTo = coinAddress.ToString();
+    nFound = 0;
 
-        if (!it->fReceiveAnon)
-        {
-            // -- have to do full decrypt to see address from
-            if (SecureMsgDecrypt(false, addressTo, pHeader, pPayload, nPayload, msg) == 0)
-            {
-                if (fDebugSmsg)
-                    LogPrintf("Decrypted message with %s.\n", addressTo.c_str());
+    // -- only the receiving keys need cs_smsg. They are copied out with it
+    //    held; the messages are the caller's buffers. Matching, decrypting and
+    //    the inbox writes then run without blocking the message handler.
+    std::vector<SecMsgScanKey> vKeys;
+    {
+        LOCK(cs_smsg);
 
-                if (msg.sFromAddress.compare("anon") != 0)
-                    fOwnMessage = true;
-                break;
-            };
-        } else
+        if (pwalletMain->IsLocked())
         {
+            if (fDebugSmsg)
+                LogPrintf("ScanMessage: Wallet is locked, storing message to scan later.\n");
 
-            if (SecureMsgDecrypt(true, addressTo, pHeader, pPayload, nPayload, msg) == 0)
-            {
-                if (fDebugSmsg)
-                    LogPrintf("Decrypted message with %s.\n", addressTo.c_str());
+            SecureMsgClearScanKeys();
 
-                fOwnMessage = true;
-                break;
+            for (unsigned int i = 0; i < vMessages.size(); ++i)
+            {
+                SecureMessage* psmsg = (SecureMessage*) vMessages[i].first;
+                if (SecureMsgStoreUnscanned(vMessages[i].first, vMessages[i].second, psmsg->nPayload) != 0)
+                    return 1;
             };
-        }
+
+            return 3;
+        };
+
+        SecureMsgGetScanKeys(vKeys);
+    } // LOCK(cs_smsg);
+
+    std::vector<int> vMatch(vMessages.size(), -1);
+    if (!vKeys.empty())
+    {
+        CCheckQueueControl<SecMsgScanCheck> control(nSmsgScanThreads && vMessages.size() > 1 ? &smsgscanqueue : NULL);
+        std::vector<SecMsgScanCheck> vChecks;
+        vChecks.reserve(vMessages.size());
+        for (unsigned int i = 0; i < vMessages.size(); ++i)
+        {
+            SecMsgScanCheck check(vKeys, vMessages[i].first, vMessages[i].second, vMatch[i]);
+            if (!nSmsgScanThreads || vMessages.size() == 1)
+                check();
+            else
+                vChecks.push_back(check);
+        };
+        control.Add(vChecks);
+        control.Wait();
     };
 
-    if (fOwnMessage)
+    int rv = 0;
+    for (unsigned int i = 0; i < vMessages.size(); ++i)
     {
-        // -- save to inbox
+        if (vMatch[i] < 0)
+            continue;
+
+        uint8_t *pHeader = vMessages[i].first;
+        uint8_t *pPayload = vMessages[i].second;
         SecureMessage* psmsg = (SecureMessage*) pHeader;
+        uint32_t nPayload = psmsg->nPayload;
+
+        std::string addressTo = vKeys[vMatch[i]].sAddress;
+
+        if (fDebugSmsg)
+            LogPrintf("Decrypted message with %s.\n", addressTo.c_str());
+
+        if (!vKeys[vMatch[i]].fReceiveAnon)
+        {
+            // -- have to do full decrypt to see address from
+            MessageData msg;
+            if (SecureMsgDecrypt(false, addressTo, pHeader, pPayload, nPayload, msg) != 0
+                || msg.sFromAddress.compare("anon") == 0)
+                continue;
+        };
+
+        nFound++;
+
+        // -- save to inbox
         std::string sPrefix("im");
         uint8_t chKey[18];
         memcpy(&chKey[0],  sPrefix.data(),    2);
@@ -2546,7 +2944,8 @@ int SecureMsgScanMessage(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload,
             smsgInbox.vchMessage.resize(SMSG_HDR_LEN + nPayload);
         } catch (std::exception& e) {
             LogPrintf("SecureMsgScanMessage(): Could not resize vchData, %u, %s\n", SMSG_HDR_LEN + nPayload, e.what());
-            return 1;
+            rv = 1;
+            continue;
         };
         memcpy(&smsgInbox.vchMessage[0], pHeader, SMSG_HDR_LEN);
         memcpy(&smsgInbox.vchMessage[SMSG_HDR_LEN], pPayload, nPayload);
@@ -2573,7 +2972,7 @@ int SecureMsgScanMessage(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload,
         }
     };
 
-    return 0;
+    return rv;
 };
 
 int SecureMsgGetLocalKey(CKeyID& ckid, CPubKey& cpkOut)
@@ -2827,6 +3226,7 @@ int SecureMsgReceive(CNode* pfrom, std::vector<uint8_t>& vchData)
     };
 
     uint32_t n = 12;
+    std::vector<std::pair<uint8_t*, uint8_t*> > vMessages;
 
     for (uint32_t i = 0; i < nBunch; ++i)
     {
@@ -2860,15 +3260,20 @@ int SecureMsgReceive(CNode* pfrom, std::vector<uint8_t>& vchData)
                 // message dropped
                 break; // continue?
             };
-
-            if (SecureMsgScanMessage(&vchData[n], &vchData[n + SMSG_HDR_LEN], psmsg->nPayload, true) != 0)
-            {
-                // message recipient is not this node (or failed)
-            };
         } // LOCK(cs_smsg);
+
+        vMessages.push_back(std::make_pair(&vchData[n], &vchData[n + SMSG_HDR_LEN]));
         
         n += SMSG_HDR_LEN + psmsg->nPayload;
     };
+
+    // -- scan the whole bunch at once
+    uint32_t nFound;
+    if (!vMessages.empty()
+        && SecureMsgScanMessages(vMessages, true, nFound) != 0)
+    {
+        // message recipient is not this node (or failed)
+    };
     
     {
         LOCK(cs_smsg);
@@ -3063,6 +3468,16 @@ int SecureMsgStore(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool
 
     token.offset = ofs;
 
+    // -- a new bucket file starts a new index
+    SecMsgIndexRecord record;
+    record.timestamp = token.timestamp;
+    memcpy(record.sample, token.sample, 8);
+    record.offset = ofs;
+    record.nPayload = nPayload;
+    fs::path pathIdx = pathSmsgDir / (boost::lexical_cast<std::string>(bucket) + "_01.idx");
+    if (SecureMsgWriteIndex(pathIdx, &record, 1, ofs != 0) != 0)
+        LogPrintf("Could not update index %s.\n", pathIdx.string().c_str());
+
     //LogPrintf("token.offset: %d\n", token.offset); // DEBUG
     tokenSet.insert(token);
 
@@ -24,6 +24,9 @@ const unsigned int SMSG_THREAD_DELAY    = 20;
 const unsigned int SMSG_TIME_LEEWAY     = 60;
 const unsigned int SMSG_TIME_IGNORE     = 90;                // seconds that a peer is ignored for if they fail to deliver messages for a smsgWant
 
+const unsigned int SMSG_SCAN_BATCH      = 256;               // messages read from a bucket file per trial decryption batch
+const int SMSG_MAX_SCAN_THREADS         = 8;
+
 
 const unsigned int SMSG_MAX_MSG_BYTES   = 4096;              // the user input part
 
@@ -346,6 +349,7 @@ int SecureMsgWalletUnlocked();
 int SecureMsgWalletKeyChanged(std::string sAddress, std::string sLabel, ChangeType mode);
 
 int SecureMsgScanMessage(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool reportToGui);
+int SecureMsgScanMessages(std::vector<std::pair<uint8_t*, uint8_t*> >& vMessages, bool reportToGui, uint32_t& nFound);
 
 int SecureMsgGetStoredKey(CKeyID& ckid, CPubKey& cpkOut);
 int SecureMsgGetLocalKey(CKeyID& ckid, CPubKey& cpkOut);
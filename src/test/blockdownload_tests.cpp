@@ -0,0 +1,186 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockdownload_tests)
+
+static const int64_t nStart = 1400000000;
+
+static uint256 BlockHash(int n)
+{
+    // well clear of anything in mapBlockIndex
+    return uint256(1000 + n);
+}
+
+static vector<CInv> Schedule(CBlockDownloadQueue& queue, NodeId nodeid, int64_t nNow, bool fAhead = false)
+{
+    vector<CInv> vGetData;
+    queue.Schedule(nodeid, fAhead, nNow, vGetData);
+    return vGetData;
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_window)
+{
+    CBlockDownloadQueue queue;
+    const int nBlocks = BLOCK_DOWNLOAD_WINDOW + 50;
+    for (int i = 0; i < nBlocks; i++)
+        BOOST_CHECK(queue.Queue(1, BlockHash(i), false));
+    BOOST_CHECK_EQUAL(queue.GetSize(), (unsigned int)nBlocks);
+
+    // The announcing peer gets the oldest blocks, up to its transit limit
+    vector<CInv> vGetData = Schedule(queue, 1, nStart);
+    BOOST_REQUIRE_EQUAL(vGetData.size(), (size_t)MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    for (int i = 0; i < MAX_BLOCKS_IN_TRANSIT_PER_PEER; i++)
+        BOOST_CHECK(vGetData[i].type == MSG_BLOCK && vGetData[i].hash == BlockHash(i));
+    BOOST_CHECK_EQUAL(queue.GetInFlight(1), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK(Schedule(queue, 1, nStart).empty());
+
+    // Peers that announced nothing only help when they were ahead of us
+    BOOST_CHECK(Schedule(queue, 2, nStart).empty());
+
+    // However many peers help, nothing past the window is requested
+    set<uint256> setRequested;
+    BOOST_FOREACH(const CInv& inv, vGetData)
+        setRequested.insert(inv.hash);
+    for (NodeId nodeid = 2; nodeid < 40; nodeid++)
+        BOOST_FOREACH(const CInv& inv, Schedule(queue, nodeid, nStart, true))
+            BOOST_CHECK(setRequested.insert(inv.hash).second);
+    BOOST_CHECK_EQUAL(setRequested.size(), BLOCK_DOWNLOAD_WINDOW);
+    for (unsigned int i = 0; i < BLOCK_DOWNLOAD_WINDOW; i++)
+        BOOST_CHECK(setRequested.count(BlockHash(i)));
+
+    // Arrivals move the window on
+    for (int i = 0; i < 10; i++)
+        queue.Received(BlockHash(i));
+    BOOST_CHECK_EQUAL(queue.GetInFlight(1), MAX_BLOCKS_IN_TRANSIT_PER_PEER - 10);
+    vGetData = Schedule(queue, 40, nStart, true);
+    BOOST_REQUIRE_EQUAL(vGetData.size(), 10U);
+    BOOST_CHECK(vGetData[0].hash == BlockHash(BLOCK_DOWNLOAD_WINDOW));
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_continue)
+{
+    // The last block of a getblocks reply is only asked from the peer that
+    // sent the reply, as serving it makes the peer send the next batch
+    CBlockDownloadQueue queue;
+    BOOST_CHECK(queue.Queue(2, BlockHash(0), false));
+    BOOST_CHECK(queue.Queue(1, BlockHash(0), true));
+    BOOST_CHECK(Schedule(queue, 2, nStart).empty());
+    BOOST_CHECK(Schedule(queue, 3, nStart, true).empty());
+    BOOST_CHECK_EQUAL(Schedule(queue, 1, nStart).size(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_timeout)
+{
+    CBlockDownloadQueue queue;
+    BOOST_CHECK(queue.Queue(1, BlockHash(0), false));
+    BOOST_CHECK(queue.Queue(2, BlockHash(0), false));
+    BOOST_CHECK(queue.Queue(1, BlockHash(1), false));
+
+    BOOST_CHECK_EQUAL(Schedule(queue, 1, nStart).size(), 2U);
+    BOOST_CHECK(Schedule(queue, 2, nStart + BLOCK_DOWNLOAD_TIMEOUT).empty());
+
+    // Past the timeout the other source takes over; the block only peer 1
+    // had is given up on
+    vector<CInv> vGetData = Schedule(queue, 2, nStart + BLOCK_DOWNLOAD_TIMEOUT + 1);
+    BOOST_REQUIRE_EQUAL(vGetData.size(), 1U);
+    BOOST_CHECK(vGetData[0].hash == BlockHash(0));
+    BOOST_CHECK_EQUAL(queue.GetInFlight(1), 0);
+    BOOST_CHECK_EQUAL(queue.GetInFlight(2), 1);
+    BOOST_CHECK(!queue.IsQueued(BlockHash(1)));
+
+    // The slow peer is not asked again, nor can it announce the block again
+    BOOST_CHECK(!queue.Queue(1, BlockHash(0), false));
+    vGetData = Schedule(queue, 1, nStart + 3 * BLOCK_DOWNLOAD_TIMEOUT, true);
+    BOOST_CHECK(vGetData.empty());
+    BOOST_CHECK(queue.IsQueued(BlockHash(0)));
+
+    queue.Received(BlockHash(0));
+    BOOST_CHECK(queue.IsEmpty());
+    BOOST_CHECK_EQUAL(queue.GetInFlight(2), 0);
+    BOOST_CHECK_EQUAL(queue.GetPeerEntries(1), 0U);
+    BOOST_CHECK_EQUAL(queue.GetPeerEntries(2), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_notfound)
+{
+    CBlockDownloadQueue queue;
+    BOOST_CHECK(queue.Queue(1, BlockHash(0), false));
+    BOOST_CHECK(queue.Queue(2, BlockHash(0), false));
+    BOOST_CHECK_EQUAL(Schedule(queue, 1, nStart).size(), 1U);
+
+    // Only the peer it was asked from can give it back
+    queue.NotFound(2, BlockHash(0));
+    BOOST_CHECK(Schedule(queue, 2, nStart).empty());
+
+    // ...and then it is requested elsewhere without waiting for the timeout
+    queue.NotFound(1, BlockHash(0));
+    BOOST_CHECK_EQUAL(queue.GetInFlight(1), 0);
+    BOOST_CHECK_EQUAL(Schedule(queue, 2, nStart).size(), 1U);
+    BOOST_CHECK(Schedule(queue, 1, nStart, true).empty());
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_disconnect)
+{
+    CBlockDownloadQueue queue;
+    for (int i = 0; i < 4; i++)
+        BOOST_CHECK(queue.Queue(1, BlockHash(i), false));
+    BOOST_CHECK(queue.Queue(2, BlockHash(0), false));
+    BOOST_CHECK(queue.Queue(2, BlockHash(1), false));
+    BOOST_CHECK_EQUAL(Schedule(queue, 1, nStart).size(), 4U);
+    BOOST_CHECK_EQUAL(queue.GetPeerEntries(1), 4U);
+
+    // Blocks another peer announced are handed over at once, the rest dropped
+    queue.RemovePeer(1);
+    BOOST_CHECK_EQUAL(queue.GetInFlight(1), 0);
+    BOOST_CHECK_EQUAL(queue.GetPeerEntries(1), 0U);
+    BOOST_CHECK_EQUAL(queue.GetSize(), 2U);
+    vector<CInv> vGetData = Schedule(queue, 2, nStart);
+    BOOST_REQUIRE_EQUAL(vGetData.size(), 2U);
+    BOOST_CHECK(vGetData[0].hash == BlockHash(0));
+    BOOST_CHECK(vGetData[1].hash == BlockHash(1));
+
+    queue.RemovePeer(2);
+    BOOST_CHECK(queue.IsEmpty());
+    BOOST_CHECK_EQUAL(queue.GetInFlight(2), 0);
+
+    // Removing an unknown peer is harmless
+    queue.RemovePeer(3);
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_limits)
+{
+    CBlockDownloadQueue queue;
+    int n = 0;
+    for (unsigned int i = 0; i < MAX_QUEUED_BLOCKS_PER_PEER; i++)
+        BOOST_CHECK(queue.Queue(1, BlockHash(n++), false));
+
+    // One peer can't take more than its share, not even of known blocks
+    BOOST_CHECK(!queue.Queue(1, BlockHash(n), false));
+    BOOST_CHECK(queue.Queue(2, BlockHash(n), false));
+    BOOST_CHECK(!queue.Queue(1, BlockHash(n), false));
+    BOOST_CHECK(queue.Queue(1, BlockHash(0), false));
+    n++;
+
+    // and all peers together can't grow the queue past its total cap
+    NodeId nodeid = 2;
+    while (queue.GetSize() < MAX_QUEUED_BLOCKS)
+    {
+        if (queue.GetPeerEntries(nodeid) >= MAX_QUEUED_BLOCKS_PER_PEER)
+            nodeid++;
+        BOOST_CHECK(queue.Queue(nodeid, BlockHash(n++), false));
+    }
+    BOOST_CHECK(!queue.Queue(nodeid + 1, BlockHash(n), false));
+    BOOST_CHECK_EQUAL(queue.GetSize(), MAX_QUEUED_BLOCKS);
+    BOOST_CHECK_EQUAL(queue.GetPeerEntries(nodeid + 1), 0U);
+
+    // A disconnect frees the space again
+    queue.RemovePeer(1);
+    BOOST_CHECK_EQUAL(queue.GetSize(), MAX_QUEUED_BLOCKS - MAX_QUEUED_BLOCKS_PER_PEER);
+    BOOST_CHECK(queue.Queue(nodeid + 1, BlockHash(n), false));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
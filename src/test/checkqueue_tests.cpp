@@ -0,0 +1,126 @@
+#include <boost/test/unit_test.hpp>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include "checkqueue.h"
+
+using namespace std;
+
+// Stand-in for CScriptCheck: counts how often it ran and returns a fixed result.
+static volatile int nChecksRun = 0;
+
+class CFakeCheck
+{
+public:
+    bool fOk;
+
+    CFakeCheck() : fOk(true) {}
+    CFakeCheck(bool fOkIn) : fOk(fOkIn) {}
+
+    bool operator()()
+    {
+        __sync_fetch_and_add(&nChecksRun, 1);
+        return fOk;
+    }
+
+    void swap(CFakeCheck& check)
+    {
+        std::swap(fOk, check.fOk);
+    }
+};
+
+// Owns a queue with the worker threads main.cpp would run for -par=4.
+struct CheckQueueSetup
+{
+    CCheckQueue<CFakeCheck> queue;
+    boost::thread_group threadGroup;
+
+    CheckQueueSetup() : queue(16)
+    {
+        nChecksRun = 0;
+        for (int i = 0; i < 3; i++)
+            threadGroup.create_thread(boost::bind(&CCheckQueue<CFakeCheck>::Thread, &queue));
+    }
+
+    ~CheckQueueSetup()
+    {
+        queue.Quit();
+        threadGroup.join_all();
+    }
+
+    // Connects one "block": nTxs transactions of nInputs checks each, with
+    // the check at nFail (counted across the block) failing, if any.
+    bool RunBlock(int nTxs, int nInputs, int nFail = -1)
+    {
+        CCheckQueueControl<CFakeCheck> control(&queue);
+        int n = 0;
+        for (int i = 0; i < nTxs; i++)
+        {
+            vector<CFakeCheck> vChecks;
+            for (int j = 0; j < nInputs; j++, n++)
+                vChecks.push_back(CFakeCheck(n != nFail));
+            control.Add(vChecks);
+        }
+        return control.Wait();
+    }
+};
+
+BOOST_FIXTURE_TEST_SUITE(checkqueue_tests, CheckQueueSetup)
+
+BOOST_AUTO_TEST_CASE(checkqueue_all_pass)
+{
+    BOOST_CHECK(RunBlock(100, 10));
+    BOOST_CHECK_EQUAL(nChecksRun, 1000);
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_single_failure)
+{
+    // Wherever the bad input sits, the block fails; checks after it may be
+    // skipped but never run twice.
+    int vFail[] = { 0, 1, 499, 998, 999 };
+    for (unsigned int i = 0; i < sizeof(vFail) / sizeof(vFail[0]); i++)
+    {
+        nChecksRun = 0;
+        BOOST_CHECK(!RunBlock(100, 10, vFail[i]));
+        BOOST_CHECK(nChecksRun >= 1 && nChecksRun <= 1000);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_empty)
+{
+    // A block with no script checks (coinbase/coinstake only) passes at once.
+    BOOST_CHECK(RunBlock(0, 0));
+    BOOST_CHECK(RunBlock(5, 0));
+    BOOST_CHECK_EQUAL(nChecksRun, 0);
+
+    // The control releases the queue even if Wait() is never called.
+    {
+        CCheckQueueControl<CFakeCheck> control(&queue);
+    }
+    BOOST_CHECK(RunBlock(1, 1));
+    BOOST_CHECK_EQUAL(nChecksRun, 1);
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_reuse)
+{
+    // A failed block must not leak its result into the next one connected on
+    // the same queue, and a good block must not mask a later failure.
+    for (int i = 0; i < 50; i++)
+    {
+        bool fFail = (i % 3 == 1);
+        BOOST_CHECK_EQUAL(RunBlock(1 + i % 7, 1 + i % 5, fFail ? 0 : -1), !fFail);
+    }
+    BOOST_CHECK(RunBlock(10, 10));
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_no_workers)
+{
+    // With -par=1 main.cpp passes no queue and the control is a no-op.
+    CCheckQueueControl<CFakeCheck> control(NULL);
+    vector<CFakeCheck> vChecks(1, CFakeCheck(false));
+    control.Add(vChecks);
+    BOOST_CHECK(control.Wait());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
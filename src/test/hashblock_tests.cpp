@@ -0,0 +1,67 @@
+#include <boost/test/unit_test.hpp>
+
+#include "hashblock.h"
+#include "util.h"
+
+#include <string.h>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(hashblock_tests)
+
+typedef struct {
+    const char *pszData;
+    const char *pszHash;
+} testvec_t;
+
+// Computed with the portable sphlib chain before the SSE2/AES-NI stages were added
+static const testvec_t vtest[] = {
+    {
+        "",
+        "ba4e5867eb17cdc33dccb6cc7175256320e2b4627ec221a26e5783902072b551"
+    },
+    {
+        "The quick brown fox jumps over the lazy dog",
+        "5cbc66e69d1c11fe78983d2e533bf2c29d440072f7027f44326bf1e4a4364553"
+    },
+    {
+        "RenosCoin",
+        "e28beb4a3cab1b80a15fc76d8888d6e421bcf86c4801d43ad61b7badf36516f1"
+    },
+};
+
+BOOST_AUTO_TEST_CASE(hashblock_testvectors)
+{
+    for (unsigned int n = 0; n < sizeof(vtest)/sizeof(vtest[0]); n++)
+    {
+        const char *p = vtest[n].pszData;
+        BOOST_CHECK_EQUAL(Hash9(p, p + strlen(p)).GetHex(), vtest[n].pszHash);
+        BOOST_CHECK_EQUAL(HashX11Generic(p, strlen(p)).GetHex(), vtest[n].pszHash);
+    }
+
+    // A block header sized input and one that spans several blake blocks
+    unsigned char header[80];
+    for (int i = 0; i < 80; i++)
+        header[i] = i;
+    BOOST_CHECK_EQUAL(Hash9(header, header + 80).GetHex(), "ceece3d4f75f36c26b50278c1ae635eef54fde24e49cea10e29ea3a97a762e41");
+
+    unsigned char data[200];
+    for (int i = 0; i < 200; i++)
+        data[i] = i * 7 + 3;
+    BOOST_CHECK_EQUAL(Hash9(data, data + 200).GetHex(), "1d41f32d7c94f6c29aefa2110c1b5ac7785fcb9ec20d439e12c9826963e53e92");
+}
+
+BOOST_AUTO_TEST_CASE(hashblock_generic_match)
+{
+    // Whatever implementation was selected for this CPU must agree with the portable one
+    unsigned char data[256];
+    for (int n = 0; n < 1000; n++)
+    {
+        size_t nSize = GetRand(sizeof(data) + 1);
+        for (size_t i = 0; i < nSize; i++)
+            data[i] = GetRand(256);
+        BOOST_CHECK(HashX11(data, nSize) == HashX11Generic(data, nSize));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
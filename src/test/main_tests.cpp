@@ -0,0 +1,106 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(main_tests)
+
+// The merkle tree as it was built before the levels were hashed in batches
+static uint256 NaiveMerkleRoot(const CBlock& block)
+{
+    vector<uint256> vTree;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        vTree.push_back(tx.GetHash());
+    int j = 0;
+    for (int nSize = block.vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+    {
+        for (int i = 0; i < nSize; i += 2)
+        {
+            int i2 = std::min(i+1, nSize-1);
+            vTree.push_back(Hash(BEGIN(vTree[j+i]),  END(vTree[j+i]),
+                                 BEGIN(vTree[j+i2]), END(vTree[j+i2])));
+        }
+        j += nSize;
+    }
+    return (vTree.empty() ? 0 : vTree.back());
+}
+
+// A one input, two output transaction of typical size
+static CTransaction RandomTransaction()
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), GetRand(4));
+    tx.vin[0].scriptSig = CScript() << vector<unsigned char>(72, 1) << vector<unsigned char>(33, 2);
+    tx.vout.resize(2);
+    for (int i = 0; i < 2; i++)
+    {
+        tx.vout[i].nValue = GetRand(100 * COIN);
+        tx.vout[i].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20, i) << OP_EQUALVERIFY << OP_CHECKSIG;
+    }
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(merkle_root)
+{
+    CBlock block;
+    BOOST_CHECK(block.BuildMerkleTree() == 0);
+    for (int n = 1; n <= 70; n++)
+    {
+        block.vtx.push_back(RandomTransaction());
+        BOOST_CHECK(block.BuildMerkleTree() == NaiveMerkleRoot(block));
+
+        // The branches still lead to the root
+        int nIndex = GetRand(n);
+        BOOST_CHECK(CBlock::CheckMerkleBranch(block.vtx[nIndex].GetHash(), block.GetMerkleBranch(nIndex), nIndex) == block.vMerkleTree.back());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(transaction_hash_cache)
+{
+    CTransaction tx = RandomTransaction();
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << tx;
+
+    // Reading a transaction doesn't cache its hash, the reader may change it
+    CTransaction txRead;
+    ss >> txRead;
+    BOOST_CHECK(txRead.GetHash() == tx.GetHash());
+    txRead.vout[0].nValue++;
+    BOOST_CHECK(txRead.GetHash() == SerializeHash(txRead));
+    BOOST_CHECK(txRead.GetHash() != tx.GetHash());
+
+    // Copies of a cached transaction can be changed
+    uint256 hash = tx.GetHash();
+    tx.CacheHash();
+    BOOST_CHECK(tx.GetHash() == hash);
+    CTransaction txCopy(tx);
+    txCopy.vout[0].nValue++;
+    BOOST_CHECK(txCopy.GetHash() == SerializeHash(txCopy));
+    txCopy = tx;
+    txCopy.vin[0].prevout.n++;
+    BOOST_CHECK(txCopy.GetHash() == SerializeHash(txCopy));
+    BOOST_CHECK(txCopy.GetHash() != hash);
+
+    // Assigning or reading over a cached transaction drops its hash
+    tx = txRead;
+    BOOST_CHECK(tx.GetHash() == txRead.GetHash());
+    tx.CacheHash();
+    CDataStream ssCopy(SER_NETWORK, PROTOCOL_VERSION);
+    ssCopy << txCopy;
+    ssCopy >> tx;
+    BOOST_CHECK(tx.GetHash() == txCopy.GetHash());
+
+    // A block's transactions only once the block is cached
+    CBlock block;
+    block.vtx.push_back(txRead);
+    block.CacheTxHashes();
+    BOOST_CHECK(block.vtx[0].GetHash() == txRead.GetHash());
+    CBlock blockCopy(block);
+    blockCopy.vtx[0].nLockTime++;
+    BOOST_CHECK(blockCopy.vtx[0].GetHash() == SerializeHash(blockCopy.vtx[0]));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
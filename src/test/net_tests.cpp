@@ -0,0 +1,82 @@
+#include <boost/test/unit_test.hpp>
+
+#include <string.h>
+
+#include "net.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+BOOST_AUTO_TEST_CASE(shared_message)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader("ping", 0) << (uint64_t)0x0123456789abcdefULL;
+    CSharedMessage msg = MakeSharedMessage(ss);
+    BOOST_CHECK(ss.empty());
+    BOOST_CHECK_EQUAL(msg->size(), CMessageHeader::HEADER_SIZE + 8);
+
+    // The header it was finished with is what a receiving node checks
+    CDataStream ssRecv(*msg, SER_NETWORK, PROTOCOL_VERSION);
+    CMessageHeader hdr;
+    ssRecv >> hdr;
+    BOOST_CHECK(hdr.IsValid());
+    BOOST_CHECK_EQUAL(hdr.GetCommand(), "ping");
+    BOOST_CHECK_EQUAL(hdr.nMessageSize, 8U);
+    uint256 hash = Hash(ssRecv.begin(), ssRecv.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    BOOST_CHECK_EQUAL(hdr.nChecksum, nChecksum);
+}
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(send_batched)
+{
+    // Small messages queued behind a full socket go out several to a call,
+    // complete and in order, wherever the kernel cuts the sends
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    int nBufSize = 4096;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &nBufSize, sizeof(nBufSize));
+    CNode node(fds[0], CAddress(), "", true);
+
+    const int nMessages = 1000;
+    string strExpected;
+    {
+        LOCK(node.cs_vSend);
+        for (int i = 0; i < nMessages; i++)
+        {
+            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+            ss << CMessageHeader("ping", 0) << (uint64_t)i;
+            CSharedMessage msg = MakeSharedMessage(ss);
+            strExpected.append(msg->begin(), msg->end());
+            node.QueueMessage(msg);
+        }
+        BOOST_CHECK(!node.vSendMsg.empty());
+    }
+
+    string strReceived;
+    char pchBuf[1000];
+    while (strReceived.size() < strExpected.size())
+    {
+        int nBytes = recv(fds[1], pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+        if (nBytes > 0)
+            strReceived.append(pchBuf, nBytes);
+        LOCK(node.cs_vSend);
+        SocketSendData(&node);
+    }
+    BOOST_CHECK(strReceived == strExpected);
+    BOOST_CHECK(node.vSendMsg.empty());
+    BOOST_CHECK_EQUAL(node.nSendSize, 0U);
+    BOOST_CHECK_EQUAL(node.nSendOffset, 0U);
+    BOOST_CHECK_EQUAL(node.nSendBytes, strExpected.size());
+    BOOST_CHECK(node.nSendCalls < (uint64_t)nMessages);
+    BOOST_TEST_MESSAGE(strprintf("%d messages of %u bytes sent in %d calls",
+        nMessages, strExpected.size() / nMessages, node.nSendCalls));
+
+    close(fds[1]);
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,121 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(rawblock_tests)
+
+static CSharedMessage MakeMessage(size_t nSize)
+{
+    return CSharedMessage(new CSerializeData(nSize));
+}
+
+BOOST_AUTO_TEST_CASE(rawblockcache_lru)
+{
+    CRawBlockCache cache(4000);
+    CSharedMessage vMsg[5];
+    for (int i = 0; i < 5; i++)
+        vMsg[i] = MakeMessage(1000);
+
+    for (int i = 0; i < 4; i++)
+        cache.Insert(uint256(i), vMsg[i]);
+    BOOST_CHECK_EQUAL(cache.GetSize(), 4000U);
+
+    // A hit hands out the cached message itself and makes it the most
+    // recently used, so the next insert evicts block 1 instead
+    CSharedMessage msg;
+    BOOST_CHECK(cache.Get(uint256(0), msg));
+    BOOST_CHECK(msg == vMsg[0]);
+
+    cache.Insert(uint256(4), vMsg[4]);
+    BOOST_CHECK_EQUAL(cache.GetSize(), 4000U);
+    BOOST_CHECK(!cache.Get(uint256(1), msg));
+    BOOST_CHECK(cache.Get(uint256(0), msg) && msg == vMsg[0]);
+    BOOST_CHECK(cache.Get(uint256(2), msg) && msg == vMsg[2]);
+    BOOST_CHECK(cache.Get(uint256(4), msg) && msg == vMsg[4]);
+
+    // Inserting a cached block again changes nothing
+    cache.Insert(uint256(4), MakeMessage(1000));
+    BOOST_CHECK(cache.Get(uint256(4), msg) && msg == vMsg[4]);
+    BOOST_CHECK_EQUAL(cache.GetSize(), 4000U);
+
+    // Messages over a quarter of the cache are never kept
+    cache.Insert(uint256(5), MakeMessage(1001));
+    BOOST_CHECK(!cache.Get(uint256(5), msg));
+    BOOST_CHECK(cache.Get(uint256(0), msg));
+}
+
+BOOST_AUTO_TEST_CASE(rawblock_read)
+{
+    BOOST_REQUIRE(pindexGenesisBlock);
+    CBlock block;
+    BOOST_REQUIRE(block.ReadFromDisk(pindexGenesisBlock));
+
+    // The message is the block as CBlock serializes it, behind a "block" header
+    CSharedMessage msg;
+    BOOST_REQUIRE(ReadRawBlockFromDisk(msg, pindexGenesisBlock));
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << block;
+    BOOST_REQUIRE_EQUAL(msg->size(), CMessageHeader::HEADER_SIZE + ssBlock.size());
+    BOOST_CHECK(std::equal(ssBlock.begin(), ssBlock.end(), msg->begin() + CMessageHeader::HEADER_SIZE));
+
+    CDataStream ssHeader(msg->begin(), msg->begin() + CMessageHeader::HEADER_SIZE, SER_NETWORK, PROTOCOL_VERSION);
+    CMessageHeader hdr;
+    ssHeader >> hdr;
+    BOOST_CHECK(hdr.IsValid());
+    BOOST_CHECK_EQUAL(hdr.GetCommand(), "block");
+    BOOST_CHECK_EQUAL(hdr.nMessageSize, ssBlock.size());
+
+    // The second read is served from the cache without a copy
+    CSharedMessage msg2;
+    BOOST_CHECK(ReadRawBlockFromDisk(msg2, pindexGenesisBlock));
+    BOOST_CHECK(msg2 == msg);
+}
+
+BOOST_AUTO_TEST_CASE(rawblock_read_rejects_bad_hash)
+{
+    // The right bytes under the wrong index entry
+    CBlockIndex index = *pindexGenesisBlock;
+    uint256 hashWrong = 1;
+    index.phashBlock = &hashWrong;
+    CSharedMessage msg;
+    BOOST_CHECK(!ReadRawBlockFromDisk(msg, &index));
+    BOOST_CHECK(!msg);
+}
+
+BOOST_AUTO_TEST_CASE(rawblock_read_rejects_bad_size)
+{
+    unsigned int vSizes[] = { 0, 79, MAX_BLOCK_SIZE + 1, 0xffffffff };
+    for (unsigned int i = 0; i < sizeof(vSizes) / sizeof(vSizes[0]); i++)
+    {
+        // A record with the usual framing but an impossible size
+        unsigned int nFile;
+        FILE* file = AppendBlockFile(nFile);
+        BOOST_REQUIRE(file);
+        unsigned int nSize = vSizes[i];
+        fwrite(Params().MessageStart(), 1, MESSAGE_START_SIZE, file);
+        fwrite(&nSize, 1, sizeof(nSize), file);
+        long nBlockPos = ftell(file);
+        char pchJunk[100] = {};
+        fwrite(pchJunk, 1, sizeof(pchJunk), file);
+        fclose(file);
+
+        CBlockIndex index;
+        uint256 hash = 2 + i;
+        index.phashBlock = &hash;
+        index.nFile = nFile;
+        index.nBlockPos = nBlockPos;
+        CSharedMessage msg;
+        BOOST_CHECK(!ReadRawBlockFromDisk(msg, &index));
+    }
+
+    // A position that leaves no room for the framing
+    CBlockIndex index = *pindexGenesisBlock;
+    index.nBlockPos = 4;
+    CSharedMessage msg;
+    BOOST_CHECK(!ReadRawBlockFromDisk(msg, &index));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
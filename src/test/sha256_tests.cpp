@@ -0,0 +1,101 @@
+#include <boost/test/unit_test.hpp>
+
+#include "hash.h"
+#include "util.h"
+
+#include <string.h>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(sha256_tests)
+
+typedef struct {
+    const char *pszData;
+    const char *pszHash;
+} testvec_t;
+
+// FIPS 180-2 examples
+static const testvec_t vtest[] = {
+    {
+        "",
+        "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"
+    },
+    {
+        "abc",
+        "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"
+    },
+    {
+        "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+        "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"
+    },
+};
+
+// Every combination SHA256AutoDetect() can be restricted to, the CPU
+// permitting, so each variant gets tested on machines that have it
+static const int vAllow[] = {
+    0, SHA256_USE_SSE41, SHA256_USE_AVX2, SHA256_USE_SHANI, SHA256_USE_ALL
+};
+
+BOOST_AUTO_TEST_CASE(sha256_testvectors)
+{
+    for (unsigned int i = 0; i < sizeof(vAllow)/sizeof(vAllow[0]); i++)
+    {
+        SHA256AutoDetect(vAllow[i]);
+        for (unsigned int n = 0; n < sizeof(vtest)/sizeof(vtest[0]); n++)
+        {
+            unsigned char hash[CSHA256::OUTPUT_SIZE];
+            CSHA256().Write((const unsigned char*)vtest[n].pszData, strlen(vtest[n].pszData)).Finalize(hash);
+            BOOST_CHECK_EQUAL(HexStr(hash, hash + sizeof(hash)), vtest[n].pszHash);
+        }
+
+        // One million 'a', written in uneven pieces
+        CSHA256 sha;
+        unsigned char data[1000];
+        memset(data, 'a', sizeof(data));
+        for (int nWritten = 0; nWritten < 1000000; )
+        {
+            int nSize = std::min(1 + nWritten % 997, 1000000 - nWritten);
+            sha.Write(data, nSize);
+            nWritten += nSize;
+        }
+        unsigned char hash[CSHA256::OUTPUT_SIZE];
+        sha.Finalize(hash);
+        BOOST_CHECK_EQUAL(HexStr(hash, hash + sizeof(hash)), "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+
+        // Double SHA-256, including the 64 byte special case
+        unsigned char input[64];
+        for (int n = 0; n < 64; n++)
+            input[n] = n;
+        BOOST_CHECK_EQUAL(Hash(input, input).GetHex(), "56944c5d3f98413ef45cf54545538103cc9f298e0575820ad3591376e2e0f65d");
+        BOOST_CHECK_EQUAL(Hash(input, input + 64).GetHex(), "ef0339214e2c4c9e430157a6f56921fb6c89f2e20f40ebf46a1b0a7864f4c901");
+        BOOST_CHECK_EQUAL(Hash(input, input + 20, input + 20, input + 64).GetHex(), "ef0339214e2c4c9e430157a6f56921fb6c89f2e20f40ebf46a1b0a7864f4c901");
+    }
+    SHA256AutoDetect();
+}
+
+BOOST_AUTO_TEST_CASE(sha256d64_match)
+{
+    // Batches of every size up to two full 8 way rounds plus leftovers
+    // against the streaming hasher
+    unsigned char input[64 * 21], output[32 * 21];
+    for (unsigned int n = 0; n < sizeof(input); n++)
+        input[n] = GetRand(256);
+
+    for (unsigned int i = 0; i < sizeof(vAllow)/sizeof(vAllow[0]); i++)
+    {
+        SHA256AutoDetect(vAllow[i]);
+        for (size_t nBlocks = 0; nBlocks <= 21; nBlocks++)
+        {
+            SHA256D64(output, input, nBlocks);
+            for (size_t n = 0; n < nBlocks; n++)
+            {
+                unsigned char hash[CHash256::OUTPUT_SIZE];
+                CHash256().Write(input + 64 * n, 64).Finalize(hash);
+                BOOST_CHECK(memcmp(hash, output + 32 * n, 32) == 0);
+            }
+        }
+    }
+    SHA256AutoDetect();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,48 @@
+#define BOOST_TEST_MODULE RenosCoin Test Suite
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+
+#include "hash.h"
+#include "init.h"
+#include "main.h"
+#include "util.h"
+#ifdef ENABLE_WALLET
+#include "db.h"
+#include "wallet.h"
+#endif
+
+extern void noui_connect();
+
+struct TestingSetup {
+    boost::filesystem::path pathTemp;
+
+    TestingSetup() {
+        SHA256AutoDetect();
+        noui_connect();
+        pathTemp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("test_renos_%%%%%%%%");
+        boost::filesystem::create_directories(pathTemp);
+        mapArgs["-datadir"] = pathTemp.string();
+#ifdef ENABLE_WALLET
+        bitdb.MakeMock();
+#endif
+        LoadBlockIndex(true);
+#ifdef ENABLE_WALLET
+        bool fFirstRun;
+        pwalletMain = new CWallet("wallet.dat");
+        pwalletMain->LoadWallet(fFirstRun);
+        RegisterWallet(pwalletMain);
+#endif
+    }
+    ~TestingSetup()
+    {
+#ifdef ENABLE_WALLET
+        UnregisterWallet(pwalletMain);
+        delete pwalletMain;
+        pwalletMain = NULL;
+        bitdb.Flush(true);
+#endif
+        boost::filesystem::remove_all(pathTemp);
+    }
+};
+
+BOOST_GLOBAL_FIXTURE(TestingSetup);
@@ -0,0 +1,91 @@
+#include <boost/test/unit_test.hpp>
+
+#include "txdb.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(txdb_tests)
+
+// Heights deliberately span several bytes and are written out of order; the
+// index must still hand them back in chain order.
+static const int vHeights[] = { 70000, 1, 300, 2, 65536 };
+static const int vSorted[] = { 1, 2, 300, 65536, 70000 };
+static const int nEntries = sizeof(vHeights) / sizeof(vHeights[0]);
+
+static vector<uint256> Slice(int nBegin, int nEnd)
+{
+    vector<uint256> v;
+    for (int i = nBegin; i < nEnd; i++)
+        v.push_back(uint256(vSorted[i]));
+    return v;
+}
+
+static void CheckRead(CTxDB& txdb, uint160 addr, int nSkip, int nCount, const vector<uint256>& vExpected)
+{
+    vector<uint256> vtx;
+    BOOST_CHECK(txdb.ReadAddrIndex(addr, vtx, nSkip, nCount));
+    BOOST_CHECK(vtx == vExpected);
+}
+
+BOOST_AUTO_TEST_CASE(addrindex_paging)
+{
+    CTxDB txdb("r+");
+    BOOST_CHECK(txdb.ClearAddrIndex());
+
+    // Neighbours on both sides share most of the key prefix and must not leak
+    // into the scan.
+    uint160 addr(1000), addrBefore(999), addrAfter(1001);
+    for (int i = 0; i < nEntries; i++)
+    {
+        BOOST_CHECK(txdb.WriteAddrIndex(addr, vHeights[i], uint256(vHeights[i])));
+        BOOST_CHECK(txdb.WriteAddrIndex(addrBefore, vHeights[i], uint256(1)));
+        BOOST_CHECK(txdb.WriteAddrIndex(addrAfter, vHeights[i], uint256(2)));
+    }
+
+    // Forward paging from the oldest entry
+    CheckRead(txdb, addr, 0, numeric_limits<int>::max(), Slice(0, nEntries));
+    CheckRead(txdb, addr, 0, 2, Slice(0, 2));
+    CheckRead(txdb, addr, 2, 2, Slice(2, 4));
+    CheckRead(txdb, addr, 4, 100, Slice(4, nEntries));
+    CheckRead(txdb, addr, nEntries, 100, Slice(0, 0));
+    CheckRead(txdb, addr, nEntries + 10, 100, Slice(0, 0));
+
+    // Negative skip counts back from the newest entry
+    CheckRead(txdb, addr, -1, 100, Slice(nEntries - 1, nEntries));
+    CheckRead(txdb, addr, -3, 100, Slice(nEntries - 3, nEntries));
+    CheckRead(txdb, addr, -3, 2, Slice(nEntries - 3, nEntries - 1));
+    CheckRead(txdb, addr, -nEntries - 10, 100, Slice(0, nEntries));
+
+    // A non-positive count returns nothing
+    CheckRead(txdb, addr, 0, 0, Slice(0, 0));
+    CheckRead(txdb, addr, -2, -1, Slice(0, 0));
+
+    // Unknown addresses are empty, not an error
+    CheckRead(txdb, uint160(5), 0, 100, Slice(0, 0));
+
+    // Erasing one entry closes the gap in the page
+    BOOST_CHECK(txdb.EraseAddrIndex(addr, 300, uint256(300)));
+    vector<uint256> vExpected = Slice(0, 2);
+    vExpected.push_back(uint256(65536));
+    CheckRead(txdb, addr, 0, 3, vExpected);
+
+    BOOST_CHECK(txdb.ClearAddrIndex());
+    CheckRead(txdb, addr, 0, 100, Slice(0, 0));
+    CheckRead(txdb, addrBefore, 0, 100, Slice(0, 0));
+}
+
+BOOST_AUTO_TEST_CASE(addrindex_version)
+{
+    CTxDB txdb("r+");
+    int nVersion = -1;
+    BOOST_CHECK(txdb.EraseAddrIndexVersion());
+    BOOST_CHECK(!txdb.ReadAddrIndexVersion(nVersion));
+    BOOST_CHECK_EQUAL(nVersion, 0);
+
+    BOOST_CHECK(txdb.WriteAddrIndexVersion(ADDRINDEX_VERSION));
+    BOOST_CHECK(txdb.ReadAddrIndexVersion(nVersion));
+    BOOST_CHECK_EQUAL(nVersion, ADDRINDEX_VERSION);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -100,6 +100,7 @@ CTxDB::CTxDB(const char* pszMode)
             txdb = pdb = NULL;
             delete activeBatch;
             activeBatch = NULL;
+            mapBatchOverlay.clear();
 
             init_blockindex(options, true); // Remove directory and create new database
             pdb = txdb;
@@ -131,6 +132,7 @@ void CTxDB::Close()
     options.block_cache = NULL;
     delete activeBatch;
     activeBatch = NULL;
+    mapBatchOverlay.clear();
 }
 
 bool CTxDB::TxnBegin()
@@ -146,6 +148,7 @@ bool CTxDB::TxnCommit()
     leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
     delete activeBatch;
     activeBatch = NULL;
+    mapBatchOverlay.clear();
     if (!status.ok()) {
         LogPrintf("LevelDB batch commit failure: %s\n", status.ToString());
         return false;
@@ -153,75 +156,161 @@ bool CTxDB::TxnCommit()
     return true;
 }
 
-class CBatchScanner : public leveldb::WriteBatch::Handler {
-public:
-    std::string needle;
-    bool *deleted;
-    std::string *foundValue;
-    bool foundEntry;
-
-    CBatchScanner() : foundEntry(false) {}
-
-    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = false;
-            *foundValue = value.ToString();
-        }
-    }
-
-    virtual void Delete(const leveldb::Slice& key) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = true;
-        }
-    }
-};
-
 // When performing a read, if we have an active batch we need to check it first
 // before reading from the database, as the rest of the code assumes that once
-// a database transaction begins reads are consistent with it. It would be good
-// to change that assumption in future and avoid the performance hit, though in
-// practice it does not appear to be large.
+// a database transaction begins reads are consistent with it. Every Put/Delete
+// queued in the batch is mirrored in mapBatchOverlay, so this is a single hash
+// lookup rather than a walk over the whole batch.
 bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const {
     assert(activeBatch);
     *deleted = false;
-    CBatchScanner scanner;
-    scanner.needle = key.str();
-    scanner.deleted = deleted;
-    scanner.foundValue = value;
-    leveldb::Status status = activeBatch->Iterate(&scanner);
-    if (!status.ok()) {
-        throw runtime_error(status.ToString());
+    boost::unordered_map<string, pair<bool, string> >::const_iterator mi = mapBatchOverlay.find(key.str());
+    if (mi == mapBatchOverlay.end())
+        return false;
+    if (mi->second.first)
+        *deleted = true;
+    else
+        *value = mi->second.second;
+    return true;
+}
+
+// Address index entries are stored one per (address, height, txid) under the
+// "adrtx" prefix with an empty value, so indexing a transaction is a blind
+// append and all entries of an address are adjacent on disk. The height is
+// serialized big-endian so LevelDB returns them in chain order.
+class CAddrIndexKey
+{
+public:
+    uint160 addrHash;
+    unsigned int nHeight;
+    uint256 txHash;
+
+    CAddrIndexKey(uint160 addrHashIn, int nHeightIn, uint256 txHashIn) :
+        addrHash(addrHashIn), nHeight(nHeightIn), txHash(txHashIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return ::GetSerializeSize(string("adrtx"), nType, nVersion) + sizeof(addrHash) + 4 + sizeof(txHash);
     }
-    return scanner.foundEntry;
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, string("adrtx"), nType, nVersion);
+        ::Serialize(s, addrHash, nType, nVersion);
+        unsigned char heightBE[4] = { (unsigned char)(nHeight >> 24), (unsigned char)(nHeight >> 16),
+                                      (unsigned char)(nHeight >> 8), (unsigned char)nHeight };
+        s.write((const char*)heightBE, sizeof(heightBE));
+        ::Serialize(s, txHash, nType, nVersion);
+    }
+};
+
+static string AddrIndexPrefix(uint160 addrHash)
+{
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << make_pair(string("adrtx"), addrHash);
+    return ssPrefix.str();
 }
 
-bool CTxDB::WriteAddrIndex(uint160 addrHash, uint256 txHash)
+bool CTxDB::WriteAddrIndex(uint160 addrHash, int nHeight, uint256 txHash)
 {
-    std::vector<uint256> txHashes;
-    if(!ReadAddrIndex(addrHash, txHashes))
+    return Write(CAddrIndexKey(addrHash, nHeight, txHash), '\0');
+}
+
+bool CTxDB::EraseAddrIndex(uint160 addrHash, int nHeight, uint256 txHash)
+{
+    return Erase(CAddrIndexKey(addrHash, nHeight, txHash));
+}
+
+// Returns the txids indexed for addrHash in chain order. Entries are read with
+// a prefix range scan: a non-negative nSkip skips that many of the oldest
+// entries, a negative one starts that many entries back from the newest, and
+// at most nCount hashes are returned. Pending batch writes are not visible.
+bool CTxDB::ReadAddrIndex(uint160 addrHash, std::vector<uint256>& txHashes, int nSkip, int nCount)
+{
+    txHashes.clear();
+    if (nCount <= 0)
+        return true;
+
+    const string strPrefix = AddrIndexPrefix(addrHash);
+    const size_t nHashOffset = strPrefix.size() + 4;
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+
+    if (nSkip >= 0)
     {
-	txHashes.push_back(txHash);
-        return Write(make_pair(string("adr"), addrHash), txHashes);
+        for (iterator->Seek(strPrefix); iterator->Valid() && (int)txHashes.size() < nCount; iterator->Next())
+        {
+            leveldb::Slice key = iterator->key();
+            if (!key.starts_with(strPrefix) || key.size() != nHashOffset + sizeof(uint256))
+                break;
+            if (nSkip > 0)
+            {
+                nSkip--;
+                continue;
+            }
+            uint256 txHash;
+            memcpy(txHash.begin(), key.data() + nHashOffset, sizeof(uint256));
+            txHashes.push_back(txHash);
+        }
     }
     else
     {
-	if(std::find(txHashes.begin(), txHashes.end(), txHash) == txHashes.end()) 
-    	{
-    	    txHashes.push_back(txHash);
-            return Write(make_pair(string("adr"), addrHash), txHashes);
-	}
-	else
-	{
-	    return true; // already have this tx hash
-	}
+        // Walk backwards from the last entry of this address.
+        iterator->Seek(strPrefix + '\xff');
+        if (iterator->Valid())
+            iterator->Prev();
+        else
+            iterator->SeekToLast();
+        for (; iterator->Valid() && nSkip < 0; iterator->Prev(), nSkip++)
+        {
+            leveldb::Slice key = iterator->key();
+            if (!key.starts_with(strPrefix) || key.size() != nHashOffset + sizeof(uint256))
+                break;
+            uint256 txHash;
+            memcpy(txHash.begin(), key.data() + nHashOffset, sizeof(uint256));
+            txHashes.push_back(txHash);
+        }
+        reverse(txHashes.begin(), txHashes.end());
+        if ((int)txHashes.size() > nCount)
+            txHashes.resize(nCount);
     }
+
+    bool fOk = iterator->status().ok();
+    if (!fOk)
+        LogPrintf("LevelDB address index scan failure: %s\n", iterator->status().ToString());
+    delete iterator;
+    return fOk;
 }
 
-bool CTxDB::ReadAddrIndex(uint160 addrHash, std::vector<uint256>& txHashes)
+// Drops every address index entry, both the per-transaction ones above and the
+// old ("adr", address) -> vector<uint256> records they superseded.
+bool CTxDB::ClearAddrIndex()
 {
-    return Read(make_pair(string("adr"), addrHash), txHashes);
+    const char* pszPrefixes[] = { "adr", "adrtx" };
+    for (unsigned int i = 0; i < sizeof(pszPrefixes) / sizeof(pszPrefixes[0]); i++)
+    {
+        CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+        ssPrefix << string(pszPrefixes[i]);
+        const string strPrefix = ssPrefix.str();
+
+        // Delete in bounded batches; a full index has millions of entries.
+        leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+        iterator->Seek(strPrefix);
+        while (iterator->Valid() && iterator->key().starts_with(strPrefix))
+        {
+            leveldb::WriteBatch batch;
+            for (int n = 0; n < 10000 && iterator->Valid() && iterator->key().starts_with(strPrefix); n++, iterator->Next())
+                batch.Delete(iterator->key());
+            leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
+            if (!status.ok())
+            {
+                delete iterator;
+                return error("ClearAddrIndex() : %s", status.ToString());
+            }
+        }
+        delete iterator;
+    }
+    return true;
 }
 
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
@@ -331,7 +420,7 @@ static CBlockIndex *InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
@@ -345,6 +434,88 @@ static CBlockIndex *InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
+// Block index entries decoded from the "blockindex" keys whose block hash
+// starts with a byte in [nKeyBegin, nKeyEnd). Entries are allocated in
+// chunks and, like everything else in mapBlockIndex, never freed.
+struct CBlockIndexRange
+{
+    unsigned int nKeyBegin;
+    unsigned int nKeyEnd;
+    std::vector<CBlockIndex*> vIndex;
+    std::vector<uint256> vHash;  // block, prev and next hash of each entry
+    std::string strError;
+};
+
+static const unsigned int BLOCK_INDEX_CHUNK_SIZE = 4096;
+
+struct CBlockIndexHeightCompare
+{
+    bool operator()(const CBlockIndex* a, const CBlockIndex* b) const { return a->nHeight < b->nHeight; }
+};
+
+static void ReadBlockIndexRange(leveldb::DB *pdb, CBlockIndexRange *prange)
+{
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << make_pair(string("blockindex"), uint256(prange->nKeyBegin));
+    const string strStartKey = ssStartKey.str();
+    const size_t nPrefixSize = strStartKey.size() - sizeof(uint256);
+
+    // One stream and one CDiskBlockIndex are reused for all records
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    CDiskBlockIndex diskindex;
+    CBlockIndex *pchunk = NULL;
+    unsigned int nChunkUsed = BLOCK_INDEX_CHUNK_SIZE;
+
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    try {
+        for (iterator->Seek(strStartKey); iterator->Valid(); iterator->Next())
+        {
+            // Did we reach the end of the range?
+            leveldb::Slice slKey = iterator->key();
+            if (slKey.size() != strStartKey.size() || memcmp(slKey.data(), strStartKey.data(), nPrefixSize) != 0)
+                break;
+            if ((unsigned char)slKey[nPrefixSize] >= prange->nKeyEnd)
+                break;
+
+            ssValue.clear();
+            ssValue.write(iterator->value().data(), iterator->value().size());
+            ssValue >> diskindex;
+
+            if (nChunkUsed == BLOCK_INDEX_CHUNK_SIZE)
+            {
+                pchunk = new CBlockIndex[BLOCK_INDEX_CHUNK_SIZE];
+                nChunkUsed = 0;
+            }
+            CBlockIndex* pindexNew    = &pchunk[nChunkUsed++];
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nBlockPos      = diskindex.nBlockPos;
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nMint          = diskindex.nMint;
+            pindexNew->nMoneySupply   = diskindex.nMoneySupply;
+            pindexNew->nFlags         = diskindex.nFlags;
+            pindexNew->nStakeModifier = diskindex.nStakeModifier;
+            pindexNew->prevoutStake   = diskindex.prevoutStake;
+            pindexNew->nStakeTime     = diskindex.nStakeTime;
+            pindexNew->hashProof      = diskindex.hashProof;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+
+            // Hashing the header is the expensive part when -fastindex
+            // doesn't apply, which is why the ranges are read in parallel
+            prange->vIndex.push_back(pindexNew);
+            prange->vHash.push_back(diskindex.GetBlockHash());
+            prange->vHash.push_back(diskindex.hashPrev);
+            prange->vHash.push_back(diskindex.hashNext);
+        }
+    } catch (std::exception &e) {
+        prange->strError = e.what();
+    }
+    delete iterator;
+}
+
 bool CTxDB::LoadBlockIndex()
 {
     if (mapBlockIndex.size() > 0) {
@@ -355,83 +526,92 @@ bool CTxDB::LoadBlockIndex()
     // The block index is an in-memory structure that maps hashes to on-disk
     // locations where the contents of the block can be found. Here, we scan it
     // out of the DB and into mapBlockIndex.
-    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
-    // Seek to start key.
-    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
-    ssStartKey << make_pair(string("blockindex"), uint256(0));
-    iterator->Seek(ssStartKey.str());
-    // Now read each entry.
-    while (iterator->Valid())
+    int64_t nStart = GetTimeMillis();
+
+    // Decode the records on several threads, each one reading the keys of a
+    // range of block hashes
+    int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), 8));
+    vector<CBlockIndexRange> vRanges(nThreads);
+    for (int i = 0; i < nThreads; i++)
     {
-        boost::this_thread::interruption_point();
-        // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
-        string strType;
-        ssKey >> strType;
-        // Did we reach the end of the data to read?
-        if (strType != "blockindex")
-            break;
-        CDiskBlockIndex diskindex;
-        ssValue >> diskindex;
-
-        uint256 blockHash = diskindex.GetBlockHash();
-
-        // Construct block index object
-        CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
-        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-        pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
-        pindexNew->nFile          = diskindex.nFile;
-        pindexNew->nBlockPos      = diskindex.nBlockPos;
-        pindexNew->nHeight        = diskindex.nHeight;
-        pindexNew->nMint          = diskindex.nMint;
-        pindexNew->nMoneySupply   = diskindex.nMoneySupply;
-        pindexNew->nFlags         = diskindex.nFlags;
-        pindexNew->nStakeModifier = diskindex.nStakeModifier;
-        pindexNew->prevoutStake   = diskindex.prevoutStake;
-        pindexNew->nStakeTime     = diskindex.nStakeTime;
-        pindexNew->hashProof      = diskindex.hashProof;
-        pindexNew->nVersion       = diskindex.nVersion;
-        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-        pindexNew->nTime          = diskindex.nTime;
-        pindexNew->nBits          = diskindex.nBits;
-        pindexNew->nNonce         = diskindex.nNonce;
-
-        // Watch for genesis block
-        if (pindexGenesisBlock == NULL && blockHash == Params().HashGenesisBlock())
-            pindexGenesisBlock = pindexNew;
-
-        if (!pindexNew->CheckIndex()) {
-            delete iterator;
-            return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
-        }
+        vRanges[i].nKeyBegin = 256 * i / nThreads;
+        vRanges[i].nKeyEnd = 256 * (i + 1) / nThreads;
+    }
+    {
+        // The workers use vRanges, so don't leave before they are done
+        boost::this_thread::disable_interruption di;
+        boost::thread_group threadGroupRead;
+        for (int i = 1; i < nThreads; i++)
+            threadGroupRead.create_thread(boost::bind(&ReadBlockIndexRange, pdb, &vRanges[i]));
+        ReadBlockIndexRange(pdb, &vRanges[0]);
+        threadGroupRead.join_all();
+    }
+    boost::this_thread::interruption_point();
+
+    size_t nEntries = 0;
+    BOOST_FOREACH(const CBlockIndexRange& range, vRanges)
+    {
+        if (!range.strError.empty())
+            return error("LoadBlockIndex() : deserialize error: %s", range.strError);
+        nEntries += range.vIndex.size();
+    }
+    LogPrintf("LoadBlockIndex(): read %u entries on %d threads  %15dms\n", nEntries, nThreads, GetTimeMillis() - nStart);
+    nStart = GetTimeMillis();
+
+    // Construct block index objects: register every entry first, so linking
+    // them up afterwards only needs lookups
+    mapBlockIndex.rehash(nEntries + nEntries / 4);
+    BOOST_FOREACH(const CBlockIndexRange& range, vRanges)
+    {
+        for (unsigned int i = 0; i < range.vIndex.size(); i++)
+        {
+            CBlockIndex* pindexNew = range.vIndex[i];
+            const uint256& blockHash = range.vHash[3 * i];
+            pair<BlockMap::iterator, bool> ret = mapBlockIndex.insert(make_pair(blockHash, pindexNew));
+            if (!ret.second)
+            {
+                LogPrintf("LoadBlockIndex() : ignoring duplicate block index entry %s\n", blockHash.ToString());
+                continue;
+            }
+            pindexNew->phashBlock = &((*ret.first).first);
 
-        // NovaCoin: build setStakeSeen
-        if (pindexNew->IsProofOfStake())
-            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+            // Watch for genesis block
+            if (pindexGenesisBlock == NULL && blockHash == Params().HashGenesisBlock())
+                pindexGenesisBlock = pindexNew;
 
-        iterator->Next();
+            if (!pindexNew->CheckIndex())
+                return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+
+            // NovaCoin: build setStakeSeen
+            if (pindexNew->IsProofOfStake())
+                setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+        }
     }
-    delete iterator;
+    vector<CBlockIndex*> vSortedByHeight;
+    vSortedByHeight.reserve(nEntries);
+    BOOST_FOREACH(const CBlockIndexRange& range, vRanges)
+    {
+        for (unsigned int i = 0; i < range.vIndex.size(); i++)
+        {
+            CBlockIndex* pindex = range.vIndex[i];
+            if (pindex->phashBlock == NULL)
+                continue; // duplicate
+            pindex->pprev = InsertBlockIndex(range.vHash[3 * i + 1]);
+            pindex->pnext = InsertBlockIndex(range.vHash[3 * i + 2]);
+            vSortedByHeight.push_back(pindex);
+        }
+    }
+    vRanges.clear();
+    LogPrintf("LoadBlockIndex(): link block index  %15dms\n", GetTimeMillis() - nStart);
+    nStart = GetTimeMillis();
 
     boost::this_thread::interruption_point();
 
     // Calculate nChainTrust
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
-    {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
-    }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
-    {
-        CBlockIndex* pindex = item.second;
+    sort(vSortedByHeight.begin(), vSortedByHeight.end(), CBlockIndexHeightCompare());
+    BOOST_FOREACH(CBlockIndex* pindex, vSortedByHeight)
         pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
-    }
+    LogPrintf("LoadBlockIndex(): chain trust  %15dms\n", GetTimeMillis() - nStart);
 
     // Load hashBestChain pointer to end of best chain
     if (!ReadHashBestChain(hashBestChain))
@@ -443,6 +623,7 @@ bool CTxDB::LoadBlockIndex()
     if (!mapBlockIndex.count(hashBestChain))
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
+    SetBlockIndexByHeight(pindexBest);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexBest->nChainTrust;
 
@@ -468,6 +649,7 @@ bool CTxDB::LoadBlockIndex()
     if (nCheckDepth > nBestHeight)
         nCheckDepth = nBestHeight;
     LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
+    nStart = GetTimeMillis();
     CBlockIndex* pindexFork = NULL;
     map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
     for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
@@ -576,6 +758,7 @@ bool CTxDB::LoadBlockIndex()
             }
         }
     }
+    LogPrintf("LoadBlockIndex(): verify blocks  %15dms\n", GetTimeMillis() - nStart);
     if (pindexFork)
     {
         boost::this_thread::interruption_point();
@@ -8,10 +8,13 @@
 
 #include "main.h"
 
+#include <limits>
 #include <map>
 #include <string>
 #include <vector>
 
+#include <boost/unordered_map.hpp>
+
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
@@ -46,6 +49,9 @@ private:
     // A batch stores up writes and deletes for atomic application. When this
     // field is non-NULL, writes/deletes go there instead of directly to disk.
     leveldb::WriteBatch *activeBatch;
+    // Hashed mirror of activeBatch so reads inside a transaction don't have
+    // to replay the whole batch. Maps key to (erased, value).
+    boost::unordered_map<std::string, std::pair<bool, std::string> > mapBatchOverlay;
     leveldb::Options options;
     bool fReadOnly;
     int nVersion;
@@ -111,7 +117,12 @@ protected:
         ssValue << value;
 
         if (activeBatch) {
-            activeBatch->Put(ssKey.str(), ssValue.str());
+            std::string strKey = ssKey.str();
+            std::string strValue = ssValue.str();
+            activeBatch->Put(strKey, strValue);
+            std::pair<bool, std::string>& entry = mapBatchOverlay[strKey];
+            entry.first = false;
+            entry.second.swap(strValue);
             return true;
         }
         leveldb::Status status = pdb->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
@@ -134,7 +145,11 @@ protected:
         ssKey.reserve(1000);
         ssKey << key;
         if (activeBatch) {
-            activeBatch->Delete(ssKey.str());
+            std::string strKey = ssKey.str();
+            activeBatch->Delete(strKey);
+            std::pair<bool, std::string>& entry = mapBatchOverlay[strKey];
+            entry.first = true;
+            entry.second.clear();
             return true;
         }
         leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), ssKey.str());
@@ -151,12 +166,10 @@ protected:
 
         if (activeBatch) {
             bool deleted;
-            if (ScanBatch(ssKey, &unused, &deleted) && !deleted) {
-                return true;
-            }
+            if (ScanBatch(ssKey, &unused, &deleted))
+                return !deleted;
         }
 
-
         leveldb::Status status = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &unused);
         return status.IsNotFound() == false;
     }
@@ -169,6 +182,7 @@ public:
     {
         delete activeBatch;
         activeBatch = NULL;
+        mapBatchOverlay.clear();
         return true;
     }
 
@@ -183,8 +197,26 @@ public:
         return Write(std::string("version"), nVersion);
     }
 
-    bool ReadAddrIndex(uint160 addrHash, std::vector<uint256>& txHashes);
-    bool WriteAddrIndex(uint160 addrHash, uint256 txHash);
+    bool ReadAddrIndexVersion(int& nVersion)
+    {
+        nVersion = 0;
+        return Read(std::string("addrindexversion"), nVersion);
+    }
+
+    bool WriteAddrIndexVersion(int nVersion)
+    {
+        return Write(std::string("addrindexversion"), nVersion);
+    }
+
+    bool EraseAddrIndexVersion()
+    {
+        return Erase(std::string("addrindexversion"));
+    }
+
+    bool ReadAddrIndex(uint160 addrHash, std::vector<uint256>& txHashes, int nSkip = 0, int nCount = std::numeric_limits<int>::max());
+    bool WriteAddrIndex(uint160 addrHash, int nHeight, uint256 txHash);
+    bool EraseAddrIndex(uint160 addrHash, int nHeight, uint256 txHash);
+    bool ClearAddrIndex();
     bool ReadTxIndex(uint256 hash, CTxIndex& txindex);
     bool UpdateTxIndex(uint256 hash, const CTxIndex& txindex);
     bool AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight);
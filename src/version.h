@@ -26,6 +26,10 @@ extern const std::string CLIENT_DATE;
 //
 static const int DATABASE_VERSION = 70509;
 
+// address index layout, tracked separately so it can be rebuilt in place
+// without wiping the transaction index
+static const int ADDRINDEX_VERSION = 1;
+
 //
 // network protocol versioning
 //
@@ -6,6 +6,7 @@
 #include "wallet.h"
 
 #include "base58.h"
+#include "checkqueue.h"
 #include "coincontrol.h"
 #include "kernel.h"
 #include "net.h"
@@ -33,6 +34,97 @@ int64_t nTransactionFee = MIN_TX_FEE;
 int64_t nReserveBalance = 0;
 int64_t nMinimumInputValue = 0;
 
+int nStakeThreads = 0;
+
+// Outcome of one kernel search, shared by all threads working on it
+struct CStakeSearchResult
+{
+    CCriticalSection cs;
+    volatile int nStop;    // set once a kernel is found, polled by every search thread
+    bool fFound;
+    unsigned int nIndex;   // candidate the kernel was found for
+    unsigned int nOffset;  // seconds before the search time
+    uint64_t nKernels;     // kernels checked
+
+    CStakeSearchResult() : nStop(0), fFound(false), nIndex(0), nOffset(0), nKernels(0) {}
+
+    bool IsStopped() { return __sync_fetch_and_add(&nStop, 0) != 0; }
+    void Stop() { __sync_lock_test_and_set(&nStop, 1); }
+};
+
+/** Protocol v2 kernel search over the timestamps of one staking coin, queued
+ *  on a CCheckQueue. It only uses the stake modifier of the tip it was
+ *  created for, copied under cs_main, so the search threads never look at
+ *  pindexBest or mapBlockIndex. It fails once any thread found a kernel, so
+ *  the queue skips the candidates that are still pending.
+ */
+class CStakeKernelCheck
+{
+private:
+    uint64_t nStakeModifier;
+    const CKernelInput* pkernel;
+    CStakeSearchResult* presult;
+    unsigned int nBits;
+    unsigned int nTime;
+    unsigned int nInterval;
+    unsigned int nIndex;
+
+public:
+    CStakeKernelCheck() : nStakeModifier(0), pkernel(NULL), presult(NULL), nBits(0), nTime(0), nInterval(0), nIndex(0) {}
+    CStakeKernelCheck(uint64_t nStakeModifierIn, unsigned int nBitsIn, unsigned int nTimeIn, unsigned int nIntervalIn,
+                      const CKernelInput& kernel, unsigned int nIndexIn, CStakeSearchResult& result) :
+        nStakeModifier(nStakeModifierIn), pkernel(&kernel), presult(&result), nBits(nBitsIn), nTime(nTimeIn), nInterval(nIntervalIn), nIndex(nIndexIn) {}
+
+    bool operator()()
+    {
+        unsigned int n = 0;
+        bool fFound = false;
+
+        // Serialize the kernel and weigh the target once for the whole interval
+        CStakeKernelHasher hasher(nStakeModifier, nBits, *pkernel);
+        for (; n < nInterval && !presult->IsStopped(); n++)
+        {
+            if (hasher.CheckKernel(nTime - n))
+            {
+                fFound = true;
+                break;
+            }
+        }
+
+        LOCK(presult->cs);
+        presult->nKernels += fFound ? n + 1 : n;
+        if (fFound && !presult->fFound)
+        {
+            // the first kernel found wins
+            presult->fFound = true;
+            presult->nIndex = nIndex;
+            presult->nOffset = n;
+            presult->Stop();
+        }
+        return !fFound;
+    }
+
+    void swap(CStakeKernelCheck& check)
+    {
+        std::swap(nStakeModifier, check.nStakeModifier);
+        std::swap(pkernel, check.pkernel);
+        std::swap(presult, check.presult);
+        std::swap(nBits, check.nBits);
+        std::swap(nTime, check.nTime);
+        std::swap(nInterval, check.nInterval);
+        std::swap(nIndex, check.nIndex);
+    }
+};
+
+static CCheckQueue<CStakeKernelCheck> stakecheckqueue(128);
+
+void ThreadStakeSearch()
+{
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+    RenameThread("RenosCoin-stake");
+    stakecheckqueue.Thread();
+}
+
 static unsigned int GetStakeSplitAge() { return 9 * 24 * 60 * 60; }
 static int64_t GetStakeCombineThreshold() { return 100 * COIN; }
 
@@ -496,6 +588,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
                     LogPrintf("WalletUpdateSpent found spent coin %s BC %s\n", FormatMoney(wtx.GetCredit()), wtx.GetHash().ToString());
                     wtx.MarkSpent(txin.prevout.n);
                     wtx.WriteToDisk();
+                    UpdateUnspent(wtx);
                     NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                 }
             }
@@ -513,6 +606,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
                 {
                     wtx.MarkUnspent(&txout - &tx.vout[0]);
                     wtx.WriteToDisk();
+                    UpdateUnspent(wtx);
                     NotifyTransactionChanged(this, hash, CT_UPDATED);
                 }
             }
@@ -527,9 +621,28 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        nWalletUpdated++;
     }
 }
 
+// Call whenever wtx is added or its spent flags change
+void CWallet::UpdateUnspent(const CWalletTx& wtx)
+{
+    LOCK(cs_wallet);
+    nWalletUpdated++;
+
+    uint256 hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        if (!wtx.IsSpent(i) && IsMine(wtx.vout[i]) != ISMINE_NO)
+        {
+            mapWalletUnspent[hash] = &wtx;
+            return;
+        }
+    }
+    mapWalletUnspent.erase(hash);
+}
+
 bool CWallet::AddToWallet(const CWalletTx& wtxIn)
 {
     uint256 hash = wtxIn.GetHash();
@@ -540,6 +653,11 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         CWalletTx& wtx = (*ret.first).second;
         wtx.BindWallet(this);
         bool fInsertedNew = ret.second;
+
+        // Cached kernel data of this transaction may be stale now
+        map<COutPoint, CKernelInput>::iterator mk = mapKernelCache.lower_bound(COutPoint(hash, 0));
+        while (mk != mapKernelCache.end() && mk->first.hash == hash)
+            mapKernelCache.erase(mk++);
         if (fInsertedNew)
         {
             wtx.nTimeReceived = GetAdjustedTime();
@@ -642,6 +760,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
                 }
             }
         }
+        UpdateUnspent(wtx);
+
         // since AddToWallet is called directly for self-originating transactions, check for consumption of own coins
         WalletUpdateSpent(wtx, (wtxIn.hashBlock != 0));
 
@@ -714,6 +834,8 @@ void CWallet::EraseFromWallet(const uint256 &hash)
         return;
     {
         LOCK(cs_wallet);
+        mapWalletUnspent.erase(hash);
+        nWalletUpdated++;
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
     }
@@ -1075,6 +1197,7 @@ void CWallet::ReacceptWalletTransactions()
                     LogPrintf("ReacceptWalletTransactions found spent coin %s BC %s\n", FormatMoney(wtx.GetCredit()), wtx.GetHash().ToString());
                     wtx.MarkDirty();
                     wtx.WriteToDisk();
+                    UpdateUnspent(wtx);
                 }
             }
             else
@@ -1179,29 +1302,64 @@ void CWallet::ResendWalletTransactions(bool fForce)
 //
 
 
-int64_t CWallet::GetBalance() const
+// Sum up all balances in one pass over the unspent transactions, unless
+// nothing they depend on changed since the last time
+void CWallet::UpdateBalanceCache() const
 {
-    int64_t nTotal = 0;
+    AssertLockHeld(cs_wallet);
+    unsigned int nTransactionsUpdated = mempool.GetTransactionsUpdated();
+    if (fBalanceCached && hashBalanceBestChain == hashBestChain &&
+        nBalanceTransactionsUpdated == nTransactionsUpdated && nBalanceWalletUpdated == nWalletUpdated)
+        return;
+
+    nBalanceCached = nUnconfirmedBalanceCached = nImmatureBalanceCached = nStakeCached = nNewMintCached = 0;
+    bool fAllFinal = true;
+    for (map<uint256, const CWalletTx*>::const_iterator it = mapWalletUnspent.begin(); it != mapWalletUnspent.end(); ++it)
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        const CWalletTx* pcoin = (*it).second;
+
+        // finality can change with time alone, so don't keep the result then
+        bool fFinal = IsFinalTx(*pcoin);
+        fAllFinal &= fFinal;
+
+        bool fTrusted = pcoin->IsTrusted();
+        if (fTrusted)
+            nBalanceCached += pcoin->GetAvailableCredit();
+        if (!fFinal || (!fTrusted && pcoin->GetDepthInMainChain() == 0))
+            nUnconfirmedBalanceCached += pcoin->GetAvailableCredit();
+
+        if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
+            if (pcoin->IsCoinBase())
+            {
+                nImmatureBalanceCached += GetCredit(*pcoin);
+                nNewMintCached += GetCredit(*pcoin);
+            }
+            else
+                nStakeCached += GetCredit(*pcoin);
         }
     }
 
-    return nTotal;
+    fBalanceCached = fAllFinal;
+    hashBalanceBestChain = hashBestChain;
+    nBalanceTransactionsUpdated = nTransactionsUpdated;
+    nBalanceWalletUpdated = nWalletUpdated;
+}
+
+int64_t CWallet::GetBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalanceCache();
+    return nBalanceCached;
 }
 
 int64_t CWallet::GetBalanceNoLocks() const
 {
     int64_t nTotal = 0;
     {
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (map<uint256, const CWalletTx*>::const_iterator it = mapWalletUnspent.begin(); it != mapWalletUnspent.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableCredit();
         }
@@ -1359,32 +1517,16 @@ CAmount CWallet::GetDenominatedBalance(bool onlyDenom, bool onlyUnconfirmed) con
 
 int64_t CWallet::GetUnconfirmedBalance() const
 {
-    int64_t nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalanceCache();
+    return nUnconfirmedBalanceCached;
 }
 
 int64_t CWallet::GetImmatureBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx& pcoin = (*it).second;
-            if (pcoin.IsCoinBase() && pcoin.GetBlocksToMaturity() > 0 && pcoin.IsInMainChain())
-                nTotal += GetCredit(pcoin);
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalanceCache();
+    return nImmatureBalanceCached;
 }
 
 
@@ -1395,9 +1537,9 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (map<uint256, const CWalletTx*>::const_iterator it = mapWalletUnspent.begin(); it != mapWalletUnspent.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
 
             if (!IsFinalTx(*pcoin))
                 continue;
@@ -1461,9 +1603,9 @@ void CWallet::AvailableCoinsMN(vector<COutput>& vCoins, bool fOnlyConfirmed, con
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (map<uint256, const CWalletTx*>::const_iterator it = mapWalletUnspent.begin(); it != mapWalletUnspent.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
 
             if (!IsFinalTx(*pcoin))
                 continue;
@@ -1529,9 +1671,9 @@ void CWallet::AvailableCoinsForStaking(vector<COutput>& vCoins, unsigned int nSp
     {
         LOCK2(cs_main, cs_wallet);
         int nStakeMinConfirmations = 1440;
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (map<uint256, const CWalletTx*>::const_iterator it = mapWalletUnspent.begin(); it != mapWalletUnspent.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
 
             int nDepth = pcoin->GetDepthInMainChain();
             if (nDepth < 1)
@@ -1632,28 +1774,16 @@ static void ApproximateBestSubset(vector<pair<int64_t, pair<const CWalletTx*,uns
 // ppcoin: total coins staked (non-spendable until maturity)
 int64_t CWallet::GetStake() const
 {
-    int64_t nTotal = 0;
     LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    UpdateBalanceCache();
+    return nStakeCached;
 }
 
 int64_t CWallet::GetNewMint() const
 {
-    int64_t nTotal = 0;
     LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    UpdateBalanceCache();
+    return nNewMintCached;
 }
 
 struct LargerOrEqualThanThreshold
@@ -3364,7 +3494,15 @@ uint64_t CWallet::GetStakeWeight() const
 
 bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, int64_t nFees, CTransaction& txNew, CKey& key)
 {
-    CBlockIndex* pindexPrev = pindexBest;
+    // Everything the kernel search needs from the tip is copied here, under
+    // cs_main, before any search thread runs
+    CBlockIndex* pindexPrev;
+    uint64_t nStakeModifier;
+    {
+        LOCK(cs_main);
+        pindexPrev = pindexBest;
+        nStakeModifier = pindexPrev->nStakeModifier;
+    }
     CBigNum bnTargetPerCoinDay;
     bnTargetPerCoinDay.SetCompact(nBits);
 
@@ -3394,85 +3532,155 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (setCoins.empty())
         return false;
 
-    int64_t nCredit = 0;
-    CScript scriptPubKeyKernel;
-    CTxDB txdb("r");
-    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+    // Look up the kernel inputs of the selected coins, reading only the ones
+    // not cached yet for this tip from disk
+    vector<pair<CKernelInput, pair<const CWalletTx*, unsigned int> > > vKernels;
     {
-        static int nMaxStakeSearchInterval = 60;
-        bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64_t)nMaxStakeSearchInterval) && !fKernelFound && pindexPrev == pindexBest; n++)
+        LOCK(cs_wallet);
+        if (hashKernelCacheBest != pindexPrev->GetBlockHash())
+        {
+            mapKernelCache.clear();
+            hashKernelCacheBest = pindexPrev->GetBlockHash();
+        }
+
+        CTxDB txdb("r");
+        vKernels.reserve(setCoins.size());
+        BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
         {
-            boost::this_thread::interruption_point();
-            // Search backward in time from the given txNew timestamp 
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
             COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            int64_t nBlockTime;
-            if (CheckKernel(pindexPrev, nBits, txNew.nTime - n, prevoutStake, &nBlockTime))
+            map<COutPoint, CKernelInput>::iterator mk = mapKernelCache.find(prevoutStake);
+            if (mk == mapKernelCache.end())
             {
-                // Found a kernel
-                LogPrint("coinstake", "CreateCoinStake : kernel found\n");
-                vector<valtype> vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
-                    break;
-                }
-                LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-                {
-                    LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
-                }
-                if (whichType == TX_PUBKEYHASH) // pay to address type
+                CKernelInput kernel;
+                if (!GetKernelInput(txdb, prevoutStake, kernel))
+                    continue;
+                mk = mapKernelCache.insert(make_pair(prevoutStake, kernel)).first;
+            }
+            vKernels.push_back(make_pair(mk->second, pcoin));
+        }
+    }
+
+    int64_t nCredit = 0;
+    CScript scriptPubKeyKernel;
+    static int nMaxStakeSearchInterval = 60;
+    unsigned int nInterval = min(nSearchInterval, (int64_t)nMaxStakeSearchInterval);
+    int64_t nSearchStart = GetTimeMicros();
+    uint64_t nKernels = 0;
+    unsigned int nStart = 0;
+    while (nStart < vKernels.size() && pindexPrev == pindexBest)
+    {
+        boost::this_thread::interruption_point();
+
+        // Search backward in time from the given txNew timestamp, nInterval
+        // seconds for every candidate, spreading the candidates over the
+        // stake search threads
+        CStakeSearchResult result;
+        if (!IsProtocolV2(pindexPrev->nHeight+1))
+        {
+            // v1 kernels look up their stake modifier in mapBlockIndex, so
+            // they are only searched here, under cs_main
+            LOCK(cs_main);
+            for (unsigned int i = nStart; i < vKernels.size() && !result.fFound; i++)
+            {
+                for (unsigned int n = 0; n < nInterval; n++)
                 {
-                    // convert to pay to public key type
-                    if (!keystore.GetKey(uint160(vSolutions[0]), key))
+                    result.nKernels++;
+                    if (CheckKernel(pindexPrev, nBits, txNew.nTime - n, vKernels[i].first))
                     {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
+                        result.fFound = true;
+                        result.nIndex = i;
+                        result.nOffset = n;
+                        break;
                     }
-                    scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
                 }
-                if (whichType == TX_PUBKEY)
+            }
+        }
+        else
+        {
+            CCheckQueueControl<CStakeKernelCheck> control(nStakeThreads ? &stakecheckqueue : NULL);
+            vector<CStakeKernelCheck> vChecks;
+            vChecks.reserve(vKernels.size() - nStart);
+            for (unsigned int i = nStart; i < vKernels.size(); i++)
+            {
+                CStakeKernelCheck check(nStakeModifier, nBits, txNew.nTime, nInterval, vKernels[i].first, i, result);
+                if (!nStakeThreads)
                 {
-                    valtype& vchPubKey = vSolutions[0];
-                    if (!keystore.GetKey(Hash160(vchPubKey), key))
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-
-                    if (key.GetPubKey() != vchPubKey)
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
-                        break; // keys mismatch
-                    }
-
-                    scriptPubKeyOut = scriptPubKeyKernel;
+                    if (!check())
+                        break;
                 }
+                else
+                    vChecks.push_back(check);
+            }
+            control.Add(vChecks);
+            control.Wait();
+        }
+        nKernels += result.nKernels;
+        if (!result.fFound)
+            break;
 
-                txNew.nTime -= n;
-                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-                nCredit += pcoin.first->vout[pcoin.second].nValue;
-                vwtxPrev.push_back(pcoin.first);
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+        // Found a kernel
+        const pair<const CWalletTx*, unsigned int>& pcoin = vKernels[result.nIndex].second;
+        nStart = result.nIndex + 1; // keep searching after it if it turns out unusable
+        LogPrint("coinstake", "CreateCoinStake : kernel found\n");
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        CScript scriptPubKeyOut;
+        scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
+        if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
+        {
+            LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
+            continue;
+        }
+        LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
+        if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+        {
+            LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
+            continue;  // only support pay to public key and pay to address
+        }
+        if (whichType == TX_PUBKEYHASH) // pay to address type
+        {
+            // convert to pay to public key type
+            if (!keystore.GetKey(uint160(vSolutions[0]), key))
+            {
+                LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                continue;  // unable to find corresponding public key
+            }
+            scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
+        }
+        if (whichType == TX_PUBKEY)
+        {
+            valtype& vchPubKey = vSolutions[0];
+            if (!keystore.GetKey(Hash160(vchPubKey), key))
+            {
+                LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                continue;  // unable to find corresponding public key
+            }
 
-                if(nCredit > 100 * COIN)
-                    txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
-                LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
+            if (key.GetPubKey() != vchPubKey)
+            {
+                LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
+                continue; // keys mismatch
             }
+
+            scriptPubKeyOut = scriptPubKeyKernel;
         }
 
-        if (fKernelFound)
-            break; // if kernel is found stop searching
+        txNew.nTime -= result.nOffset;
+        txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
+        nCredit += pcoin.first->vout[pcoin.second].nValue;
+        vwtxPrev.push_back(pcoin.first);
+        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+
+        if(nCredit > 100 * COIN)
+            txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
+        LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
+        break; // if kernel is found stop searching
     }
 
+    nLastCoinStakeSearchDuration = GetTimeMicros() - nSearchStart;
+    nLastCoinStakeSearchKernels = nKernels;
+    LogPrint("bench", "- Stake search: %u candidates, %u kernels in %.2fms\n", vKernels.size(), nKernels, nLastCoinStakeSearchDuration * 0.001);
+
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
         return false;
 
@@ -3647,6 +3855,7 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
                 coin.WriteToDisk();
+                UpdateUnspent(coin);
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
 
@@ -3915,6 +4124,13 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         return nLoadWalletRet;
     fFirstRunRet = !vchDefaultKey.IsValid();
 
+    {
+        LOCK(cs_wallet);
+        mapWalletUnspent.clear();
+        BOOST_FOREACH(const PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+            UpdateUnspent(item.second);
+    }
+
     return DB_LOAD_OK;
 }
 
@@ -4269,6 +4485,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, bo
                 {
                     pcoin->MarkUnspent(n);
                     pcoin->WriteToDisk();
+                    UpdateUnspent(*pcoin);
                 }
             }
             else if (IsMine(pcoin->vout[n]) && !pcoin->IsSpent(n) && (txindex.vSpent.size() > n && !txindex.vSpent[n].IsNull()))
@@ -4281,6 +4498,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, bo
                 {
                     pcoin->MarkSpent(n);
                     pcoin->WriteToDisk();
+                    UpdateUnspent(*pcoin);
                 }
             }
         }
@@ -4304,6 +4522,7 @@ void CWallet::DisableTransaction(const CTransaction &tx)
             {
                 prev.MarkUnspent(txin.prevout.n);
                 prev.WriteToDisk();
+                UpdateUnspent(prev);
             }
         }
     }
@@ -4444,7 +4663,7 @@ void CWallet::GetKeyBirthTimes(std::map<CKeyID, int64_t> &mapKeyBirth) const {
     for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); it++) {
         // iterate over all wallet transactions...
         const CWalletTx &wtx = (*it).second;
-        std::map<uint256, CBlockIndex*>::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
+        BlockMap::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
         if (blit != mapBlockIndex.end() && blit->second->IsInMainChain()) {
             // ... which are already in a block
             int nHeight = blit->second->nHeight;
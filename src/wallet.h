@@ -14,6 +14,7 @@
 
 #include "crypter.h"
 #include "main.h"
+#include "kernel.h"
 #include "key.h"
 #include "keystore.h"
 #include "script.h"
@@ -27,6 +28,13 @@ extern int64_t nReserveBalance;
 extern int64_t nMinimumInputValue;
 extern bool fWalletUnlockStakingOnly;
 extern bool fConfChange;
+extern int nStakeThreads;
+
+/** Maximum number of stake search threads */
+static const int MAX_STAKE_THREADS = 16;
+
+/** Run an instance of the stake search thread */
+void ThreadStakeSearch();
 
 class CAccountingEntry;
 class CCoinControl;
@@ -111,6 +119,17 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
+    // Balances summed over mapWalletUnspent. They stay valid while the
+    // wallet, the best chain and the memory pool are unchanged.
+    mutable bool fBalanceCached;
+    mutable uint256 hashBalanceBestChain;
+    mutable unsigned int nBalanceTransactionsUpdated;
+    mutable unsigned int nBalanceWalletUpdated;
+    mutable int64_t nBalanceCached, nUnconfirmedBalanceCached, nImmatureBalanceCached, nStakeCached, nNewMintCached;
+    unsigned int nWalletUpdated;
+
+    void UpdateBalanceCache() const;
+
 public:
     /// Main wallet lock.
     /// This lock protects all the fields added by CWallet
@@ -176,9 +195,14 @@ public:
         nTimeFirstKey = 0;
         nLastFilteredHeight = 0;
         fWalletUnlockAnonymizeOnly = false;
+        fBalanceCached = false;
+        nWalletUpdated = 0;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
+    // Transactions with at least one output that is ours and not spent,
+    // which is all the balance and coin selection queries have to look at
+    std::map<uint256, const CWalletTx*> mapWalletUnspent;
     int64_t nOrderPosNext;
     std::map<uint256, int> mapRequestCount;
 
@@ -190,6 +214,13 @@ public:
 
     int64_t nTimeFirstKey;
 
+    // Kernel inputs of staking coins, so CreateCoinStake can hash candidate
+    // timestamps without re-reading every coin from disk. Only valid for the
+    // tip in hashKernelCacheBest; entries of a transaction are dropped when
+    // it is updated in the wallet.
+    std::map<COutPoint, CKernelInput> mapKernelCache;
+    uint256 hashKernelCacheBest;
+
     // check whether we are allowed to upgrade (or already support) to the named feature
     bool CanSupportFeature(enum WalletFeature wf) { AssertLockHeld(cs_wallet); return nWalletMaxVersion >= wf; }
 
@@ -250,6 +281,7 @@ public:
     TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
 
     void MarkDirty();
+    void UpdateUnspent(const CWalletTx& wtx);
     bool AddToWallet(const CWalletTx& wtxIn);
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock, bool fConnect = true);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);